@@ -0,0 +1,431 @@
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <disk.h>
+#include <fat_scan.h>
+#include <fs.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define bench_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	bench_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define FAT_EOC 0xFFFF
+
+/* Largest FAT the on-disk format can describe */
+#define FAT_MAX_ENTRIES 65535
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Keep results alive so that the scans are not optimised away */
+static volatile size_t sink;
+
+/*
+ * FAT benchmark
+ */
+
+enum fatPattern {
+	PATTERN_EMPTY,
+	PATTERN_PACKED,
+	PATTERN_FRAGMENTED,
+	PATTERN_FULL,
+};
+
+static const char *pattern_names[] = {
+	[PATTERN_EMPTY] = "empty",
+	[PATTERN_PACKED] = "packed",
+	[PATTERN_FRAGMENTED] = "fragmented",
+	[PATTERN_FULL] = "full",
+};
+
+/* Fill @fat with chains laid out according to @pattern */
+static void fat_fill(uint16_t *fat, size_t n, enum fatPattern pattern)
+{
+	uint16_t prev = 0;
+
+	memset(fat, 0, n * sizeof(*fat));
+	srand(150);
+	for (size_t i = 1; i < n; i++) {
+		bool used;
+		switch (pattern) {
+		case PATTERN_EMPTY:
+			used = false;
+			break;
+		case PATTERN_PACKED:
+			used = i < n * 9 / 10;
+			break;
+		case PATTERN_FRAGMENTED:
+			used = rand() % 2;
+			break;
+		default:
+			used = i < n - 1;
+			break;
+		}
+		if (used) {
+			fat[i] = FAT_EOC;
+			if (prev) {
+				fat[prev] = i;
+			}
+			prev = i;
+		}
+	}
+	fat[0] = FAT_EOC;
+}
+
+static void bench_fat(int argc, char **argv)
+{
+	size_t n = FAT_MAX_ENTRIES;
+	int reps = 2000;
+	size_t count;
+
+	if (argc > 0) {
+		n = strtoul(argv[0], NULL, 0);
+	}
+	if (argc > 1) {
+		reps = atoi(argv[1]);
+	}
+	if (n < 2 || n > FAT_MAX_ENTRIES || reps < 1) {
+		die("Usage: fat [<entries> [<repetitions>]]");
+	}
+
+	uint16_t *fat = malloc(n * sizeof(*fat));
+	if (!fat) {
+		die("Cannot malloc");
+	}
+
+	const struct fatKernels *const *kernels = fat_kernels_list(&count);
+
+	printf("FAT scan: %zu entries, %d repetitions, best kernels '%s'\n",
+	       n, reps, fat_kernels()->name);
+	printf("%-11s %-7s %12s %12s %12s %12s\n", "pattern", "kernels",
+	       "count_ns", "find_ns", "run16_ns", "validate_ns");
+
+	for (size_t p = 0; p < ARRAY_SIZE(pattern_names); p++) {
+		fat_fill(fat, n, p);
+
+		/* Scalar results are the reference for the vector kernels */
+		const struct fatKernels *ref = &fat_kernels_scalar;
+		size_t want[4] = {
+			ref->count_free(fat, n),
+			ref->find_free(fat, 0, n),
+			fat_find_free_run(ref, fat, 0, n, 16),
+			ref->validate(fat, n, FAT_EOC),
+		};
+
+		for (size_t k = 0; k < count; k++) {
+			const struct fatKernels *kern = kernels[k];
+			double ns[4];
+			double start;
+
+			start = now();
+			for (int r = 0; r < reps; r++) {
+				sink = kern->count_free(fat, n);
+			}
+			ns[0] = (now() - start) * 1e9 / reps;
+			if (sink != want[0]) {
+				die("%s: count_free mismatch", kern->name);
+			}
+
+			start = now();
+			for (int r = 0; r < reps; r++) {
+				sink = kern->find_free(fat, 0, n);
+			}
+			ns[1] = (now() - start) * 1e9 / reps;
+			if (sink != want[1]) {
+				die("%s: find_free mismatch", kern->name);
+			}
+
+			start = now();
+			for (int r = 0; r < reps; r++) {
+				sink = fat_find_free_run(kern, fat, 0, n, 16);
+			}
+			ns[2] = (now() - start) * 1e9 / reps;
+			if (sink != want[2]) {
+				die("%s: find_free_run mismatch", kern->name);
+			}
+
+			start = now();
+			for (int r = 0; r < reps; r++) {
+				sink = kern->validate(fat, n, FAT_EOC);
+			}
+			ns[3] = (now() - start) * 1e9 / reps;
+			if (sink != want[3]) {
+				die("%s: validate mismatch", kern->name);
+			}
+
+			printf("%-11s %-7s %12.0f %12.0f %12.0f %12.0f\n",
+			       pattern_names[p], kern->name,
+			       ns[0], ns[1], ns[2], ns[3]);
+		}
+	}
+
+	free(fat);
+}
+
+/*
+ * Fragmentation benchmark
+ */
+
+/* Write @nfiles files of @size bytes, interleaved block by block or not */
+static void frag_fill(int nfiles, size_t size, bool interleave, char *buf)
+{
+	int fds[FS_OPEN_MAX_COUNT];
+
+	for (int f = 0; f < nfiles; f++) {
+		char name[FS_FILENAME_LEN];
+		snprintf(name, sizeof(name), "frag%d", f);
+		if (fs_create(name) || (fds[f] = fs_open(name)) < 0)
+			die("Cannot create '%s'", name);
+		if (!interleave && fs_reserve(fds[f], size))
+			die("No space for '%s'", name);
+	}
+
+	/* Interleaving makes first-fit allocation hand out alternating blocks */
+	size_t blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	for (size_t i = 0; i < nfiles * blocks; i++) {
+		int f = interleave ? i % nfiles : i / blocks;
+		size_t off = (interleave ? i / nfiles : i % blocks) * BLOCK_SIZE;
+		size_t len = size - off < BLOCK_SIZE ? size - off : BLOCK_SIZE;
+
+		if (fs_write(fds[f], buf, len) != (int)len)
+			die("Short write");
+	}
+
+	for (int f = 0; f < nfiles; f++)
+		fs_close(fds[f]);
+}
+
+/* Read every file back sequentially, return the elapsed time */
+static double frag_read(int nfiles, size_t size, char *buf)
+{
+	double start = now();
+
+	for (int f = 0; f < nfiles; f++) {
+		char name[FS_FILENAME_LEN];
+		int fd;
+
+		snprintf(name, sizeof(name), "frag%d", f);
+		if ((fd = fs_open(name)) < 0)
+			die("Cannot open '%s'", name);
+		for (size_t off = 0; off < size; off += BLOCK_SIZE)
+			fs_read(fd, buf, BLOCK_SIZE);
+		fs_close(fd);
+	}
+
+	return now() - start;
+}
+
+static void bench_frag(int argc, char **argv)
+{
+	char diskname[PATH_MAX];
+	const char *spec = "hdd";
+	int nfiles = 4;
+	size_t size = 256 << 10;
+	char *buf;
+
+	if (argc < 1)
+		die("Usage: frag <disk image> [<lat spec> [<files> [<file size>]]]");
+	if (argc > 1)
+		spec = argv[1];
+	if (argc > 2)
+		nfiles = atoi(argv[2]);
+	if (argc > 3)
+		size = strtoul(argv[3], NULL, 0);
+	if (nfiles < 1 || nfiles > FS_OPEN_MAX_COUNT || size == 0)
+		die("Invalid file count or size");
+
+	buf = malloc(BLOCK_SIZE);
+	if (!buf)
+		die("Cannot malloc");
+	memset(buf, 0x5a, BLOCK_SIZE);
+
+	/* Work on a private RAM copy of the image, behind the latency model */
+	if (snprintf(diskname, sizeof(diskname), "lat:%s:ram:%s", spec,
+		     argv[0]) >= (int)sizeof(diskname))
+		die("Disk name too long");
+
+	printf("Fragmentation: %d files of %zu bytes, medium '%s'\n",
+	       nfiles, size, spec);
+	printf("%-12s %10s %10s\n", "layout", "read_s", "MiB/s");
+
+	for (int interleave = 1; interleave >= 0; interleave--) {
+		if (fs_mount(diskname))
+			die("Cannot mount '%s'", argv[0]);
+		frag_fill(nfiles, size, interleave, buf);
+		double secs = frag_read(nfiles, size, buf);
+		printf("%-12s %10.3f %10.1f\n",
+		       interleave ? "interleaved" : "contiguous", secs,
+		       nfiles * size / secs / (1 << 20));
+		fs_umount();
+	}
+
+	free(buf);
+}
+
+/*
+ * Block size benchmark
+ */
+
+/* Capacity of the scratch images, whatever their block size */
+#define BS_IMAGE_BYTES (32 << 20)
+
+static const struct {
+	const char *name;
+	int nfiles;
+	size_t size;
+} bs_workloads[] = {
+	{ "small",	120,	700 },
+	{ "large",	4,		4 << 20 },
+};
+
+/* Write then read back one workload, return the elapsed times */
+static void bs_run(int w, char *buf, double *write_s, double *read_s,
+		   size_t *alloc)
+{
+	double start = now();
+
+	*alloc = 0;
+	for (int f = 0; f < bs_workloads[w].nfiles; f++) {
+		char name[FS_FILENAME_LEN];
+		int fd;
+
+		snprintf(name, sizeof(name), "bs%d", f);
+		if (fs_create(name) || (fd = fs_open(name)) < 0)
+			die("Cannot create '%s'", name);
+		if (fs_write(fd, buf, bs_workloads[w].size) != (int)bs_workloads[w].size)
+			die("Short write");
+		fs_close(fd);
+		*alloc += fs_map(name, NULL, 0);
+	}
+	*write_s = now() - start;
+
+	start = now();
+	for (int f = 0; f < bs_workloads[w].nfiles; f++) {
+		char name[FS_FILENAME_LEN];
+		int fd;
+
+		snprintf(name, sizeof(name), "bs%d", f);
+		if ((fd = fs_open(name)) < 0)
+			die("Cannot open '%s'", name);
+		if (fs_read(fd, buf, bs_workloads[w].size) != (int)bs_workloads[w].size)
+			die("Short read");
+		fs_close(fd);
+	}
+	*read_s = now() - start;
+}
+
+static void bench_blocksize(int argc, char **argv)
+{
+	char diskname[PATH_MAX];
+	const char *spec = "ssd";
+	size_t max_size = 0;
+	char *buf;
+
+	if (argc < 1)
+		die("Usage: blocksize <scratch image> [<lat spec>]");
+	if (argc > 1)
+		spec = argv[1];
+
+	for (size_t w = 0; w < ARRAY_SIZE(bs_workloads); w++)
+		if (bs_workloads[w].size > max_size)
+			max_size = bs_workloads[w].size;
+	buf = malloc(max_size);
+	if (!buf)
+		die("Cannot malloc");
+	memset(buf, 0x5a, max_size);
+
+	/* Formatted on the host, then used through a RAM copy and the model */
+	if (snprintf(diskname, sizeof(diskname), "lat:%s:ram:%s", spec,
+		     argv[0]) >= (int)sizeof(diskname))
+		die("Disk name too long");
+
+	printf("Block size: %d MiB images, medium '%s'\n", BS_IMAGE_BYTES >> 20,
+	       spec);
+	printf("%-6s %8s %8s %10s %7s %9s %9s %9s\n", "load", "blk_size",
+	       "fat_KiB", "alloc_KiB", "waste%", "write_s", "read_s", "MiB/s");
+
+	for (size_t w = 0; w < ARRAY_SIZE(bs_workloads); w++) {
+		size_t bytes = bs_workloads[w].nfiles * bs_workloads[w].size;
+
+		for (size_t bs = BLOCK_SIZE_MIN; bs <= BLOCK_SIZE_MAX; bs <<= 1) {
+			size_t blocks = BS_IMAGE_BYTES / bs;
+			double write_s, read_s;
+			size_t alloc;
+
+			/* The smallest blocks run into the 16-bit block indices */
+			if (blocks > 60000)
+				blocks = 60000;
+			if (fs_mkfs(argv[0], blocks, bs, 0) < 0)
+				die("Cannot create '%s'", argv[0]);
+			if (fs_mount(diskname))
+				die("Cannot mount '%s'", argv[0]);
+			bs_run(w, buf, &write_s, &read_s, &alloc);
+			fs_umount();
+
+			size_t fat = (blocks + bs / 2 - 1) / (bs / 2) * bs;
+			printf("%-6s %8zu %8zu %10zu %7.1f %9.3f %9.3f %9.1f\n",
+			       bs_workloads[w].name, bs, fat >> 10, alloc * bs >> 10,
+			       100.0 * (alloc * bs - bytes) / (alloc * bs),
+			       write_s, read_s, bytes / read_s / (1 << 20));
+		}
+	}
+
+	free(buf);
+}
+
+static struct {
+	const char *name;
+	void(*func)(int, char **);
+} commands[] = {
+	{ "fat",	bench_fat },
+	{ "frag",	bench_frag },
+	{ "blocksize",	bench_blocksize },
+};
+
+void usage(char *program)
+{
+	size_t i;
+	fprintf(stderr, "Usage: %s <benchmark> [<arg>]\n", program);
+	fprintf(stderr, "Possible benchmarks are:\n");
+	for (i = 0; i < ARRAY_SIZE(commands); i++)
+		fprintf(stderr, "\t%s\n", commands[i].name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	size_t i;
+	char *program = argv[0];
+
+	if (argc == 1)
+		usage(program);
+
+	for (i = 0; i < ARRAY_SIZE(commands); i++) {
+		if (!strcmp(argv[1], commands[i].name)) {
+			commands[i].func(argc - 2, &argv[2]);
+			break;
+		}
+	}
+	if (i == ARRAY_SIZE(commands)) {
+		bench_error("invalid benchmark '%s'", argv[1]);
+		usage(program);
+	}
+
+	return 0;
+}
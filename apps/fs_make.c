@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <disk.h>
+#include <fs.h>
+
+#define make_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	make_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Parse "<bytes>[K|M|G]", return 0 on error */
+static size_t parse_size(const char *str)
+{
+	char *end;
+	size_t size = strtoull(str, &end, 0);
+
+	switch (*end) {
+	case 'G':
+		size <<= 10;
+		/* fallthrough */
+	case 'M':
+		size <<= 10;
+		/* fallthrough */
+	case 'K':
+		size <<= 10;
+		end++;
+		break;
+	}
+
+	return end == str || *end ? 0 : size;
+}
+
+/* Largest data block count whose image fits in @size bytes */
+static size_t blocks_for_size(size_t size, size_t block_size)
+{
+	size_t total = size / block_size;
+	size_t per_fat = block_size / 2;
+	/* The root directory takes 4 KiB, in as many blocks as needed */
+	size_t meta = 1 + (block_size < 4096 ? 4096 / block_size : 1);
+
+	if (total < meta + 2)
+		return 0;
+
+	/* Every FAT block accounts for itself plus the data blocks it maps */
+	size_t data = (total - meta) * per_fat / (per_fat + 1);
+	while (data > 0 && meta + (data + per_fat - 1) / per_fat + data > total)
+		data--;
+
+	return data;
+}
+
+static void usage(void)
+{
+	die("Usage: [-b <block size>] [-s <image size>[K|M|G]] <diskname> "
+	    "[<data block count>]\n"
+	    "       [-b <block size>] -e <diskname>\t(format an existing disk in place)");
+}
+
+int main(int argc, char **argv)
+{
+	size_t count = 0, size = 0, block_size = BLOCK_SIZE;
+	int flags = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:es:")) != -1) {
+		switch (opt) {
+		case 'b':
+			block_size = parse_size(optarg);
+			if (block_size < BLOCK_SIZE_MIN || block_size > BLOCK_SIZE_MAX ||
+			    (block_size & (block_size - 1)))
+				die("block size invalid, must be a power of two in [%d, %d]",
+				    BLOCK_SIZE_MIN, BLOCK_SIZE_MAX);
+			break;
+		case 'e':
+			flags |= FS_MKFS_EXISTING;
+			break;
+		case 's':
+			size = parse_size(optarg);
+			if (size == 0)
+				die("image size invalid");
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (size) {
+		count = blocks_for_size(size, block_size);
+		if (count == 0 || count > FS_DATA_BLOCKS_MAX)
+			die("image size invalid");
+	}
+
+	if (argc < 1 || argc > 2 || (argc == 2 && count))
+		usage();
+	if (argc == 2) {
+		char *end;
+		count = strtoul(argv[1], &end, 0);
+		if (*end || count == 0 || count > FS_DATA_BLOCKS_MAX)
+			die("data block count invalid, range is [1, %d]",
+			    FS_DATA_BLOCKS_MAX);
+	}
+	if (!count && !(flags & FS_MKFS_EXISTING))
+		usage();
+
+	/* An in-place format picks the count from the disk's size */
+	int made = fs_mkfs(argv[0], count, block_size, flags);
+	if (made < 0)
+		die("Cannot create virtual disk");
+
+	printf("Created virtual disk '%s' with '%d' data blocks\n", argv[0],
+	       made);
+
+	return 0;
+}
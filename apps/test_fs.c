@@ -1,14 +1,20 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <ftw.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <disk.h>
 #include <fs.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
@@ -316,6 +322,253 @@ void thread_fs_stat(void *arg)
 	printf("Size of file '%s' is %d bytes\n", filename, stat);
 }
 
+void thread_fs_trim(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int discarded;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	discarded = fs_trim();
+	if (discarded < 0) {
+		fs_umount();
+		die("Cannot trim diskname");
+	}
+
+	printf("Discarded %d free blocks\n", discarded);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_defrag(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_dirent entry, before[FS_FILE_MAX_COUNT];
+	struct fs_dir *dir;
+	char *diskname;
+	size_t budget = SIZE_MAX;
+	int count = 0, moved;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<block budget>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1) {
+		char *end;
+		budget = strtoull(t_arg->argv[1], &end, 0);
+		if (*end || end == t_arg->argv[1])
+			die("Invalid budget '%s'", t_arg->argv[1]);
+	}
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	dir = fs_opendir(NULL);
+	if (!dir) {
+		fs_umount();
+		die("Cannot open root directory");
+	}
+	while (count < FS_FILE_MAX_COUNT && fs_readdir(dir, &before[count]) == 1)
+		count++;
+	fs_closedir(dir);
+
+	moved = fs_defrag(budget);
+	if (moved < 0) {
+		fs_umount();
+		die("Cannot defragment diskname");
+	}
+
+	/* Runs per file, before and after */
+	dir = fs_opendir(NULL);
+	if (!dir) {
+		fs_umount();
+		die("Cannot open root directory");
+	}
+	for (int i = 0; i < count && fs_readdir(dir, &entry) == 1; i++)
+		if (before[i].runs != entry.runs)
+			printf("%s: %zu -> %zu runs\n", entry.name, before[i].runs,
+			       entry.runs);
+	fs_closedir(dir);
+
+	printf("Moved %d blocks\n", moved);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_cp(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *src, *dst;
+	int fd_in, fd_out, copied;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <source file> <new file>");
+
+	diskname = t_arg->argv[0];
+	src = t_arg->argv[1];
+	dst = t_arg->argv[2];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fd_in = fs_open(src);
+	if (fd_in < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+	if (fs_create(dst) || (fd_out = fs_open(dst)) < 0) {
+		fs_umount();
+		die("Cannot create file");
+	}
+
+	copied = fs_stat(fd_in) ? fs_copy_file_range(fd_in, 0, fd_out, 0, fs_stat(fd_in)) : 0;
+
+	fs_close(fd_in);
+	fs_close(fd_out);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Copied file '%s' to '%s' (%d bytes)\n", src, dst, copied);
+}
+
+void thread_fs_clone(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *src, *dst;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <source file> <new file>");
+
+	diskname = t_arg->argv[0];
+	src = t_arg->argv[1];
+	dst = t_arg->argv[2];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_clone(src, dst)) {
+		fs_umount();
+		die("Cannot clone file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Cloned file '%s' to '%s'\n", src, dst);
+}
+
+void thread_fs_snap(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char names[FS_SNAPSHOT_MAX][FS_FILENAME_LEN];
+	char *diskname, *action, *name;
+	int ret;
+
+	if (t_arg->argc < 2 ||
+	    (t_arg->argc < 3 && strcmp(t_arg->argv[1], "list")))
+		die("Usage: <diskname> create|restore|delete <name>\n"
+		    "       <diskname> list");
+
+	diskname = t_arg->argv[0];
+	action = t_arg->argv[1];
+	name = t_arg->argv[2];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (!strcmp(action, "list")) {
+		ret = fs_snapshot_list(names, FS_SNAPSHOT_MAX);
+		for (int i = 0; i < ret; i++)
+			printf("%s\n", names[i]);
+	} else if (!strcmp(action, "create")) {
+		ret = fs_snapshot(name);
+	} else if (!strcmp(action, "restore")) {
+		ret = fs_snapshot_restore(name);
+	} else if (!strcmp(action, "delete")) {
+		ret = fs_snapshot_delete(name);
+	} else {
+		fs_umount();
+		die("Unknown action '%s'", action);
+	}
+	if (ret < 0) {
+		fs_umount();
+		die("Cannot %s snapshot", action);
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_dedup(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int freed;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	freed = fs_dedup();
+	if (freed < 0) {
+		fs_umount();
+		die("Cannot deduplicate diskname");
+	}
+
+	printf("Freed %d duplicate blocks\n", freed);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_pack(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_dirent entry;
+	struct fs_dir *dir;
+	char *diskname;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount_flags(diskname, FS_MOUNT_TAILPACK))
+		die("Cannot mount diskname");
+
+	/* Closing a file is what packs its tail */
+	dir = fs_opendir(NULL);
+	if (!dir) {
+		fs_umount();
+		die("Cannot open root directory");
+	}
+	while (fs_readdir(dir, &entry) == 1) {
+		int fd = fs_open(entry.name);
+		if (fd < 0 || fs_close(fd))
+			die("Cannot pack '%s'", entry.name);
+	}
+	fs_closedir(dir);
+
+	fs_info();
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
 void thread_fs_cat(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -379,12 +632,15 @@ void thread_fs_rm(void *arg)
 	char *diskname, *filename;
 
 	if (t_arg->argc < 2)
-		die("need <diskname> <filename>");
+		die("need <diskname> <filename> [discard]");
 
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
+	if (t_arg->argc > 2 && strcmp(t_arg->argv[2], "discard"))
+		die("Unknown option '%s'", t_arg->argv[2]);
 
-	if (fs_mount(diskname))
+	/* "discard" gives the file's blocks back to the host image */
+	if (fs_mount_flags(diskname, t_arg->argc > 2 ? FS_MOUNT_DISCARD : 0))
 		die("Cannot mount diskname");
 
 	if (fs_delete(filename)) {
@@ -398,10 +654,89 @@ void thread_fs_rm(void *arg)
 	printf("Removed file '%s'\n", filename);
 }
 
+void thread_fs_compress(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+	int enable = 1;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <filename> [off]");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	if (t_arg->argc > 2) {
+		if (strcmp(t_arg->argv[2], "off"))
+			die("Unknown option '%s'", t_arg->argv[2]);
+		enable = 0;
+	}
+
+	if (fs_mount_flags(diskname, FS_MOUNT_COMPRESS))
+		die("Cannot mount diskname");
+
+	if (fs_compress(filename, enable)) {
+		fs_umount();
+		die("Cannot %s file", enable ? "compress" : "decompress");
+	}
+
+	fs_info();
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_fsck(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_fsck_report r;
+	struct timespec start, end;
+	int flags = 0, nthreads = 0, found;
+
+	if (t_arg->argc < 1)
+		die("need <diskname> [repair] [<threads>]");
+
+	for (int i = 1; i < t_arg->argc; i++) {
+		char *end_arg;
+		if (!strcmp(t_arg->argv[i], "repair")) {
+			flags |= FS_FSCK_REPAIR;
+			continue;
+		}
+		nthreads = strtol(t_arg->argv[i], &end_arg, 0);
+		if (*end_arg || nthreads < 1)
+			die("Unknown option '%s'", t_arg->argv[i]);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	found = fs_fsck(t_arg->argv[0], flags, nthreads, &r);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (found < 0)
+		die("Cannot check diskname");
+
+	printf("files=%zu\n", r.files);
+	printf("used_blk_count=%zu\n", r.used_blocks);
+	printf("shared_blk_count=%zu\n", r.shared_blocks);
+	printf("bad_fat_entries=%zu\n", r.bad_fat_entries);
+	printf("bad_snapshots=%zu\n", r.bad_snapshots);
+	printf("bad_entries=%zu\n", r.bad_entries);
+	printf("broken_chains=%zu\n", r.broken_chains);
+	printf("cycles=%zu\n", r.cycles);
+	printf("bad_sizes=%zu\n", r.bad_sizes);
+	printf("bad_tails=%zu\n", r.bad_tails);
+	printf("leaked_blk_count=%zu\n", r.leaked_blocks);
+	printf("bad_summary_count=%zu\n", r.bad_summary);
+	printf("Checked in %.3f ms: %d problem(s)%s\n",
+	       (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6,
+	       found, r.repaired ? ", repaired" : "");
+
+	/* Like fsck(8): non-zero when problems are left on disk */
+	if (found && !r.repaired)
+		exit(1);
+}
+
 void thread_fs_add(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
+	char *diskname, *filename;
 	int fd, fs_fd;
 	struct stat st;
 	int written;
@@ -421,11 +756,6 @@ void thread_fs_add(void *arg)
 	if (!S_ISREG(st.st_mode))
 		die("Not a regular file: %s\n", filename);
 
-	/* Map file into buffer */
-	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (!buf)
-		die_perror("mmap");
-
 	/* Now, deal with our filesystem:
 	 * - mount, create a new file, copy content of host file into this new
 	 *   file, close the new file, and umount
@@ -444,7 +774,8 @@ void thread_fs_add(void *arg)
 		die("Cannot open file");
 	}
 
-	written = fs_write(fs_fd, buf, st.st_size);
+	/* Straight from the host file, without staging it in memory */
+	written = st.st_size ? fs_import_range(fd, 0, fs_fd, 0, st.st_size) : 0;
 
 	if (fs_close(fs_fd)) {
 		fs_umount();
@@ -457,10 +788,381 @@ void thread_fs_add(void *arg)
 	printf("Wrote file '%s' (%d/%zu bytes)\n", filename, written,
 		   st.st_size);
 
-	munmap(buf, st.st_size);
 	close(fd);
 }
 
+/* Bulk import: loader threads map host files while one writer streams them */
+#define IMPORT_QUEUE_DEPTH 16
+#define IMPORT_MAX_THREADS 16
+
+struct import_file {
+	const char *path;
+	char *data;
+	size_t size;
+	int error;
+};
+
+struct import_queue {
+	char **paths;
+	size_t num_paths;
+	size_t next_path;
+	struct import_file files[IMPORT_QUEUE_DEPTH];
+	size_t head;
+	size_t count;
+	pthread_mutex_t lock;
+	pthread_cond_t not_full;
+	pthread_cond_t not_empty;
+};
+
+/* nftw() has no user argument, so the walk collects into these */
+static char **import_paths;
+static size_t import_num_paths;
+
+static void import_add_path(const char *path)
+{
+	import_paths = realloc(import_paths,
+			       (import_num_paths + 1) * sizeof(char *));
+	if (!import_paths)
+		die_perror("realloc");
+	import_paths[import_num_paths++] = strdup(path);
+}
+
+static int import_walk(const char *path, const struct stat *st, int type,
+		       struct FTW *ftw)
+{
+	(void)ftw;
+	if (type == FTW_F && S_ISREG(st->st_mode))
+		import_add_path(path);
+	return 0;
+}
+
+static void *import_loader(void *arg)
+{
+	struct import_queue *q = arg;
+
+	for (;;) {
+		struct import_file file = { 0 };
+		struct stat st;
+		int fd;
+
+		pthread_mutex_lock(&q->lock);
+		if (q->next_path == q->num_paths) {
+			pthread_mutex_unlock(&q->lock);
+			break;
+		}
+		file.path = q->paths[q->next_path++];
+		pthread_mutex_unlock(&q->lock);
+
+		/* Fault the whole file in here, off the writer's path */
+		fd = open(file.path, O_RDONLY);
+		if (fd < 0 || fstat(fd, &st)) {
+			file.error = 1;
+		} else if (st.st_size > 0) {
+			file.size = st.st_size;
+			file.data = mmap(NULL, file.size, PROT_READ,
+					 MAP_PRIVATE | MAP_POPULATE, fd, 0);
+			if (file.data == MAP_FAILED) {
+				file.data = NULL;
+				file.error = 1;
+			}
+		}
+		if (fd >= 0)
+			close(fd);
+
+		pthread_mutex_lock(&q->lock);
+		while (q->count == IMPORT_QUEUE_DEPTH)
+			pthread_cond_wait(&q->not_full, &q->lock);
+		q->files[(q->head + q->count) % IMPORT_QUEUE_DEPTH] = file;
+		q->count++;
+		pthread_cond_signal(&q->not_empty);
+		pthread_mutex_unlock(&q->lock);
+	}
+
+	return NULL;
+}
+
+/* Copy one loaded host file into the mounted FS, return bytes written */
+static long import_one(struct import_file *file)
+{
+	const char *name = strrchr(file->path, '/');
+	int fs_fd, written;
+
+	name = name ? name + 1 : file->path;
+	if (file->error) {
+		test_fs_error("cannot load '%s'", file->path);
+		return -1;
+	}
+	if (fs_create(name)) {
+		test_fs_error("cannot create '%s'", name);
+		return -1;
+	}
+
+	fs_fd = fs_open(name);
+	if (fs_fd < 0) {
+		fs_delete(name);
+		test_fs_error("cannot open '%s'", name);
+		return -1;
+	}
+
+	/* Lay the whole file out in one run before streaming it in */
+	if (fs_reserve(fs_fd, file->size)) {
+		fs_close(fs_fd);
+		fs_delete(name);
+		test_fs_error("no space for '%s'", name);
+		return -1;
+	}
+	written = file->size ? fs_write(fs_fd, file->data, file->size) : 0;
+	fs_close(fs_fd);
+
+	if (written < 0 || (size_t)written != file->size) {
+		fs_delete(name);
+		test_fs_error("short write for '%s'", name);
+		return -1;
+	}
+	return written;
+}
+
+void thread_fs_import(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct import_queue q = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.not_full = PTHREAD_COND_INITIALIZER,
+		.not_empty = PTHREAD_COND_INITIALIZER,
+	};
+	pthread_t threads[IMPORT_MAX_THREADS];
+	char *diskname, *source;
+	int nthreads = 4;
+	size_t imported = 0, skipped = 0, bytes = 0;
+	struct timespec start, end;
+	double secs;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host directory|@list file> [threads]");
+
+	diskname = t_arg->argv[0];
+	source = t_arg->argv[1];
+	if (t_arg->argc > 2)
+		nthreads = atoi(t_arg->argv[2]);
+	if (nthreads < 1 || nthreads > IMPORT_MAX_THREADS)
+		die("thread count must be in [1, %d]", IMPORT_MAX_THREADS);
+
+	/* Gather the host files: a list file, or a whole directory tree */
+	if (source[0] == '@') {
+		FILE *list = fopen(source + 1, "r");
+		char line[PATH_MAX];
+		if (!list)
+			die_perror("fopen");
+		while (fgets(line, sizeof(line), list)) {
+			char *nl = strchr(line, '\n');
+			if (nl)
+				*nl = '\0';
+			if (line[0] != '\0')
+				import_add_path(line);
+		}
+		fclose(list);
+	} else if (nftw(source, import_walk, 64, FTW_PHYS)) {
+		die_perror("nftw");
+	}
+	q.paths = import_paths;
+	q.num_paths = import_num_paths;
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, import_loader, &q))
+			die("Cannot create loader thread");
+
+	for (size_t i = 0; i < q.num_paths; i++) {
+		struct import_file file;
+		long written;
+
+		pthread_mutex_lock(&q.lock);
+		while (q.count == 0)
+			pthread_cond_wait(&q.not_empty, &q.lock);
+		file = q.files[q.head];
+		q.head = (q.head + 1) % IMPORT_QUEUE_DEPTH;
+		q.count--;
+		pthread_cond_signal(&q.not_full);
+		pthread_mutex_unlock(&q.lock);
+
+		written = import_one(&file);
+		if (written < 0) {
+			skipped++;
+		} else {
+			imported++;
+			bytes += written;
+		}
+		if (file.data)
+			munmap(file.data, file.size);
+	}
+
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("Imported %zu files (%zu bytes) in %.3f s, %.1f MiB/s, %zu skipped\n",
+	       imported, bytes, secs, secs > 0 ? bytes / secs / (1 << 20) : 0.0,
+	       skipped);
+
+	for (size_t i = 0; i < import_num_paths; i++)
+		free(import_paths[i]);
+	free(import_paths);
+}
+
+/* Export: one read per data block, in block order across all files */
+struct export_read {
+	uint16_t block;
+	uint16_t file;
+	uint32_t index;
+	uint16_t offset;	// Where the file's bytes start in the block
+};
+
+static int export_cmp(const void *a, const void *b)
+{
+	const struct export_read *ra = a, *rb = b;
+	return (int)ra->block - (int)rb->block;
+}
+
+void thread_fs_export(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *dirname;
+	struct fs_dirent files[FS_FILE_MAX_COUNT];
+	int host_fds[FS_FILE_MAX_COUNT];
+	struct export_read *plan = NULL;
+	size_t num_files = 0, num_reads = 0, bytes = 0, block_size;
+	struct fs_dir *dir;
+	struct timespec start, end;
+	char *buf;
+	double secs;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host directory>");
+
+	diskname = t_arg->argv[0];
+	dirname = t_arg->argv[1];
+
+	if (mkdir(dirname, 0755) && errno != EEXIST)
+		die_perror("mkdir");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* Build the global read plan from every file's block map */
+	dir = fs_opendir(NULL);
+	if (!dir) {
+		fs_umount();
+		die("Cannot open root directory");
+	}
+	while (fs_readdir(dir, &files[num_files]) == 1) {
+		struct fs_dirent *f = &files[num_files];
+		char path[PATH_MAX];
+		uint16_t *blocks;
+		int n;
+
+		if (snprintf(path, sizeof(path), "%s/%s", dirname, f->name) >= PATH_MAX)
+			die("Path too long for '%s'", f->name);
+		host_fds[num_files] = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (host_fds[num_files] < 0 || ftruncate(host_fds[num_files], f->size))
+			die_perror(path);
+
+		/* Compressed files are read through the library, below */
+		if (f->compressed) {
+			num_files++;
+			continue;
+		}
+
+		n = fs_map(f->name, NULL, 0);
+		blocks = malloc((n + 1) * sizeof(*blocks));
+		plan = realloc(plan, (num_reads + n) * sizeof(*plan));
+		if (n < 0 || !blocks || (n && !plan))
+			die("Cannot map '%s'", f->name);
+		fs_map(f->name, blocks, n);
+		for (int i = 0; i < n; i++) {
+			plan[num_reads].block = blocks[i];
+			plan[num_reads].file = num_files;
+			plan[num_reads].index = i;
+			plan[num_reads].offset = 0;
+			num_reads++;
+		}
+		free(blocks);
+
+		/* A packed tail is one more read, usually shared with other files */
+		if (f->tail_block != FS_BLOCK_NONE) {
+			plan = realloc(plan, (num_reads + 1) * sizeof(*plan));
+			if (!plan)
+				die_perror("realloc");
+			plan[num_reads].block = f->tail_block;
+			plan[num_reads].file = num_files;
+			plan[num_reads].index = n;
+			plan[num_reads].offset = f->tail_offset;
+			num_reads++;
+		}
+		num_files++;
+	}
+	fs_closedir(dir);
+
+	qsort(plan, num_reads, sizeof(*plan), export_cmp);
+
+	/* Single pass over the image, scattering each block to its file */
+	block_size = fs_block_size();
+	buf = malloc(block_size);
+	if (!buf)
+		die_perror("malloc");
+	for (size_t i = 0; i < num_reads; i++) {
+		struct export_read *r = &plan[i];
+		struct fs_dirent *f = &files[r->file];
+		off_t offset = (off_t)r->index * block_size;
+		size_t len = f->size - offset < block_size ? f->size - offset : block_size;
+
+		/* Blocks shared between files are only read once */
+		if ((i == 0 || plan[i - 1].block != r->block) &&
+		    fs_read_block(r->block, buf))
+			die("Cannot read block %d", r->block);
+		if (pwrite(host_fds[r->file], buf + r->offset, len, offset) != (ssize_t)len)
+			die_perror("pwrite");
+		bytes += len;
+	}
+	free(buf);
+	free(plan);
+
+	for (size_t i = 0; i < num_files; i++) {
+		struct fs_dirent *f = &files[i];
+		int fd;
+
+		if (f->compressed && f->size) {
+			buf = malloc(f->size);
+			fd = fs_open(f->name);
+			if (!buf || fd < 0 || fs_read(fd, buf, f->size) != (int)f->size)
+				die("Cannot read '%s'", f->name);
+			fs_close(fd);
+			if (pwrite(host_fds[i], buf, f->size, 0) != (ssize_t)f->size)
+				die_perror("pwrite");
+			bytes += f->size;
+			free(buf);
+		}
+		close(host_fds[i]);
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("Exported %zu files (%zu bytes, %zu blocks) in %.3f s, %.1f MiB/s\n",
+	       num_files, bytes, num_reads, secs,
+	       secs > 0 ? bytes / secs / (1 << 20) : 0.0);
+}
+
 void thread_fs_ls(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -514,8 +1216,19 @@ static struct {
 	{ "info",	thread_fs_info },
 	{ "ls",		thread_fs_ls },
 	{ "add",	thread_fs_add },
+	{ "import",	thread_fs_import },
+	{ "export",	thread_fs_export },
 	{ "rm",		thread_fs_rm },
+	{ "compress",	thread_fs_compress },
+	{ "fsck",	thread_fs_fsck },
+	{ "trim",	thread_fs_trim },
+	{ "pack",	thread_fs_pack },
 	{ "cat",	thread_fs_cat },
+	{ "cp",		thread_fs_cp },
+	{ "defrag",	thread_fs_defrag },
+	{ "clone",	thread_fs_clone },
+	{ "snap",	thread_fs_snap },
+	{ "dedup",	thread_fs_dedup },
 	{ "stat",	thread_fs_stat },
 	{ "script",	thread_fs_script }
 };
@@ -0,0 +1,376 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "fs.h"
+
+#define async_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+enum reqState {
+	REQ_FREE = 0,
+	REQ_QUEUED,
+	REQ_RUNNING,
+	REQ_DONE,
+};
+
+enum reqOp {
+	REQ_READ,
+	REQ_WRITE,
+};
+
+struct asyncRequest {
+	enum reqState state;
+	enum reqOp op;
+	int fd;
+	void *buf;
+	size_t count;
+	fs_async_cb_t cb;
+	void *arg;
+	int ret;
+	uint64_t seq;			// Submission order, keeps same-fd requests FIFO
+};
+
+struct asyncContext {
+	bool running;
+	bool stopping;
+	int nthreads;
+	pthread_t threads[FS_ASYNC_MAX_THREADS];
+	pthread_mutex_t lock;
+	pthread_cond_t work;		// Signalled when a request is queued
+	pthread_cond_t done;		// Signalled when a request completes
+	struct asyncRequest reqs[FS_ASYNC_MAX_COUNT];
+	uint64_t nextSeq;
+	int inFlight;
+	/* Completion queue of requests submitted without a callback */
+	int completed[FS_ASYNC_MAX_COUNT];
+	int head;
+	int numCompleted;
+	int eventFd;
+};
+
+static struct asyncContext ctx = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+	.eventFd = -1,
+};
+
+/* Oldest queued request whose file descriptor has nothing running, or -1 */
+static int next_runnable(void)
+{
+	int best = -1;
+
+	for (int i = 0; i < FS_ASYNC_MAX_COUNT; i++) {
+		struct asyncRequest *r = &ctx.reqs[i];
+		if (r->state != REQ_QUEUED) {
+			continue;
+		}
+		if (best != -1 && ctx.reqs[best].seq < r->seq) {
+			continue;
+		}
+
+		/* An older request on the same fd must go first */
+		bool blocked = false;
+		for (int j = 0; j < FS_ASYNC_MAX_COUNT; j++) {
+			struct asyncRequest *o = &ctx.reqs[j];
+			if (o->fd == r->fd && ((o->state == REQ_RUNNING) ||
+			    (o->state == REQ_QUEUED && o->seq < r->seq))) {
+				blocked = true;
+				break;
+			}
+		}
+		if (!blocked) {
+			best = i;
+		}
+	}
+	return best;
+}
+
+/* Unlink @req from the completion queue and release its slot */
+static void reap(int req)
+{
+	uint64_t token;
+
+	for (int i = 0; i < ctx.numCompleted; i++) {
+		int pos = (ctx.head + i) % FS_ASYNC_MAX_COUNT;
+		if (ctx.completed[pos] != req) {
+			continue;
+		}
+		/* Close the gap so the queue keeps completion order */
+		for (int j = i; j > 0; j--) {
+			int to = (ctx.head + j) % FS_ASYNC_MAX_COUNT;
+			int from = (ctx.head + j - 1) % FS_ASYNC_MAX_COUNT;
+			ctx.completed[to] = ctx.completed[from];
+		}
+		ctx.head = (ctx.head + 1) % FS_ASYNC_MAX_COUNT;
+		ctx.numCompleted--;
+		break;
+	}
+
+	if (read(ctx.eventFd, &token, sizeof(token)) < 0) {
+		perror("read");
+	}
+	ctx.reqs[req].state = REQ_FREE;
+	ctx.inFlight--;
+}
+
+static void *worker(void *unused)
+{
+	(void)unused;
+
+	pthread_mutex_lock(&ctx.lock);
+	for (;;) {
+		int req = next_runnable();
+		if (req == -1) {
+			if (ctx.stopping && ctx.inFlight == 0) {
+				break;
+			}
+			pthread_cond_wait(&ctx.work, &ctx.lock);
+			continue;
+		}
+
+		struct asyncRequest *r = &ctx.reqs[req];
+		r->state = REQ_RUNNING;
+		pthread_mutex_unlock(&ctx.lock);
+
+		/* The blocking call itself, serialised by the library lock */
+		int ret;
+		if (r->op == REQ_READ) {
+			ret = fs_read(r->fd, r->buf, r->count);
+		} else {
+			ret = fs_write(r->fd, r->buf, r->count);
+		}
+
+		if (r->cb) {
+			r->cb(req, ret, r->arg);
+		}
+
+		pthread_mutex_lock(&ctx.lock);
+		r->ret = ret;
+		if (r->cb) {
+			r->state = REQ_FREE;
+			ctx.inFlight--;
+		} else {
+			uint64_t token = 1;
+			int tail = (ctx.head + ctx.numCompleted) % FS_ASYNC_MAX_COUNT;
+			ctx.completed[tail] = req;
+			ctx.numCompleted++;
+			r->state = REQ_DONE;
+			if (write(ctx.eventFd, &token, sizeof(token)) < 0) {
+				perror("write");
+			}
+		}
+		/* Requests held back behind this one may now run */
+		pthread_cond_broadcast(&ctx.work);
+		pthread_cond_broadcast(&ctx.done);
+	}
+	pthread_mutex_unlock(&ctx.lock);
+
+	return NULL;
+}
+
+int fs_async_init(int nthreads)
+{
+	if (nthreads < 1 || nthreads > FS_ASYNC_MAX_THREADS) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&ctx.lock);
+	if (ctx.running) {
+		pthread_mutex_unlock(&ctx.lock);
+		async_error("workers already running");
+		return -1;
+	}
+
+	ctx.eventFd = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE | EFD_CLOEXEC);
+	if (ctx.eventFd < 0) {
+		pthread_mutex_unlock(&ctx.lock);
+		perror("eventfd");
+		return -1;
+	}
+
+	ctx.stopping = false;
+	ctx.inFlight = 0;
+	ctx.head = 0;
+	ctx.numCompleted = 0;
+	for (int i = 0; i < FS_ASYNC_MAX_COUNT; i++) {
+		ctx.reqs[i].state = REQ_FREE;
+	}
+
+	for (ctx.nthreads = 0; ctx.nthreads < nthreads; ctx.nthreads++) {
+		if (pthread_create(&ctx.threads[ctx.nthreads], NULL, worker, NULL)) {
+			break;
+		}
+	}
+	ctx.running = true;
+	pthread_mutex_unlock(&ctx.lock);
+
+	if (ctx.nthreads != nthreads) {
+		async_error("cannot create worker threads");
+		fs_async_exit();
+		return -1;
+	}
+
+	return 0;
+}
+
+int fs_async_exit(void)
+{
+	pthread_mutex_lock(&ctx.lock);
+	if (!ctx.running || ctx.stopping) {
+		pthread_mutex_unlock(&ctx.lock);
+		return -1;
+	}
+
+	/* Drop unreaped completions so that the workers can drain */
+	for (int i = 0; i < FS_ASYNC_MAX_COUNT; i++) {
+		if (ctx.reqs[i].state == REQ_DONE) {
+			reap(i);
+		}
+	}
+	ctx.stopping = true;
+	pthread_cond_broadcast(&ctx.work);
+	pthread_cond_broadcast(&ctx.done);
+
+	while (ctx.inFlight > 0) {
+		pthread_cond_wait(&ctx.done, &ctx.lock);
+		for (int i = 0; i < FS_ASYNC_MAX_COUNT; i++) {
+			if (ctx.reqs[i].state == REQ_DONE) {
+				reap(i);
+			}
+		}
+	}
+	pthread_cond_broadcast(&ctx.work);
+	pthread_mutex_unlock(&ctx.lock);
+
+	for (int i = 0; i < ctx.nthreads; i++) {
+		pthread_join(ctx.threads[i], NULL);
+	}
+
+	pthread_mutex_lock(&ctx.lock);
+	close(ctx.eventFd);
+	ctx.eventFd = -1;
+	ctx.nthreads = 0;
+	ctx.running = false;
+	pthread_mutex_unlock(&ctx.lock);
+
+	return 0;
+}
+
+static int submit(enum reqOp op, int fd, void *buf, size_t count,
+		  fs_async_cb_t cb, void *arg)
+{
+	if (buf == NULL) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&ctx.lock);
+	if (!ctx.running || ctx.stopping) {
+		pthread_mutex_unlock(&ctx.lock);
+		return -1;
+	}
+
+	int req = -1;
+	for (int i = 0; i < FS_ASYNC_MAX_COUNT; i++) {
+		if (ctx.reqs[i].state == REQ_FREE) {
+			req = i;
+			break;
+		}
+	}
+	if (req == -1) {
+		pthread_mutex_unlock(&ctx.lock);
+		return -1;
+	}
+
+	struct asyncRequest *r = &ctx.reqs[req];
+	r->op = op;
+	r->fd = fd;
+	r->buf = buf;
+	r->count = count;
+	r->cb = cb;
+	r->arg = arg;
+	r->ret = -1;
+	r->seq = ctx.nextSeq++;
+	r->state = REQ_QUEUED;
+	ctx.inFlight++;
+
+	pthread_cond_signal(&ctx.work);
+	pthread_mutex_unlock(&ctx.lock);
+
+	return req;
+}
+
+int fs_read_async(int fd, void *buf, size_t count, fs_async_cb_t cb, void *arg)
+{
+	return submit(REQ_READ, fd, buf, count, cb, arg);
+}
+
+int fs_write_async(int fd, void *buf, size_t count, fs_async_cb_t cb,
+		   void *arg)
+{
+	return submit(REQ_WRITE, fd, buf, count, cb, arg);
+}
+
+int fs_async_poll(int *req, int *ret)
+{
+	pthread_mutex_lock(&ctx.lock);
+	if (!ctx.running || ctx.numCompleted == 0) {
+		pthread_mutex_unlock(&ctx.lock);
+		return -1;
+	}
+
+	int done = ctx.completed[ctx.head];
+	if (req) {
+		*req = done;
+	}
+	if (ret) {
+		*ret = ctx.reqs[done].ret;
+	}
+	reap(done);
+	pthread_mutex_unlock(&ctx.lock);
+
+	return 0;
+}
+
+int fs_async_wait(int req)
+{
+	if (req < 0 || req >= FS_ASYNC_MAX_COUNT) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&ctx.lock);
+	struct asyncRequest *r = &ctx.reqs[req];
+	if (!ctx.running || r->state == REQ_FREE || r->cb) {
+		pthread_mutex_unlock(&ctx.lock);
+		return -1;
+	}
+
+	/* fs_async_exit() reaps the completions that nobody is left to wait for */
+	while (r->state != REQ_DONE) {
+		if (r->state == REQ_FREE || ctx.stopping) {
+			pthread_mutex_unlock(&ctx.lock);
+			return -1;
+		}
+		pthread_cond_wait(&ctx.done, &ctx.lock);
+	}
+	int ret = r->ret;
+	reap(req);
+	pthread_mutex_unlock(&ctx.lock);
+
+	return ret;
+}
+
+int fs_async_fd(void)
+{
+	int fd;
+
+	pthread_mutex_lock(&ctx.lock);
+	fd = ctx.running ? ctx.eventFd : -1;
+	pthread_mutex_unlock(&ctx.lock);
+
+	return fd;
+}
@@ -0,0 +1,224 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+
+static size_t bucket_of(const struct blockCache *cache, size_t block)
+{
+	return (block * 0x9E3779B97F4A7C15ULL >> 32) & (cache->numBuckets - 1);
+}
+
+static int slot_of(const struct blockCache *cache, size_t block)
+{
+	int s = cache->buckets[bucket_of(cache, block)];
+	while (s != -1 && cache->block[s] != block) {
+		s = cache->next[s];
+	}
+	return s;
+}
+
+/* Take slot @s out of its bucket */
+static void slot_unlink(struct blockCache *cache, int s)
+{
+	int *link = &cache->buckets[bucket_of(cache, cache->block[s])];
+	while (*link != s) {
+		link = &cache->next[*link];
+	}
+	*link = cache->next[s];
+}
+
+/* Empty slot @s, which is then the next one taken */
+static void slot_clear(struct blockCache *cache, int s)
+{
+	slot_unlink(cache, s);
+	cache->block[s] = CACHE_EMPTY;
+	cache->used[s] = false;
+	if (cache->dirty[s]) {
+		cache->dirty[s] = false;
+		cache->numDirty--;
+	}
+	cache->freeSlots[cache->numFree++] = s;
+}
+
+/* Slot to hold @block, taken from another block if needed; -1 if all are dirty */
+static int slot_take(struct blockCache *cache, size_t block)
+{
+	int s;
+	if (cache->numFree > 0) {
+		/* Empty slots first, so that blocks dropped once read age no others */
+		s = cache->freeSlots[--cache->numFree];
+	} else if (cache->numDirty == cache->numSlots) {
+		return -1;
+	} else {
+		/* CLOCK: give the slots read since the last round another one */
+		while (cache->used[cache->hand] || cache->dirty[cache->hand]) {
+			cache->used[cache->hand] = false;
+			cache->hand = (cache->hand + 1) % cache->numSlots;
+		}
+		s = cache->hand;
+		cache->hand = (cache->hand + 1) % cache->numSlots;
+		slot_unlink(cache, s);
+	}
+
+	size_t b = bucket_of(cache, block);
+	cache->block[s] = block;
+	cache->next[s] = cache->buckets[b];
+	cache->buckets[b] = s;
+	return s;
+}
+
+int cache_init(struct blockCache *cache, size_t numSlots, size_t blockSize)
+{
+	memset(cache, 0, sizeof(*cache));
+
+	/* About one slot per bucket */
+	size_t numBuckets = 1;
+	while (numBuckets < numSlots) {
+		numBuckets <<= 1;
+	}
+
+	cache->data = malloc(numSlots * blockSize);
+	cache->block = malloc(numSlots * sizeof(size_t));
+	cache->next = malloc(numSlots * sizeof(int));
+	cache->buckets = malloc(numBuckets * sizeof(int));
+	cache->used = calloc(numSlots, sizeof(bool));
+	cache->dirty = calloc(numSlots, sizeof(bool));
+	cache->dirtySince = malloc(numSlots * sizeof(uint64_t));
+	cache->freeSlots = malloc(numSlots * sizeof(int));
+	if (numSlots == 0 || cache->data == NULL || cache->block == NULL || cache->next == NULL ||
+	    cache->buckets == NULL || cache->used == NULL || cache->dirty == NULL ||
+	    cache->dirtySince == NULL || cache->freeSlots == NULL) {
+		cache_destroy(cache);
+		return -1;
+	}
+	memset(cache->block, 0xFF, numSlots * sizeof(size_t));
+	memset(cache->buckets, 0xFF, numBuckets * sizeof(int));
+	for (size_t i = 0; i < numSlots; i++) {
+		cache->freeSlots[i] = numSlots - 1 - i;
+	}
+	cache->numFree = numSlots;
+	cache->numSlots = numSlots;
+	cache->numBuckets = numBuckets;
+	cache->blockSize = blockSize;
+
+	return 0;
+}
+
+void cache_destroy(struct blockCache *cache)
+{
+	free(cache->data);
+	free(cache->block);
+	free(cache->next);
+	free(cache->buckets);
+	free(cache->used);
+	free(cache->dirty);
+	free(cache->dirtySince);
+	free(cache->freeSlots);
+	memset(cache, 0, sizeof(*cache));
+}
+
+void *cache_lookup(struct blockCache *cache, size_t block)
+{
+	cache->lookups++;
+	int s = slot_of(cache, block);
+	if (s == -1) {
+		return NULL;
+	}
+	cache->hits++;
+	cache->used[s] = true;
+	return cache->data + s * cache->blockSize;
+}
+
+void *cache_peek(const struct blockCache *cache, size_t block, bool *dirty)
+{
+	int s = slot_of(cache, block);
+	if (dirty) {
+		*dirty = s != -1 && cache->dirty[s];
+	}
+	return s == -1 ? NULL : cache->data + s * cache->blockSize;
+}
+
+void cache_insert(struct blockCache *cache, size_t block, const void *data, bool keep)
+{
+	int s = slot_of(cache, block);
+	if (s == -1 && (s = slot_take(cache, block)) == -1) {
+		return;
+	}
+	/* A dirty block is newer than what was read from the disk */
+	if (!cache->dirty[s]) {
+		memcpy(cache->data + s * cache->blockSize, data, cache->blockSize);
+	}
+	cache->used[s] = keep;
+}
+
+int cache_write(struct blockCache *cache, size_t block, const void *data, uint64_t now)
+{
+	int s = slot_of(cache, block);
+	if (s == -1 && (s = slot_take(cache, block)) == -1) {
+		return -1;
+	}
+	memcpy(cache->data + s * cache->blockSize, data, cache->blockSize);
+	cache->used[s] = true;
+	if (!cache->dirty[s]) {
+		cache->dirty[s] = true;
+		cache->dirtySince[s] = now;
+		cache->numDirty++;
+	}
+	return 0;
+}
+
+void cache_clean(struct blockCache *cache, size_t block)
+{
+	int s = slot_of(cache, block);
+	if (s != -1 && cache->dirty[s]) {
+		cache->dirty[s] = false;
+		cache->numDirty--;
+	}
+}
+
+size_t cache_dirty(const struct blockCache *cache, struct cacheDirty *dirty)
+{
+	size_t n = 0;
+	for (size_t s = 0; s < cache->numSlots; s++) {
+		if (cache->dirty[s]) {
+			dirty[n++] = (struct cacheDirty){ cache->block[s], cache->dirtySince[s] };
+		}
+	}
+	return n;
+}
+
+void cache_update(struct blockCache *cache, size_t block, size_t count, const void *data)
+{
+	for (size_t i = 0; i < count; i++) {
+		int s = slot_of(cache, block + i);
+		if (s != -1) {
+			memcpy(cache->data + s * cache->blockSize,
+			       (const char *)data + i * cache->blockSize, cache->blockSize);
+		}
+		if (s != -1 && cache->dirty[s]) {
+			cache->dirty[s] = false;
+			cache->numDirty--;
+		}
+	}
+}
+
+void cache_drop(struct blockCache *cache, size_t block, size_t count, bool dirty)
+{
+	/* Large ranges: look at every slot rather than at every block */
+	if (count > cache->numSlots) {
+		for (size_t s = 0; s < cache->numSlots; s++) {
+			if (cache->block[s] != CACHE_EMPTY && cache->block[s] - block < count &&
+			    (dirty || !cache->dirty[s])) {
+				slot_clear(cache, s);
+			}
+		}
+		return;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		int s = slot_of(cache, block + i);
+		if (s != -1 && (dirty || !cache->dirty[s])) {
+			slot_clear(cache, s);
+		}
+	}
+}
@@ -0,0 +1,146 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/**
+ * struct blockCache - Copies of recently read disk blocks
+ *
+ * A fixed number of slots, each holding one block, found by block index
+ * through a hash table. Empty slots are taken first, then slots are reused in
+ * CLOCK order: a slot read since the hand last passed it gets another round,
+ * others are taken. Slots can also hold blocks written to the cache but not
+ * to the disk yet, which are dirty and never taken. The cache does no
+ * locking, it is only ever used under the disk lock.
+ */
+struct blockCache {
+	char *data;				// Content of every slot, back to back
+	size_t *block;			// Block held by each slot, CACHE_EMPTY if none
+	int *next;				// Next slot of the same bucket, -1 at the end
+	int *buckets;			// First slot of each bucket, -1 if empty
+	bool *used;				// Whether each slot was read since the hand passed it
+	bool *dirty;			// Whether each slot is newer than the disk
+	uint64_t *dirtySince;	// When each dirty slot was first written to
+	int *freeSlots;			// Stack of the empty slots
+	size_t numFree;
+	size_t numDirty;
+	size_t numSlots;
+	size_t numBuckets;		// Power of two
+	size_t blockSize;
+	size_t hand;			// Next slot CLOCK looks at
+	size_t hits;
+	size_t lookups;
+};
+
+/** Block index of an empty slot */
+#define CACHE_EMPTY ((size_t)-1)
+
+/**
+ * cache_init - Allocate an empty cache
+ * @cache: Cache to initialize
+ * @numSlots: Number of blocks the cache holds
+ * @blockSize: Size in bytes of each block
+ *
+ * Return: -1 if the cache cannot be allocated. 0 otherwise.
+ */
+int cache_init(struct blockCache *cache, size_t numSlots, size_t blockSize);
+
+/**
+ * cache_destroy - Release a cache
+ * @cache: Cache to release
+ */
+void cache_destroy(struct blockCache *cache);
+
+/**
+ * cache_lookup - Find a block
+ * @cache: Cache
+ * @block: Block index
+ *
+ * Return: NULL if @block is not cached. Otherwise its content, which stays
+ * valid until the next call that inserts into or drops from @cache.
+ */
+void *cache_lookup(struct blockCache *cache, size_t block);
+
+/**
+ * cache_peek - Find a block without reading it
+ * @cache: Cache
+ * @block: Block index
+ * @dirty: Set to whether @block is dirty, unless NULL
+ *
+ * Same as cache_lookup(), but neither counts as a lookup nor as a read of
+ * @block.
+ */
+void *cache_peek(const struct blockCache *cache, size_t block, bool *dirty);
+
+/**
+ * cache_insert - Cache a block
+ * @cache: Cache
+ * @block: Block index
+ * @data: Content of the block
+ * @keep: Whether @block is likely to be read again, otherwise its slot gets
+ *   no second round and is taken as soon as the hand reaches it
+ *
+ * Replaces the cached content of @block if there is one and it is not dirty,
+ * and evicts another block otherwise. Does nothing if every slot is dirty.
+ */
+void cache_insert(struct blockCache *cache, size_t block, const void *data, bool keep);
+
+/**
+ * cache_write - Write a block to the cache only
+ * @cache: Cache
+ * @block: Block index
+ * @data: New content of the block
+ * @now: Current time, in any unit that only increases
+ *
+ * The block stays dirty until cache_clean() is called once it is written to
+ * the disk, and dirty since the first of the writes before.
+ *
+ * Return: -1 if every slot is dirty already. 0 otherwise.
+ */
+int cache_write(struct blockCache *cache, size_t block, const void *data, uint64_t now);
+
+/**
+ * cache_clean - Mark a block as written to the disk
+ * @cache: Cache
+ * @block: Block index
+ */
+void cache_clean(struct blockCache *cache, size_t block);
+
+/** Dirty block, as listed by cache_dirty() */
+struct cacheDirty {
+	size_t block;
+	uint64_t since;
+};
+
+/**
+ * cache_dirty - List the dirty blocks
+ * @cache: Cache
+ * @dirty: Filled with the dirty blocks, room for @cache->numSlots of them
+ *
+ * Return: the number of dirty blocks.
+ */
+size_t cache_dirty(const struct blockCache *cache, struct cacheDirty *dirty);
+
+/**
+ * cache_update - Refresh the cached blocks among ones written to the disk
+ * @cache: Cache
+ * @block: First block written
+ * @count: Number of blocks written
+ * @data: Content of the blocks
+ *
+ * Blocks that are not cached are left out, the others are clean afterwards.
+ */
+void cache_update(struct blockCache *cache, size_t block, size_t count, const void *data);
+
+/**
+ * cache_drop - Forget blocks
+ * @cache: Cache
+ * @block: First block
+ * @count: Number of blocks
+ * @dirty: Whether to forget the dirty ones too, whose content is then lost
+ */
+void cache_drop(struct blockCache *cache, size_t block, size_t count, bool dirty);
+
+#endif /* _CACHE_H */
@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dedup.h"
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+
+static uint64_t rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static size_t bucket_of(const struct dedupIndex *idx, uint64_t hash)
+{
+	return (hash ^ (hash >> 32)) & (idx->numBuckets - 1);
+}
+
+int dedup_init(struct dedupIndex *idx, size_t numBlocks)
+{
+	memset(idx, 0, sizeof(*idx));
+
+	/* About one block per bucket */
+	size_t numBuckets = 1;
+	while (numBuckets < numBlocks) {
+		numBuckets <<= 1;
+	}
+
+	idx->hash = calloc(numBlocks, sizeof(uint64_t));
+	idx->next = malloc(numBlocks * sizeof(uint16_t));
+	idx->buckets = malloc(numBuckets * sizeof(uint16_t));
+	if (idx->hash == NULL || idx->next == NULL || idx->buckets == NULL) {
+		dedup_destroy(idx);
+		return -1;
+	}
+	memset(idx->buckets, 0xFF, numBuckets * sizeof(uint16_t));
+	idx->numBlocks = numBlocks;
+	idx->numBuckets = numBuckets;
+
+	return 0;
+}
+
+void dedup_destroy(struct dedupIndex *idx)
+{
+	free(idx->hash);
+	free(idx->next);
+	free(idx->buckets);
+	memset(idx, 0, sizeof(*idx));
+}
+
+uint64_t dedup_hash(const void *buf, size_t size)
+{
+	const unsigned char *p = buf;
+	uint64_t lane[4] = { PRIME1 + PRIME2, PRIME2, 0, -PRIME1 };
+
+	/* Four independent lanes, 32 bytes per round */
+	for (size_t i = 0; i < size; i += 32) {
+		for (int l = 0; l < 4; l++) {
+			uint64_t w;
+			memcpy(&w, p + i + l * 8, sizeof(w));
+			lane[l] = rotl(lane[l] + w * PRIME2, 31) * PRIME1;
+		}
+	}
+
+	uint64_t h = rotl(lane[0], 1) + rotl(lane[1], 7) + rotl(lane[2], 12) +
+		     rotl(lane[3], 18) + size;
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+
+	return h ? h : 1;
+}
+
+/* Unlink @block from its bucket */
+static void unlink_block(struct dedupIndex *idx, uint16_t block)
+{
+	uint16_t *link = &idx->buckets[bucket_of(idx, idx->hash[block])];
+	while (*link != block) {
+		link = &idx->next[*link];
+	}
+	*link = idx->next[block];
+	idx->hash[block] = 0;
+	idx->numIndexed--;
+}
+
+void dedup_insert(struct dedupIndex *idx, uint16_t block, uint64_t hash)
+{
+	if (idx->hash[block] == hash) {
+		return;
+	}
+	if (idx->hash[block] != 0) {
+		unlink_block(idx, block);
+	}
+	if (hash == 0) {
+		return;
+	}
+
+	size_t b = bucket_of(idx, hash);
+	idx->hash[block] = hash;
+	idx->next[block] = idx->buckets[b];
+	idx->buckets[b] = block;
+	idx->numIndexed++;
+}
+
+/* First block of the chain starting at @block that has hash @hash */
+static uint16_t scan(const struct dedupIndex *idx, uint16_t block, uint64_t hash)
+{
+	while (block != DEDUP_NONE && idx->hash[block] != hash) {
+		block = idx->next[block];
+	}
+	return block;
+}
+
+uint16_t dedup_first(const struct dedupIndex *idx, uint64_t hash)
+{
+	return scan(idx, idx->buckets[bucket_of(idx, hash)], hash);
+}
+
+uint16_t dedup_next(const struct dedupIndex *idx, uint16_t block)
+{
+	return scan(idx, idx->next[block], idx->hash[block]);
+}
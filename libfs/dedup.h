@@ -0,0 +1,83 @@
+#ifndef _DEDUP_H
+#define _DEDUP_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/** Block index that ends a bucket, or that no block has */
+#define DEDUP_NONE 0xFFFF
+
+/**
+ * struct dedupIndex - Content hash of data blocks, and blocks by hash
+ *
+ * Keeps the hash of the content of each indexed data block, and finds the
+ * blocks having a given hash. Hashes only narrow the search: the blocks found
+ * still have to be compared before being relied upon as equal. The index does
+ * no locking, it is only ever used under the library lock.
+ */
+struct dedupIndex {
+	uint64_t *hash;		// Hash of each block, 0 if not indexed
+	uint16_t *next;		// Next block of the same bucket
+	uint16_t *buckets;	// First block of each bucket
+	size_t numBlocks;
+	size_t numBuckets;	// Power of two
+	size_t numIndexed;
+};
+
+/**
+ * dedup_init - Allocate an empty index
+ * @idx: Index to initialize
+ * @numBlocks: Number of data blocks that can be indexed
+ *
+ * Return: -1 if the index cannot be allocated. 0 otherwise.
+ */
+int dedup_init(struct dedupIndex *idx, size_t numBlocks);
+
+/**
+ * dedup_destroy - Release an index
+ * @idx: Index to release
+ */
+void dedup_destroy(struct dedupIndex *idx);
+
+/**
+ * dedup_hash - Hash the content of a block
+ * @buf: Block content
+ * @size: Block size in bytes, a multiple of 32
+ *
+ * Fast and non-cryptographic: identical blocks get the same hash, different
+ * ones most likely different hashes.
+ *
+ * Return: the hash, never 0.
+ */
+uint64_t dedup_hash(const void *buf, size_t size);
+
+/**
+ * dedup_insert - Index a block
+ * @idx: Index
+ * @block: Data block index
+ * @hash: Hash of the block's content, 0 to only drop it from the index
+ *
+ * Replaces whatever hash @block was indexed with before.
+ */
+void dedup_insert(struct dedupIndex *idx, uint16_t block, uint64_t hash);
+
+/**
+ * dedup_first - Find the blocks with a given hash
+ * @idx: Index
+ * @hash: Hash to look for
+ *
+ * Return: the first indexed block with hash @hash, %DEDUP_NONE if none. The
+ * next ones are found with dedup_next().
+ */
+uint16_t dedup_first(const struct dedupIndex *idx, uint64_t hash);
+
+/**
+ * dedup_next - Find the next block with the same hash
+ * @idx: Index
+ * @block: Block returned by dedup_first() or dedup_next()
+ *
+ * Return: the next indexed block with the hash of @block, %DEDUP_NONE if none.
+ */
+uint16_t dedup_next(const struct dedupIndex *idx, uint16_t block);
+
+#endif /* _DEDUP_H */
@@ -1,44 +1,110 @@
+#define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "cache.h"
 #include "disk.h"
 
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
 
-/* Invalid file descriptor */
-#define INVALID_FD -1
+/* Maximum number of selectable backends */
+#define BACKEND_MAX_COUNT 16
+
+/* Blocks staged at once when a copy has to go through memory */
+#define COPY_MAX_BLOCKS 64
 
 /* Disk instance description */
 struct disk {
-	/* File descriptor */
-	int fd;
+	/* Backend device, NULL backend when no disk is open */
+	struct block_dev dev;
 	/* Block count */
 	size_t bcount;
+	/* Blocks read through block_read_cached(), no slots when disabled */
+	struct blockCache cache;
+	/* Requests that changed blocks since the disk was opened */
+	size_t writes;
+	/* Most blocks written to the cache only, 0 to write through */
+	size_t dirty_max;
+	/* Taken by every request, see block_writeback() */
+	pthread_mutex_t lock;
 };
 
 /* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+static struct disk disk = { .lock = PTHREAD_MUTEX_INITIALIZER };
 
-int block_disk_open(const char *diskname)
+/* Backends selectable by prefix */
+static const struct block_backend *backends[BACKEND_MAX_COUNT] = {
+	&block_backend_ram,
+	&block_backend_lat,
+	&block_backend_stripe,
+};
+
+/* Copy from a host file through a bounce buffer and the backend's write */
+static int copy_from_buffered(struct block_dev *dev, size_t block, size_t count,
+			      int fd, off_t offset)
 {
-	int fd;
-	struct stat st;
+	size_t max = count < COPY_MAX_BLOCKS ? count : COPY_MAX_BLOCKS;
+	char *buf = malloc(max * dev->block_size);
+	int ret = 0;
 
-	if (!diskname) {
-		block_error("invalid file diskname");
+	if (!buf)
 		return -1;
-	}
 
-	if (disk.fd != INVALID_FD) {
-		block_error("disk already open");
-		return -1;
+	while (count > 0 && ret == 0) {
+		size_t n = count < max ? count : max;
+		size_t len = n * dev->block_size;
+
+		for (size_t done = 0; done < len; ) {
+			ssize_t got = pread(fd, buf + done, len - done, offset + done);
+			if (got <= 0) {
+				if (got < 0)
+					perror("pread");
+				ret = -1;
+				break;
+			}
+			done += got;
+		}
+		if (ret == 0)
+			ret = dev->backend->write(dev, block, n, buf);
+
+		block += n;
+		count -= n;
+		offset += len;
 	}
 
+	free(buf);
+	return ret;
+}
+
+/*
+ * Host file backend
+ */
+
+/* Host file state */
+struct file_disk {
+	/* File descriptor */
+	int fd;
+	/* Size in bytes */
+	size_t size;
+};
+
+static int file_open(struct block_dev *dev, const char *diskname)
+{
+	struct file_disk *f;
+	int fd;
+	struct stat st;
+
 	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
 		perror("open");
 		return -1;
@@ -46,39 +112,432 @@ int block_disk_open(const char *diskname)
 
 	if (fstat(fd, &st)) {
 		perror("fstat");
+		close(fd);
 		return -1;
 	}
 
 	/* The disk image's size should be a multiple of the block size */
-	if (st.st_size % BLOCK_SIZE != 0) {
+	if (st.st_size % BLOCK_SIZE_MIN != 0) {
 		block_error("size '%zu' is not multiple of '%d'",
-			    st.st_size, BLOCK_SIZE);
+			    st.st_size, BLOCK_SIZE_MIN);
+		close(fd);
+		return -1;
+	}
+
+	f = malloc(sizeof(*f));
+	if (!f) {
+		close(fd);
+		return -1;
+	}
+	f->fd = fd;
+	f->size = st.st_size;
+	dev->priv = f;
+
+	return 0;
+}
+
+static int file_close(struct block_dev *dev)
+{
+	struct file_disk *f = dev->priv;
+
+	close(f->fd);
+	free(f);
+
+	return 0;
+}
+
+static int file_read(struct block_dev *dev, size_t block, size_t count,
+		     void *buf)
+{
+	struct file_disk *f = dev->priv;
+	size_t len = count * dev->block_size;
+	off_t offset = (off_t)block * dev->block_size;
+
+	/* Perform the actual read from the disk image */
+	while (len > 0) {
+		ssize_t ret = pread(f->fd, buf, len, offset);
+		if (ret <= 0) {
+			if (ret < 0)
+				perror("pread");
+			return -1;
+		}
+		buf = (char *)buf + ret;
+		offset += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int file_write(struct block_dev *dev, size_t block, size_t count,
+		      const void *buf)
+{
+	struct file_disk *f = dev->priv;
+	size_t len = count * dev->block_size;
+	off_t offset = (off_t)block * dev->block_size;
+
+	/* Perform the actual write into the disk image */
+	while (len > 0) {
+		ssize_t ret = pwrite(f->fd, buf, len, offset);
+		if (ret < 0) {
+			perror("pwrite");
+			return -1;
+		}
+		buf = (const char *)buf + ret;
+		offset += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static size_t file_count(struct block_dev *dev)
+{
+	struct file_disk *f = dev->priv;
+
+	return f->size / dev->block_size;
+}
+
+static int file_flush(struct block_dev *dev)
+{
+	struct file_disk *f = dev->priv;
+
+	if (fdatasync(f->fd)) {
+		perror("fdatasync");
 		return -1;
 	}
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	return 0;
+}
+
+static int file_discard(struct block_dev *dev, size_t block, size_t count)
+{
+	struct file_disk *f = dev->priv;
+
+	/* Keep the image size, only give the extent back to the host */
+	if (fallocate(f->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      (off_t)block * dev->block_size,
+		      (off_t)count * dev->block_size)) {
+		/* Host file systems without hole support keep the blocks */
+		if (errno == EOPNOTSUPP)
+			return 0;
+		perror("fallocate");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int file_copy_from(struct block_dev *dev, size_t block, size_t count,
+			  int fd, off_t offset)
+{
+	struct file_disk *f = dev->priv;
+	size_t len = count * dev->block_size;
+	off_t src = offset;
+	off_t dst = (off_t)block * dev->block_size;
+
+	/* The host kernel moves (or even shares) the data, no user-space copy */
+	while (len > 0) {
+		ssize_t ret = copy_file_range(fd, &src, f->fd, &dst, len, 0);
+		if (ret <= 0) {
+			/* Unsupported between these files: start over by hand */
+			if (ret < 0 && (errno == EXDEV || errno == EINVAL ||
+					errno == ENOSYS || errno == EOPNOTSUPP))
+				return copy_from_buffered(dev, block, count, fd, offset);
+			if (ret < 0)
+				perror("copy_file_range");
+			return -1;
+		}
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* Page-aligned extent of the host file covering @count blocks from @block */
+static void file_extent(struct block_dev *dev, size_t block, size_t count,
+			off_t *base, size_t *len, size_t *skip)
+{
+	off_t start = (off_t)block * dev->block_size;
+
+	*base = start & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+	*skip = start - *base;
+	*len = *skip + count * dev->block_size;
+}
+
+static void *file_map(struct block_dev *dev, size_t block, size_t count,
+		      int flags)
+{
+	struct file_disk *f = dev->priv;
+	off_t base;
+	size_t len, skip;
+
+	/* Blocks smaller than a page need not start on one */
+	file_extent(dev, block, count, &base, &len, &skip);
+	int share = flags & BLOCK_MAP_PRIVATE ? MAP_PRIVATE : MAP_SHARED;
+	void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE, share, f->fd, base);
+	if (addr == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+
+	return (char *)addr + skip;
+}
+
+static int file_unmap(struct block_dev *dev, void *addr, size_t block,
+		      size_t count)
+{
+	off_t base;
+	size_t len, skip;
+
+	/* The host kernel writes the modified pages back like those of pwrite() */
+	file_extent(dev, block, count, &base, &len, &skip);
+	if (munmap((char *)addr - skip, len)) {
+		perror("munmap");
+		return -1;
+	}
+
+	return 0;
+}
+
+const struct block_backend block_backend_file = {
+	.name = "file",
+	.open = file_open,
+	.close = file_close,
+	.read = file_read,
+	.write = file_write,
+	.count = file_count,
+	.flush = file_flush,
+	.discard = file_discard,
+	.copy_from = file_copy_from,
+	.map = file_map,
+	.unmap = file_unmap,
+};
+
+/*
+ * Backend selection
+ */
+
+int block_backend_register(const struct block_backend *backend)
+{
+	if (!backend || !backend->name || !backend->open) {
+		block_error("invalid backend");
+		return -1;
+	}
+
+	for (int i = 0; i < BACKEND_MAX_COUNT; i++) {
+		if (!backends[i]) {
+			backends[i] = backend;
+			return 0;
+		}
+		if (!strcmp(backends[i]->name, backend->name)) {
+			block_error("backend '%s' already registered", backend->name);
+			return -1;
+		}
+	}
+
+	block_error("too many backends");
+	return -1;
+}
+
+int block_dev_open(struct block_dev *dev, const char *diskname)
+{
+	const struct block_backend *backend = &block_backend_file;
+	const char *sep = strchr(diskname, ':');
+
+	/* "<backend>:<name>" selects a registered backend */
+	if (sep) {
+		for (int i = 0; i < BACKEND_MAX_COUNT && backends[i]; i++) {
+			size_t len = strlen(backends[i]->name);
+			if (len == (size_t)(sep - diskname) &&
+			    !strncmp(diskname, backends[i]->name, len)) {
+				backend = backends[i];
+				diskname = sep + 1;
+				break;
+			}
+		}
+	}
+
+	dev->backend = backend;
+	dev->priv = NULL;
+	dev->block_size = BLOCK_SIZE;
+	if (backend->open(dev, diskname)) {
+		dev->backend = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Virtual disk
+ *
+ * Every entry point takes the disk lock: the file system serialises its own
+ * requests, but block_writeback() runs beside them.
+ */
+
+static void disk_lock(void)
+{
+	pthread_mutex_lock(&disk.lock);
+}
+
+static void disk_unlock(void)
+{
+	pthread_mutex_unlock(&disk.lock);
+}
+
+/* Milliseconds since an arbitrary point, the age unit of dirty blocks */
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int dirty_by_age(const void *a, const void *b)
+{
+	const struct cacheDirty *x = a, *y = b;
+
+	return (x->since > y->since) - (x->since < y->since);
+}
+
+static int dirty_by_block(const void *a, const void *b)
+{
+	const struct cacheDirty *x = a, *y = b;
+
+	return (x->block > y->block) - (x->block < y->block);
+}
+
+/*
+ * Write back the dirty blocks dirty since @before or earlier, then the oldest
+ * ones until at most @keep are left. Runs of consecutive blocks go in one
+ * request each, the disk lock being released between them if @unlock. Return
+ * the number of blocks written back, -1 on error.
+ */
+static long writeback(uint64_t before, size_t keep, bool unlock)
+{
+	struct blockCache *cache = &disk.cache;
+	size_t bsize = cache->blockSize;
+
+	if (cache->numDirty == 0)
+		return 0;
+
+	struct cacheDirty *dirty = malloc(cache->numDirty * sizeof(*dirty));
+	char *buf = malloc(COPY_MAX_BLOCKS * bsize);
+	if (!dirty || !buf) {
+		free(dirty);
+		free(buf);
+		return -1;
+	}
+
+	size_t n = cache_dirty(cache, dirty);
+	qsort(dirty, n, sizeof(*dirty), dirty_by_age);
+	size_t todo = n > keep ? n - keep : 0;
+	while (todo < n && dirty[todo].since <= before)
+		todo++;
+	qsort(dirty, todo, sizeof(*dirty), dirty_by_block);
+
+	long done = 0;
+	size_t i = 0;
+	while (i < todo && done != -1) {
+		/* A block cleaned or dropped while the lock was released is skipped */
+		size_t run = 0;
+		bool is_dirty;
+		while (i + run < todo && run < COPY_MAX_BLOCKS &&
+		       dirty[i + run].block == dirty[i].block + run) {
+			void *data = cache_peek(cache, dirty[i + run].block, &is_dirty);
+			if (!is_dirty)
+				break;
+			memcpy(buf + run * bsize, data, bsize);
+			run++;
+		}
+		if (run == 0) {
+			i++;
+			continue;
+		}
+
+		if (disk.dev.backend->write(&disk.dev, dirty[i].block, run, buf)) {
+			done = -1;
+			break;
+		}
+		for (size_t j = 0; j < run; j++)
+			cache_clean(cache, dirty[i + j].block);
+		done += run;
+		i += run;
+
+		if (unlock) {
+			disk_unlock();
+			disk_lock();
+			if (!disk.dev.backend || !cache->numSlots || cache->blockSize != bsize)
+				break;
+		}
+	}
+
+	free(dirty);
+	free(buf);
+	return done;
+}
+
+/* Write back every dirty block, before the cache or the disk goes away */
+static int writeback_all(void)
+{
+	return writeback(UINT64_MAX, 0, false) == -1 ? -1 : 0;
+}
+
+int block_disk_open(const char *diskname)
+{
+	if (!diskname) {
+		block_error("invalid file diskname");
+		return -1;
+	}
+
+	disk_lock();
+	if (disk.dev.backend) {
+		block_error("disk already open");
+		disk_unlock();
+		return -1;
+	}
+
+	if (block_dev_open(&disk.dev, diskname)) {
+		disk_unlock();
+		return -1;
+	}
+
+	disk.bcount = disk.dev.backend->count(&disk.dev);
+	disk.writes = 0;
+	disk.dirty_max = 0;
+	disk_unlock();
 
 	return 0;
 }
 
 int block_disk_close(void)
 {
-	if (disk.fd == INVALID_FD) {
+	disk_lock();
+	if (!disk.dev.backend) {
 		block_error("no disk currently open");
+		disk_unlock();
 		return -1;
 	}
 
-	close(disk.fd);
+	/* Closing anyway: the blocks that could not be written back are lost */
+	int ret = writeback_all();
+	if (ret)
+		block_error("dirty blocks lost");
 
-	disk.fd = INVALID_FD;
+	disk.dev.backend->close(&disk.dev);
+	cache_destroy(&disk.cache);
 
-	return 0;
+	disk.dev.backend = NULL;
+	disk_unlock();
+
+	return ret;
 }
 
 int block_disk_count(void)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk.dev.backend) {
 		block_error("no disk currently open");
 		return -1;
 	}
@@ -86,59 +545,464 @@ int block_disk_count(void)
 	return disk.bcount;
 }
 
-int block_write(size_t block, const void *buf)
+int block_disk_set_block_size(size_t size)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk.dev.backend) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	if (size < BLOCK_SIZE_MIN || size > BLOCK_SIZE_MAX ||
+	    (size & (size - 1))) {
+		block_error("invalid block size '%zu'", size);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	disk_lock();
+	/* Cached blocks have the old size */
+	if (size != disk.dev.block_size) {
+		if (writeback_all()) {
+			disk_unlock();
+			return -1;
+		}
+		cache_destroy(&disk.cache);
+		disk.dirty_max = 0;
+	}
+
+	disk.dev.block_size = size;
+	disk.bcount = disk.dev.backend->count(&disk.dev);
+	disk_unlock();
+
+	return 0;
+}
+
+int block_disk_block_size(void)
+{
+	if (!disk.dev.backend) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	return disk.dev.block_size;
+}
+
+/* Common checks of every block request */
+static int check_request(size_t block, size_t count)
+{
+	if (!disk.dev.backend) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (block >= disk.bcount || count > disk.bcount - block) {
+		block_error("block index out of bounds (%zu/%zu)",
+			    block + count - 1, disk.bcount);
 		return -1;
 	}
 
 	return 0;
 }
 
+/* Forget cached blocks about to change other than through their content */
+static void cache_drop_range(size_t block, size_t count)
+{
+	if (disk.cache.numSlots)
+		cache_drop(&disk.cache, block, count, true);
+}
+
+/* Write through to the backend, or into the cache in write-back mode */
+static int write_many(size_t block, size_t count, const void *buf)
+{
+	struct blockCache *cache = &disk.cache;
+
+	disk.writes++;
+
+	/*
+	 * Past the dirty limit, writers write back the oldest blocks themselves,
+	 * down to half the limit so that the runs are long and the next writes
+	 * need not throttle again
+	 */
+	if (count <= disk.dirty_max) {
+		size_t keep = (disk.dirty_max - count) / 2;
+		if (cache->numDirty + count > disk.dirty_max &&
+		    writeback(0, keep, false) == -1)
+			return -1;
+		uint64_t now = now_ms();
+		for (size_t i = 0; i < count; i++)
+			if (cache_write(cache, block + i, (const char *)buf + i * cache->blockSize, now))
+				return -1;
+		return 0;
+	}
+
+	if (cache->numSlots)
+		cache_update(cache, block, count, buf);
+
+	return disk.dev.backend->write(&disk.dev, block, count, buf);
+}
+
+/* Read from the backend, then overlay the blocks only written to the cache */
+static int read_many(size_t block, size_t count, void *buf)
+{
+	struct blockCache *cache = &disk.cache;
+
+	if (disk.dev.backend->read(&disk.dev, block, count, buf))
+		return -1;
+
+	for (size_t i = 0; cache->numDirty && i < count; i++) {
+		bool is_dirty;
+		void *data = cache_peek(cache, block + i, &is_dirty);
+		if (is_dirty)
+			memcpy((char *)buf + i * cache->blockSize, data, cache->blockSize);
+	}
+
+	return 0;
+}
+
+int block_write_many(size_t block, size_t count, const void *buf)
+{
+	if (count == 0)
+		return 0;
+
+	disk_lock();
+	int ret = check_request(block, count) ? -1 : write_many(block, count, buf);
+	disk_unlock();
+
+	return ret;
+}
+
+int block_read_many(size_t block, size_t count, void *buf)
+{
+	if (count == 0)
+		return 0;
+
+	disk_lock();
+	int ret = check_request(block, count) ? -1 : read_many(block, count, buf);
+	disk_unlock();
+
+	return ret;
+}
+
+int block_write(size_t block, const void *buf)
+{
+	return block_write_many(block, 1, buf);
+}
+
 int block_read(size_t block, void *buf)
 {
-	if (disk.fd == INVALID_FD) {
+	return block_read_many(block, 1, buf);
+}
+
+long block_disk_writes(void)
+{
+	if (!disk.dev.backend) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	return disk.writes;
+}
+
+int block_disk_flush(void)
+{
+	disk_lock();
+	if (!disk.dev.backend) {
+		block_error("no disk currently open");
+		disk_unlock();
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	int ret = writeback_all();
+	if (ret == 0 && disk.dev.backend->flush)
+		ret = disk.dev.backend->flush(&disk.dev);
+	disk_unlock();
+
+	return ret;
+}
+
+int block_copy_from_fd(size_t block, size_t count, int fd, off_t offset)
+{
+	if (count == 0)
+		return 0;
+
+	disk_lock();
+	if (check_request(block, count)) {
+		disk_unlock();
 		return -1;
 	}
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	cache_drop_range(block, count);
+	disk.writes++;
+
+	int ret;
+	if (!disk.dev.backend->copy_from)
+		ret = copy_from_buffered(&disk.dev, block, count, fd, offset);
+	else
+		ret = disk.dev.backend->copy_from(&disk.dev, block, count, fd, offset);
+	disk_unlock();
+
+	return ret;
+}
+
+int block_discard(size_t block, size_t count)
+{
+	if (count == 0)
+		return 0;
+
+	disk_lock();
+	if (check_request(block, count)) {
+		disk_unlock();
 		return -1;
 	}
 
+	cache_drop_range(block, count);
+	disk.writes++;
+
+	int ret = 0;
+	if (disk.dev.backend->discard)
+		ret = disk.dev.backend->discard(&disk.dev, block, count);
+	disk_unlock();
+
+	return ret;
+}
+
+void *block_map(size_t block, size_t count, int flags)
+{
+	void *addr = NULL;
+
+	if (count == 0)
+		return NULL;
+
+	disk_lock();
+	/* The mapping shows what the disk holds: no dirty blocks in the range */
+	if (!check_request(block, count) && disk.dev.backend->map &&
+	    writeback_all() == 0)
+		addr = disk.dev.backend->map(&disk.dev, block, count, flags);
+	disk_unlock();
+
+	return addr;
+}
+
+int block_unmap(void *addr, size_t block, size_t count)
+{
+	disk_lock();
+	if (!disk.dev.backend) {
+		block_error("no disk currently open");
+		disk_unlock();
+		return -1;
+	}
+
+	int ret = disk.dev.backend->unmap(&disk.dev, addr, block, count);
+	disk_unlock();
+
+	return ret;
+}
+
+int block_cache_init(size_t slots)
+{
+	disk_lock();
+	if (!disk.dev.backend) {
+		block_error("no disk currently open");
+		disk_unlock();
+		return -1;
+	}
+
+	int ret = writeback_all();
+	if (ret == 0) {
+		cache_destroy(&disk.cache);
+		if (slots)
+			ret = cache_init(&disk.cache, slots, disk.dev.block_size);
+	}
+	if (disk.dirty_max > disk.cache.numSlots)
+		disk.dirty_max = disk.cache.numSlots;
+	disk_unlock();
+
+	return ret;
+}
+
+int block_read_cached(size_t block, size_t count, void *buf, int flags)
+{
+	struct blockCache *cache = &disk.cache;
+	char *dst = buf;
+	int ret = 0;
+
+	if (count == 0)
+		return 0;
+
+	disk_lock();
+	if (check_request(block, count)) {
+		disk_unlock();
+		return -1;
+	}
+
+	if (!cache->numSlots) {
+		ret = disk.dev.backend->read(&disk.dev, block, count, buf);
+		disk_unlock();
+		return ret;
+	}
+
+	/* Each run of missing blocks is read at once, when the run ends */
+	size_t start = 0, missing = 0;
+	for (size_t i = 0; i <= count && ret == 0; i++) {
+		void *data = i < count ? cache_lookup(cache, block + i) : NULL;
+		if (data) {
+			memcpy(dst + i * cache->blockSize, data, cache->blockSize);
+			if (flags & BLOCK_CACHE_ONCE)
+				cache_drop(cache, block + i, 1, false);
+		} else if (i < count) {
+			if (!missing++)
+				start = i;
+			continue;
+		}
+		if (!missing)
+			continue;
+
+		char *run = dst + start * cache->blockSize;
+		ret = disk.dev.backend->read(&disk.dev, block + start, missing, run);
+		for (size_t j = 0; ret == 0 && !(flags & BLOCK_CACHE_ONCE) && j < missing; j++)
+			cache_insert(cache, block + start + j, run + j * cache->blockSize, true);
+		missing = 0;
+	}
+	disk_unlock();
+
+	return ret;
+}
+
+int block_prefetch(size_t block, size_t count, int flags)
+{
+	struct blockCache *cache = &disk.cache;
+	int ret = 0;
+
+	if (count == 0)
+		return 0;
+
+	disk_lock();
+	if (check_request(block, count)) {
+		disk_unlock();
+		return -1;
+	}
+
+	if (!cache->numSlots) {
+		disk_unlock();
+		return 0;
+	}
+
+	/* More than the cache holds would evict what was just read */
+	if (count > cache->numSlots)
+		count = cache->numSlots;
+
+	char *buf = malloc(count * cache->blockSize);
+	if (!buf) {
+		disk_unlock();
+		return -1;
+	}
+
+	size_t i = 0;
+	while (i < count && ret == 0) {
+		if (cache_peek(cache, block + i, NULL)) {
+			i++;
+			continue;
+		}
+		size_t n = 1;
+		while (i + n < count && !cache_peek(cache, block + i + n, NULL))
+			n++;
+		ret = disk.dev.backend->read(&disk.dev, block + i, n, buf);
+		for (size_t j = 0; ret == 0 && j < n; j++)
+			cache_insert(cache, block + i + j, buf + j * cache->blockSize,
+				     !(flags & BLOCK_CACHE_ONCE));
+		i += n;
+	}
+	disk_unlock();
+
+	free(buf);
+	return ret;
+}
+
+int block_cache_drop(size_t block, size_t count)
+{
+	disk_lock();
+	if (!disk.dev.backend) {
+		block_error("no disk currently open");
+		disk_unlock();
+		return -1;
+	}
+
+	/* Dirty blocks stay until written back */
+	if (disk.cache.numSlots)
+		cache_drop(&disk.cache, block, count, false);
+	disk_unlock();
+
 	return 0;
 }
 
+int block_cache_stats(size_t *hits, size_t *lookups)
+{
+	disk_lock();
+	if (!disk.dev.backend) {
+		block_error("no disk currently open");
+		disk_unlock();
+		return -1;
+	}
+
+	*hits = disk.cache.hits;
+	*lookups = disk.cache.lookups;
+	disk_unlock();
+
+	return 0;
+}
+
+int block_cache_writeback(size_t dirty_max)
+{
+	disk_lock();
+	if (!disk.dev.backend) {
+		block_error("no disk currently open");
+		disk_unlock();
+		return -1;
+	}
+
+	if (dirty_max > disk.cache.numSlots) {
+		block_error("dirty limit '%zu' larger than the cache", dirty_max);
+		disk_unlock();
+		return -1;
+	}
+
+	/* Leaving write-back mode writes everything back */
+	int ret = 0;
+	if (dirty_max == 0)
+		ret = writeback_all();
+	disk.dirty_max = dirty_max;
+	disk_unlock();
+
+	return ret;
+}
+
+long block_writeback(unsigned int age_ms, size_t keep)
+{
+	disk_lock();
+	if (!disk.dev.backend) {
+		block_error("no disk currently open");
+		disk_unlock();
+		return -1;
+	}
+
+	uint64_t now = now_ms();
+	long ret = writeback(now >= age_ms ? now - age_ms : 0, keep, true);
+	disk_unlock();
+
+	return ret;
+}
+
+int block_cache_dirty(size_t *dirty, size_t *slots)
+{
+	disk_lock();
+	if (!disk.dev.backend) {
+		block_error("no disk currently open");
+		disk_unlock();
+		return -1;
+	}
+
+	*dirty = disk.cache.numDirty;
+	*slots = disk.cache.numSlots;
+	disk_unlock();
+
+	return 0;
+}
@@ -2,10 +2,17 @@
 #define _DISK_H
 
 #include <stddef.h> /* for size_t definition */
+#include <sys/types.h> /* for off_t definition */
 
-/** Size of a disk block in bytes */
+/** Default size of a disk block in bytes */
 #define BLOCK_SIZE 4096
 
+/** Smallest block size a disk can use (see block_disk_set_block_size()) */
+#define BLOCK_SIZE_MIN 512
+
+/** Largest block size a disk can use (see block_disk_set_block_size()) */
+#define BLOCK_SIZE_MAX 65536
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -14,6 +21,10 @@
  * blocks can be read from it with block_read() or written to it with
  * block_write().
  *
+ * @diskname can start with "<backend>:" to select a registered backend other
+ * than the default host file one, e.g. "ram:disk.fs" (see struct
+ * block_backend).
+ *
  * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
  * or is already open. 0 otherwise.
  */
@@ -34,13 +45,34 @@ int block_disk_close(void);
  */
 int block_disk_count(void);
 
+/**
+ * block_disk_set_block_size - Change the disk's block size
+ * @size: Block size in bytes
+ *
+ * Express every later request in blocks of @size bytes instead of
+ * %BLOCK_SIZE: block indices, counts and buffer sizes all follow. The block
+ * count becomes the number of whole blocks of @size bytes the disk holds.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if @size is not a
+ * power of two between %BLOCK_SIZE_MIN and %BLOCK_SIZE_MAX. 0 otherwise.
+ */
+int block_disk_set_block_size(size_t size);
+
+/**
+ * block_disk_block_size - Get disk's block size
+ *
+ * Return: -1 if there was no virtual disk file opened, otherwise the size in
+ * bytes of the blocks that requests are expressed in.
+ */
+int block_disk_block_size(void);
+
 /**
  * block_write - Write a block to disk
  * @block: Index of the block to write to
  * @buf: Data buffer to write in the block
  *
- * Write the content of buffer @buf (%BLOCK_SIZE bytes) in the virtual disk's
- * block @block.
+ * Write the content of buffer @buf (one block, %BLOCK_SIZE bytes by default)
+ * in the virtual disk's block @block.
  *
  * Return: -1 if @block is out of bounds or inaccessible or if the writing
  * operation fails. 0 otherwise.
@@ -52,13 +84,357 @@ int block_write(size_t block, const void *buf);
  * @block: Index of the block to read from
  * @buf: Data buffer to be filled with content of block
  *
- * Read the content of virtual disk's block @block (%BLOCK_SIZE bytes) into
- * buffer @buf.
+ * Read the content of virtual disk's block @block (one block, %BLOCK_SIZE bytes
+ * by default) into buffer @buf.
  *
  * Return: -1 if @block is out of bounds or inaccessible, or if the reading
  * operation fails. 0 otherwise.
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_write_many - Write consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Same as block_write(), but write @count blocks from @buf to
+ * blocks @block to @block + @count - 1 in as few operations as the backend
+ * allows.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible or if the
+ * writing operation fails. 0 otherwise.
+ */
+int block_write_many(size_t block, size_t count, const void *buf);
+
+/**
+ * block_read_many - Read consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of the blocks
+ *
+ * Same as block_read(), but read blocks @block to @block + @count - 1 into
+ * @buf in as few operations as the backend allows.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible, or if the
+ * reading operation fails. 0 otherwise.
+ */
+int block_read_many(size_t block, size_t count, void *buf);
+
+/**
+ * block_disk_flush - Flush disk writes to stable storage
+ *
+ * Makes every write completed so far durable, including the changes made to
+ * blocks mapped with block_map() and the blocks only written to the cache
+ * (see block_cache_writeback()).
+ *
+ * Return: -1 if there was no virtual disk file opened, or if the backend
+ * cannot flush. 0 otherwise.
+ */
+int block_disk_flush(void);
+
+/**
+ * block_disk_writes - Count the requests that changed the disk
+ *
+ * Writes, copies and discards count, whether or not they succeeded; changes
+ * made through block_map() do not. Comparing two counts tells whether
+ * anything was written in between, e.g. since the last block_disk_flush().
+ *
+ * Return: -1 if there was no virtual disk file opened, otherwise the number
+ * of such requests since the disk was opened.
+ */
+long block_disk_writes(void);
+
+/**
+ * block_discard - Release the storage behind unused blocks
+ * @block: Index of the first block to discard
+ * @count: Number of blocks to discard
+ *
+ * Tell the backend that blocks @block to @block + @count - 1 no longer hold
+ * data, so that it can give their storage back (e.g. punch a hole in a
+ * sparse host image). Discarded blocks read back as zeroes. Backends that
+ * cannot discard ignore the request.
+ *
+ * Return: -1 if any of the blocks is out of bounds or if the backend fails to
+ * discard them. 0 otherwise.
+ */
+int block_discard(size_t block, size_t count);
+
+/**
+ * block_copy_from_fd - Fill consecutive blocks from a host file
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @fd: Host file descriptor to copy from
+ * @offset: Byte offset in @fd to start copying from
+ *
+ * Same as block_write_many() with the @count blocks' worth of bytes found at
+ * @offset in @fd. Backends that can (e.g. the host file one, through
+ * copy_file_range()) let the host kernel move the data without it going
+ * through user space. @fd must hold that many bytes at @offset.
+ *
+ * Return: -1 if any of the blocks is out of bounds, if @fd cannot be read or
+ * if the writing operation fails. 0 otherwise.
+ */
+int block_copy_from_fd(size_t block, size_t count, int fd, off_t offset);
+
+/** The mapping is the caller's alone: changes to it never reach the disk */
+#define BLOCK_MAP_PRIVATE 0x1
+
+/**
+ * block_map - Map consecutive blocks into memory
+ * @block: Index of the first block to map
+ * @count: Number of blocks to map
+ * @flags: %BLOCK_MAP_PRIVATE or 0
+ *
+ * Make blocks @block to @block + @count - 1 accessible in memory, for the
+ * backends that can (e.g. the host file one, through mmap()). Mapped blocks
+ * are only read from the disk as they are first accessed, and only the ones
+ * modified are written back, at any time and at the latest when they are
+ * unmapped with block_unmap(). They stay coherent with block_read() and
+ * block_write() meanwhile, except for the writes still in the cache in
+ * write-back mode. Every mapping must be unmapped before the disk is closed.
+ *
+ * With %BLOCK_MAP_PRIVATE, modified blocks are never written back: the caller
+ * writes them with block_write() when it chooses to, and must not write the
+ * mapped blocks otherwise meanwhile.
+ *
+ * Return: NULL if any of the blocks is out of bounds, or if the backend cannot
+ * map them. Otherwise, return the address of block @block.
+ */
+void *block_map(size_t block, size_t count, int flags);
+
+/**
+ * block_unmap - Unmap blocks mapped with block_map()
+ * @addr: Address block_map() returned
+ * @block: Index of the first block, as given to block_map()
+ * @count: Number of blocks, as given to block_map()
+ *
+ * Return: -1 if there was no virtual disk file opened, or if the blocks
+ * cannot be unmapped. 0 otherwise.
+ */
+int block_unmap(void *addr, size_t block, size_t count);
+
+/** The blocks are read once: drop cache hits, cache nothing for long */
+#define BLOCK_CACHE_ONCE 0x1
+
+/**
+ * block_cache_init - Keep recently read blocks in memory
+ * @slots: Number of blocks to keep, 0 for none
+ *
+ * Set up the block cache that block_read_cached() and block_prefetch() go
+ * through, replacing the current one. Every write, copy and discard keeps
+ * it coherent, but the cache does not see the writes made through
+ * block_map(), which must not map the blocks read through it. The cache is
+ * released with the disk, or when its block size changes, after the blocks
+ * only written to it are written back.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if the cache cannot
+ * be allocated. 0 otherwise.
+ */
+int block_cache_init(size_t slots);
+
+/**
+ * block_read_cached - Read consecutive blocks through the block cache
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of the blocks
+ * @flags: %BLOCK_CACHE_ONCE or 0
+ *
+ * Same as block_read_many(), but take the blocks that are cached from the
+ * cache, read the others in as few operations as the backend allows and
+ * cache them. With %BLOCK_CACHE_ONCE, the blocks are dropped from the cache
+ * instead.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible, or if the
+ * reading operation fails. 0 otherwise.
+ */
+int block_read_cached(size_t block, size_t count, void *buf, int flags);
+
+/**
+ * block_prefetch - Read consecutive blocks into the block cache
+ * @block: Index of the first block to read
+ * @count: Number of blocks to read
+ * @flags: %BLOCK_CACHE_ONCE or 0
+ *
+ * Read the blocks that are not cached yet, in as few operations as the
+ * backend allows. With %BLOCK_CACHE_ONCE, they are the first ones evicted
+ * unless they are read.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible, or if the
+ * reading operation fails. 0 otherwise, including without a cache.
+ */
+int block_prefetch(size_t block, size_t count, int flags);
+
+/**
+ * block_cache_drop - Evict consecutive blocks from the block cache
+ * @block: Index of the first block to evict
+ * @count: Number of blocks to evict
+ *
+ * Blocks only written to the cache stay until they are written back.
+ *
+ * Return: -1 if there was no virtual disk file opened. 0 otherwise.
+ */
+int block_cache_drop(size_t block, size_t count);
+
+/**
+ * block_cache_stats - Get the block cache's hit counts
+ * @hits: Set to the number of blocks found in the cache
+ * @lookups: Set to the number of blocks looked up
+ *
+ * Return: -1 if there was no virtual disk file opened. 0 otherwise.
+ */
+int block_cache_stats(size_t *hits, size_t *lookups);
+
+/**
+ * block_cache_writeback - Switch the block cache to write-back mode
+ * @dirty_max: Most blocks written to the cache only, 0 to write through
+ *
+ * In write-back mode, block_write() and block_write_many() only write to the
+ * block cache and the blocks are dirty until block_writeback() or
+ * block_disk_flush() writes them to the disk; every read sees them meanwhile.
+ * A write that would take the dirty blocks past @dirty_max first writes back
+ * the oldest ones itself, down to half of @dirty_max, and one of more than
+ * @dirty_max blocks writes through. Leaving write-back mode writes every dirty block back.
+ *
+ * Return: -1 if there was no virtual disk file opened, if @dirty_max is larger
+ * than the cache, or if the dirty blocks cannot be written back. 0 otherwise.
+ */
+int block_cache_writeback(size_t dirty_max);
+
+/**
+ * block_writeback - Write dirty blocks back to the disk
+ * @age_ms: Write back the blocks dirty for at least that many milliseconds
+ * @keep: Then write back the oldest ones until at most that many are left
+ *
+ * Consecutive blocks are written in one request each, without a flush. Meant
+ * to run in a thread of its own: the disk lock is released between requests,
+ * so that reads and writes keep going meanwhile.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if writing fails.
+ * Otherwise, the number of blocks written back.
+ */
+long block_writeback(unsigned int age_ms, size_t keep);
+
+/**
+ * block_cache_dirty - Get the block cache's fill
+ * @dirty: Set to the number of dirty blocks
+ * @slots: Set to the number of blocks the cache holds
+ *
+ * Return: -1 if there was no virtual disk file opened. 0 otherwise.
+ */
+int block_cache_dirty(size_t *dirty, size_t *slots);
+
+/*
+ * Backends
+ *
+ * The virtual disk forwards every operation to a backend through the
+ * operations table below. Wrapping backends (e.g. to shape the traffic of
+ * another one) open their inner device with block_dev_open().
+ */
+
+/**
+ * struct block_dev - Open instance of a backend
+ * @backend: Operations of the backend serving this device
+ * @priv: Backend-private state
+ * @block_size: Size in bytes of the blocks requests are expressed in;
+ *   wrapping backends keep their inner devices in step with it
+ */
+struct block_dev {
+	const struct block_backend *backend;
+	void *priv;
+	size_t block_size;
+};
+
+/**
+ * struct block_backend - Block device backend operations
+ * @name: Prefix selecting the backend in block_disk_open(), without the ':'
+ * @open: Open @diskname (with the prefix stripped) into @dev, 0 or -1
+ * @close: Close @dev and release its state, 0 or -1
+ * @read: Read @count blocks starting at @block into @buf, 0 or -1
+ * @write: Write @count blocks starting at @block from @buf, 0 or -1
+ * @count: Number of whole blocks of @dev->block_size bytes the device holds
+ * @flush: Make every completed write durable, 0 or -1
+ * @discard: Release the storage of @count blocks starting at @block, which
+ *   then read back as zeroes, 0 or -1 (optional)
+ * @copy_from: Write @count blocks starting at @block with the bytes at
+ *   @offset in host file @fd, 0 or -1 (optional)
+ * @map: Map @count blocks starting at @block into memory, shared with the
+ *   device unless %BLOCK_MAP_PRIVATE is given, and return their address or
+ *   NULL (optional, with @unmap)
+ * @unmap: Undo @map for the same @block and @count, 0 or -1
+ *
+ * The virtual disk checks the bounds of every request before handing it to
+ * the backend.
+ */
+struct block_backend {
+	const char *name;
+	int (*open)(struct block_dev *dev, const char *diskname);
+	int (*close)(struct block_dev *dev);
+	int (*read)(struct block_dev *dev, size_t block, size_t count, void *buf);
+	int (*write)(struct block_dev *dev, size_t block, size_t count,
+		     const void *buf);
+	size_t (*count)(struct block_dev *dev);
+	int (*flush)(struct block_dev *dev);
+	int (*discard)(struct block_dev *dev, size_t block, size_t count);
+	int (*copy_from)(struct block_dev *dev, size_t block, size_t count, int fd,
+			 off_t offset);
+	void *(*map)(struct block_dev *dev, size_t block, size_t count, int flags);
+	int (*unmap)(struct block_dev *dev, void *addr, size_t block, size_t count);
+};
+
+/** Host file backend, used when @diskname has no backend prefix */
+extern const struct block_backend block_backend_file;
+
+/**
+ * RAM disk backend: "ram:<count>" is a zeroed disk of <count> blocks of
+ * %BLOCK_SIZE bytes, "ram:<path>" a private in-memory copy of disk image
+ * <path>. Either way, nothing is written back and the content is lost on
+ * close.
+ */
+extern const struct block_backend block_backend_ram;
+
+/**
+ * Latency-injecting backend wrapping another device, for performance
+ * modeling: "lat:<spec>:<diskname>" opens <diskname> (which can itself have
+ * a backend prefix) and delays every request according to <spec>. <spec> is
+ * a preset ("hdd", "ssd" or "nas") and/or comma-separated settings, e.g.
+ * "hdd,bw=80M" or "req=100,block=5,jitter=exp,jit=50":
+ * - req=<us>: fixed cost of every request
+ * - block=<us>: additional cost per block
+ * - bw=<bytes>[K|M|G]: transfer rate per second
+ * - jitter=none|uniform|exp, jit=<us>: random extra delay and its mean
+ * - seek=<us>, seekk=<us>, seekmax=<us>: cost of a non-sequential request,
+ *   plus seekk per 1000 blocks of distance, capped at seekmax
+ */
+extern const struct block_backend block_backend_lat;
+
+/**
+ * Striping (RAID-0) backend: "stripe:<unit>:<disk>+<disk>[+...]" presents
+ * two or more member disks (each of which can have its own backend prefix)
+ * as one device, with consecutive runs of <unit> blocks laid out round-robin
+ * across the members. Requests spanning several members are carried out on
+ * all of them in parallel. The device holds as many whole units as the
+ * smallest member, times the number of members.
+ */
+extern const struct block_backend block_backend_stripe;
+
+/**
+ * block_backend_register - Make a backend selectable by name
+ * @backend: Backend to register
+ *
+ * Return: -1 if @backend is invalid, if a backend with the same name is
+ * already registered or if the registry is full. 0 otherwise.
+ */
+int block_backend_register(const struct block_backend *backend);
+
+/**
+ * block_dev_open - Open a device through the backend its name selects
+ * @dev: Device to open
+ * @diskname: Disk name, optionally prefixed with "<backend>:"
+ *
+ * Return: -1 if the backend cannot open @diskname. 0 otherwise.
+ */
+int block_dev_open(struct block_dev *dev, const char *diskname);
+
 #endif /* _DISK_H */
 
@@ -0,0 +1,291 @@
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "disk.h"
+
+#define block_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Longest "<spec>" accepted in "lat:<spec>:<diskname>" */
+#define SPEC_MAX_LEN 256
+
+enum jitter {
+	JITTER_NONE,
+	JITTER_UNIFORM,		// Uniform in [0, 2 * jitter_us]
+	JITTER_EXP,			// Exponential with mean jitter_us
+};
+
+/* Timing model applied to every request */
+struct lat_model {
+	/* Fixed cost of any request */
+	unsigned long req_us;
+	/* Additional cost of each block of a request */
+	unsigned long block_us;
+	/* Transfer rate, 0 for unlimited */
+	unsigned long long bw_bytes;
+	/* Random extra delay */
+	enum jitter jitter;
+	unsigned long jitter_us;
+	/* Cost of a non-sequential request, growing with the distance */
+	unsigned long seek_us;
+	unsigned long seek_kblock_us;
+	unsigned long seek_max_us;
+};
+
+static const struct {
+	const char *name;
+	struct lat_model model;
+} presets[] = {
+	{ "hdd", { .req_us = 100, .bw_bytes = 150ULL << 20,
+		   .jitter = JITTER_EXP, .jitter_us = 500,
+		   .seek_us = 2000, .seek_kblock_us = 50,
+		   .seek_max_us = 12000 } },
+	{ "ssd", { .req_us = 80, .bw_bytes = 500ULL << 20,
+		   .jitter = JITTER_UNIFORM, .jitter_us = 20 } },
+	{ "nas", { .req_us = 500, .bw_bytes = 110ULL << 20,
+		   .jitter = JITTER_EXP, .jitter_us = 300 } },
+};
+
+/* Throttled device state */
+struct lat_disk {
+	struct block_dev inner;
+	struct lat_model model;
+	/* Block following the previous request, to detect seeks */
+	size_t next_block;
+	unsigned int seed;
+};
+
+/* Parse a size with an optional K, M or G suffix */
+static int parse_size(const char *str, unsigned long long *val)
+{
+	char *end;
+
+	errno = 0;
+	*val = strtoull(str, &end, 10);
+	if (errno || end == str)
+		return -1;
+
+	switch (*end) {
+	case 'G': *val <<= 10; /* fallthrough */
+	case 'M': *val <<= 10; /* fallthrough */
+	case 'K': *val <<= 10; end++; break;
+	default: break;
+	}
+
+	return *end == '\0' ? 0 : -1;
+}
+
+/*
+ * Parse "<preset>" or a comma-separated list of "key=value" settings, which
+ * can also start from a preset: "hdd,bw=80M"
+ */
+static int parse_spec(struct lat_model *model, char *spec)
+{
+	memset(model, 0, sizeof(*model));
+
+	for (char *tok = strtok(spec, ","); tok; tok = strtok(NULL, ",")) {
+		char *val = strchr(tok, '=');
+		unsigned long long num = 0;
+
+		if (!val) {
+			size_t i;
+			for (i = 0; i < sizeof(presets) / sizeof(presets[0]); i++) {
+				if (!strcmp(tok, presets[i].name)) {
+					*model = presets[i].model;
+					break;
+				}
+			}
+			if (i == sizeof(presets) / sizeof(presets[0])) {
+				block_error("unknown preset '%s'", tok);
+				return -1;
+			}
+			continue;
+		}
+		*val++ = '\0';
+
+		if (!strcmp(tok, "jitter")) {
+			if (!strcmp(val, "none"))
+				model->jitter = JITTER_NONE;
+			else if (!strcmp(val, "uniform"))
+				model->jitter = JITTER_UNIFORM;
+			else if (!strcmp(val, "exp"))
+				model->jitter = JITTER_EXP;
+			else
+				goto bad;
+			continue;
+		}
+
+		if (parse_size(val, &num))
+			goto bad;
+
+		if (!strcmp(tok, "req"))
+			model->req_us = num;
+		else if (!strcmp(tok, "block"))
+			model->block_us = num;
+		else if (!strcmp(tok, "bw"))
+			model->bw_bytes = num;
+		else if (!strcmp(tok, "jit"))
+			model->jitter_us = num;
+		else if (!strcmp(tok, "seek"))
+			model->seek_us = num;
+		else if (!strcmp(tok, "seekk"))
+			model->seek_kblock_us = num;
+		else if (!strcmp(tok, "seekmax"))
+			model->seek_max_us = num;
+		else
+			goto bad;
+		continue;
+bad:
+		block_error("invalid setting '%s=%s'", tok, val);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Sleep for as long as the model says request @block, @count takes */
+static void lat_delay(struct lat_disk *lat, size_t block, size_t count)
+{
+	const struct lat_model *m = &lat->model;
+	double us = m->req_us + (double)m->block_us * count;
+
+	if (m->bw_bytes)
+		us += (double)count * lat->inner.block_size * 1e6 / m->bw_bytes;
+
+	if (block != lat->next_block && (m->seek_us || m->seek_kblock_us)) {
+		size_t dist = block > lat->next_block ?
+			block - lat->next_block : lat->next_block - block;
+		double seek = m->seek_us + (double)m->seek_kblock_us * dist / 1000;
+		if (m->seek_max_us && seek > m->seek_max_us)
+			seek = m->seek_max_us;
+		us += seek;
+	}
+	lat->next_block = block + count;
+
+	if (m->jitter_us) {
+		double u = (rand_r(&lat->seed) + 1.0) / ((double)RAND_MAX + 2.0);
+		if (m->jitter == JITTER_UNIFORM)
+			us += 2.0 * m->jitter_us * u;
+		else if (m->jitter == JITTER_EXP)
+			us += -log(u) * m->jitter_us;
+	}
+
+	struct timespec ts = {
+		.tv_sec = (time_t)(us / 1e6),
+		.tv_nsec = (long)((us - (time_t)(us / 1e6) * 1e6) * 1e3),
+	};
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+/* State of @dev, with the inner device following its block size */
+static struct lat_disk *lat_get(struct block_dev *dev)
+{
+	struct lat_disk *lat = dev->priv;
+
+	lat->inner.block_size = dev->block_size;
+	return lat;
+}
+
+static int lat_open(struct block_dev *dev, const char *diskname)
+{
+	char spec[SPEC_MAX_LEN];
+	const char *sep = strchr(diskname, ':');
+	struct lat_disk *lat;
+
+	if (!sep || (size_t)(sep - diskname) >= sizeof(spec)) {
+		block_error("expected 'lat:<spec>:<diskname>'");
+		return -1;
+	}
+	memcpy(spec, diskname, sep - diskname);
+	spec[sep - diskname] = '\0';
+
+	lat = calloc(1, sizeof(*lat));
+	if (!lat)
+		return -1;
+
+	if (parse_spec(&lat->model, spec) ||
+	    block_dev_open(&lat->inner, sep + 1)) {
+		free(lat);
+		return -1;
+	}
+	lat->seed = 150;
+	dev->priv = lat;
+
+	return 0;
+}
+
+static int lat_close(struct block_dev *dev)
+{
+	struct lat_disk *lat = dev->priv;
+	int ret = lat->inner.backend->close(&lat->inner);
+
+	free(lat);
+
+	return ret;
+}
+
+static int lat_read(struct block_dev *dev, size_t block, size_t count,
+		    void *buf)
+{
+	struct lat_disk *lat = lat_get(dev);
+
+	lat_delay(lat, block, count);
+	return lat->inner.backend->read(&lat->inner, block, count, buf);
+}
+
+static int lat_write(struct block_dev *dev, size_t block, size_t count,
+		     const void *buf)
+{
+	struct lat_disk *lat = lat_get(dev);
+
+	lat_delay(lat, block, count);
+	return lat->inner.backend->write(&lat->inner, block, count, buf);
+}
+
+static size_t lat_count(struct block_dev *dev)
+{
+	struct lat_disk *lat = lat_get(dev);
+
+	return lat->inner.backend->count(&lat->inner);
+}
+
+static int lat_flush(struct block_dev *dev)
+{
+	struct lat_disk *lat = lat_get(dev);
+
+	if (!lat->inner.backend->flush)
+		return 0;
+
+	/* A flush costs one request round trip on the modeled medium */
+	lat_delay(lat, lat->next_block, 0);
+	return lat->inner.backend->flush(&lat->inner);
+}
+
+static int lat_discard(struct block_dev *dev, size_t block, size_t count)
+{
+	struct lat_disk *lat = lat_get(dev);
+
+	if (!lat->inner.backend->discard)
+		return 0;
+
+	/* Nothing is transferred, only the request itself costs time */
+	lat_delay(lat, block, 0);
+	return lat->inner.backend->discard(&lat->inner, block, count);
+}
+
+const struct block_backend block_backend_lat = {
+	.name = "lat",
+	.open = lat_open,
+	.close = lat_close,
+	.read = lat_read,
+	.write = lat_write,
+	.count = lat_count,
+	.flush = lat_flush,
+	.discard = lat_discard,
+};
@@ -0,0 +1,205 @@
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "disk.h"
+
+#define block_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* RAM disk state */
+struct ram_disk {
+	/* Disk content */
+	char *data;
+	/* Size in bytes */
+	size_t size;
+};
+
+/* Whether @name is a block count rather than an image path */
+static int is_count(const char *name)
+{
+	if (*name == '\0')
+		return 0;
+	for (; *name; name++)
+		if (!isdigit((unsigned char)*name))
+			return 0;
+	return 1;
+}
+
+/* Copy host disk image @path into @ram */
+static int ram_load(struct ram_disk *ram, const char *path)
+{
+	struct stat st;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		close(fd);
+		return -1;
+	}
+
+	/* The disk image's size should be a multiple of the block size */
+	if (st.st_size % BLOCK_SIZE_MIN != 0) {
+		block_error("size '%zu' is not multiple of '%d'",
+			    st.st_size, BLOCK_SIZE_MIN);
+		close(fd);
+		return -1;
+	}
+
+	ram->size = st.st_size;
+	ram->data = malloc(st.st_size ? st.st_size : 1);
+	if (!ram->data) {
+		close(fd);
+		return -1;
+	}
+
+	for (off_t off = 0; off < st.st_size; ) {
+		ssize_t ret = pread(fd, ram->data + off, st.st_size - off, off);
+		if (ret <= 0) {
+			if (ret < 0)
+				perror("pread");
+			free(ram->data);
+			close(fd);
+			return -1;
+		}
+		off += ret;
+	}
+	close(fd);
+
+	return 0;
+}
+
+static int ram_open(struct block_dev *dev, const char *diskname)
+{
+	struct ram_disk *ram = calloc(1, sizeof(*ram));
+
+	if (!ram)
+		return -1;
+
+	if (is_count(diskname)) {
+		size_t bcount = strtoul(diskname, NULL, 10);
+		ram->size = bcount * BLOCK_SIZE;
+		ram->data = calloc(bcount ? bcount : 1, BLOCK_SIZE);
+		if (!ram->data) {
+			block_error("cannot allocate %zu blocks", bcount);
+			free(ram);
+			return -1;
+		}
+	} else if (ram_load(ram, diskname)) {
+		free(ram);
+		return -1;
+	}
+
+	dev->priv = ram;
+
+	return 0;
+}
+
+static int ram_close(struct block_dev *dev)
+{
+	struct ram_disk *ram = dev->priv;
+
+	free(ram->data);
+	free(ram);
+
+	return 0;
+}
+
+static int ram_read(struct block_dev *dev, size_t block, size_t count,
+		    void *buf)
+{
+	struct ram_disk *ram = dev->priv;
+
+	memcpy(buf, ram->data + block * dev->block_size, count * dev->block_size);
+
+	return 0;
+}
+
+static int ram_write(struct block_dev *dev, size_t block, size_t count,
+		     const void *buf)
+{
+	struct ram_disk *ram = dev->priv;
+
+	memcpy(ram->data + block * dev->block_size, buf, count * dev->block_size);
+
+	return 0;
+}
+
+static size_t ram_count(struct block_dev *dev)
+{
+	struct ram_disk *ram = dev->priv;
+
+	return ram->size / dev->block_size;
+}
+
+static int ram_flush(struct block_dev *dev)
+{
+	(void)dev;
+
+	/* Nothing is ever more durable than memory here */
+	return 0;
+}
+
+static int ram_discard(struct block_dev *dev, size_t block, size_t count)
+{
+	struct ram_disk *ram = dev->priv;
+
+	memset(ram->data + block * dev->block_size, 0, count * dev->block_size);
+
+	return 0;
+}
+
+static void *ram_map(struct block_dev *dev, size_t block, size_t count,
+		     int flags)
+{
+	struct ram_disk *ram = dev->priv;
+	char *blocks = ram->data + block * dev->block_size;
+
+	/* Already in memory: hand out the blocks themselves, or a copy of them */
+	if (!(flags & BLOCK_MAP_PRIVATE))
+		return blocks;
+
+	char *copy = malloc(count * dev->block_size);
+	if (!copy) {
+		perror("malloc");
+		return NULL;
+	}
+	memcpy(copy, blocks, count * dev->block_size);
+
+	return copy;
+}
+
+static int ram_unmap(struct block_dev *dev, void *addr, size_t block,
+		     size_t count)
+{
+	struct ram_disk *ram = dev->priv;
+
+	(void)count;
+
+	if (addr != ram->data + block * dev->block_size)
+		free(addr);
+
+	return 0;
+}
+
+const struct block_backend block_backend_ram = {
+	.name = "ram",
+	.open = ram_open,
+	.close = ram_close,
+	.read = ram_read,
+	.write = ram_write,
+	.count = ram_count,
+	.flush = ram_flush,
+	.discard = ram_discard,
+	.map = ram_map,
+	.unmap = ram_unmap,
+};
@@ -0,0 +1,342 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk.h"
+
+#define block_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Maximum number of member disks */
+#define STRIPE_MAX_MEMBERS 16
+
+/* Contiguous piece of a request that lands on one member */
+struct stripe_seg {
+	size_t block;		// Block index on the member
+	size_t count;
+	char *buf;
+};
+
+/* Member disk and the worker thread that serves it */
+struct stripe_member {
+	struct block_dev dev;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Pending job, handed over by the requesting thread */
+	struct stripe_seg *segs;
+	size_t num_segs;
+	bool write;
+	bool busy;
+	bool stop;
+	int ret;
+};
+
+/* Striped device state */
+struct stripe_disk {
+	struct stripe_member members[STRIPE_MAX_MEMBERS];
+	int num_members;
+	size_t unit;		// Stripe unit, in blocks
+	/* One request at a time: members hold a single job each */
+	pthread_mutex_t lock;
+	/* Per-member segment lists, sized for the largest request so far */
+	struct stripe_seg *segs[STRIPE_MAX_MEMBERS];
+	size_t max_segs;
+};
+
+static int member_run(struct stripe_member *m)
+{
+	for (size_t i = 0; i < m->num_segs; i++) {
+		struct stripe_seg *seg = &m->segs[i];
+		int ret = m->write ?
+			m->dev.backend->write(&m->dev, seg->block, seg->count, seg->buf) :
+			m->dev.backend->read(&m->dev, seg->block, seg->count, seg->buf);
+		if (ret)
+			return -1;
+	}
+	return 0;
+}
+
+static void *member_worker(void *arg)
+{
+	struct stripe_member *m = arg;
+
+	pthread_mutex_lock(&m->lock);
+	for (;;) {
+		while (!m->busy && !m->stop)
+			pthread_cond_wait(&m->cond, &m->lock);
+		if (m->stop)
+			break;
+		pthread_mutex_unlock(&m->lock);
+
+		int ret = member_run(m);
+
+		pthread_mutex_lock(&m->lock);
+		m->ret = ret;
+		m->busy = false;
+		pthread_cond_broadcast(&m->cond);
+	}
+	pthread_mutex_unlock(&m->lock);
+
+	return NULL;
+}
+
+static void stripe_release(struct stripe_disk *sd)
+{
+	for (int i = 0; i < sd->num_members; i++) {
+		struct stripe_member *m = &sd->members[i];
+
+		pthread_mutex_lock(&m->lock);
+		m->stop = true;
+		pthread_cond_signal(&m->cond);
+		pthread_mutex_unlock(&m->lock);
+		pthread_join(m->thread, NULL);
+
+		m->dev.backend->close(&m->dev);
+		free(sd->segs[i]);
+	}
+	free(sd);
+}
+
+/* "<unit>:<disk>+<disk>+..." */
+static int stripe_open(struct block_dev *dev, const char *diskname)
+{
+	struct stripe_disk *sd;
+	char *end, *names, *name, *save;
+	size_t unit;
+
+	unit = strtoul(diskname, &end, 10);
+	if (end == diskname || *end != ':' || unit == 0) {
+		block_error("expected 'stripe:<unit>:<disk>+<disk>[+...]'");
+		return -1;
+	}
+
+	sd = calloc(1, sizeof(*sd));
+	names = strdup(end + 1);
+	if (!sd || !names) {
+		free(sd);
+		free(names);
+		return -1;
+	}
+	sd->unit = unit;
+	pthread_mutex_init(&sd->lock, NULL);
+
+	for (name = strtok_r(names, "+", &save); name;
+	     name = strtok_r(NULL, "+", &save)) {
+		struct stripe_member *m = &sd->members[sd->num_members];
+
+		if (sd->num_members == STRIPE_MAX_MEMBERS) {
+			block_error("more than %d members", STRIPE_MAX_MEMBERS);
+			goto err;
+		}
+		if (block_dev_open(&m->dev, name))
+			goto err;
+
+		pthread_mutex_init(&m->lock, NULL);
+		pthread_cond_init(&m->cond, NULL);
+		if (pthread_create(&m->thread, NULL, member_worker, m)) {
+			m->dev.backend->close(&m->dev);
+			goto err;
+		}
+		sd->num_members++;
+	}
+	free(names);
+	names = NULL;
+
+	if (sd->num_members < 2) {
+		block_error("need at least two members");
+		goto err;
+	}
+
+	dev->priv = sd;
+	return 0;
+
+err:
+	free(names);
+	stripe_release(sd);
+	return -1;
+}
+
+static int stripe_close(struct block_dev *dev)
+{
+	stripe_release(dev->priv);
+
+	return 0;
+}
+
+/* State of @dev, with the members following its block size */
+static struct stripe_disk *stripe_get(struct block_dev *dev)
+{
+	struct stripe_disk *sd = dev->priv;
+
+	for (int i = 0; i < sd->num_members; i++)
+		sd->members[i].dev.block_size = dev->block_size;
+	return sd;
+}
+
+/* Split a request into per-member segments and run them in parallel */
+static int stripe_io(struct block_dev *dev, size_t block, size_t count,
+		     char *buf, bool write)
+{
+	struct stripe_disk *sd = stripe_get(dev);
+	size_t nsegs[STRIPE_MAX_MEMBERS] = { 0 };
+	int ret = 0;
+
+	pthread_mutex_lock(&sd->lock);
+
+	/* A request touches at most this many units, hence segments */
+	size_t need = count / sd->unit + 2;
+	if (need > sd->max_segs) {
+		for (int i = 0; i < sd->num_members; i++) {
+			void *segs = realloc(sd->segs[i], need * sizeof(struct stripe_seg));
+			if (!segs) {
+				pthread_mutex_unlock(&sd->lock);
+				return -1;
+			}
+			sd->segs[i] = segs;
+		}
+		sd->max_segs = need;
+	}
+
+	while (count > 0) {
+		size_t stripe = block / sd->unit;
+		size_t within = block % sd->unit;
+		int member = stripe % sd->num_members;
+		size_t mblock = stripe / sd->num_members * sd->unit + within;
+		size_t len = sd->unit - within < count ? sd->unit - within : count;
+
+		/* A member's segments are adjacent on it, so it streams them */
+		sd->segs[member][nsegs[member]++] = (struct stripe_seg){ mblock, len, buf };
+
+		block += len;
+		count -= len;
+		buf += len * dev->block_size;
+	}
+
+	int used = 0, last = -1;
+	for (int i = 0; i < sd->num_members; i++) {
+		if (nsegs[i]) {
+			used++;
+			last = i;
+		}
+	}
+
+	/* A request within one unit needs no hand-off */
+	if (used == 1) {
+		struct stripe_member *m = &sd->members[last];
+		m->segs = sd->segs[last];
+		m->num_segs = nsegs[last];
+		m->write = write;
+		ret = member_run(m);
+		pthread_mutex_unlock(&sd->lock);
+		return ret;
+	}
+
+	for (int i = 0; i < sd->num_members; i++) {
+		struct stripe_member *m = &sd->members[i];
+		if (!nsegs[i])
+			continue;
+		pthread_mutex_lock(&m->lock);
+		m->segs = sd->segs[i];
+		m->num_segs = nsegs[i];
+		m->write = write;
+		m->busy = true;
+		pthread_cond_signal(&m->cond);
+		pthread_mutex_unlock(&m->lock);
+	}
+
+	for (int i = 0; i < sd->num_members; i++) {
+		struct stripe_member *m = &sd->members[i];
+		if (!nsegs[i])
+			continue;
+		pthread_mutex_lock(&m->lock);
+		while (m->busy)
+			pthread_cond_wait(&m->cond, &m->lock);
+		if (m->ret)
+			ret = -1;
+		pthread_mutex_unlock(&m->lock);
+	}
+
+	pthread_mutex_unlock(&sd->lock);
+	return ret;
+}
+
+static int stripe_read(struct block_dev *dev, size_t block, size_t count,
+		       void *buf)
+{
+	return stripe_io(dev, block, count, buf, false);
+}
+
+static int stripe_write(struct block_dev *dev, size_t block, size_t count,
+			const void *buf)
+{
+	/* Writes never modify @buf, the cast only shares the split logic */
+	return stripe_io(dev, block, count, (char *)buf, true);
+}
+
+static size_t stripe_count(struct block_dev *dev)
+{
+	struct stripe_disk *sd = stripe_get(dev);
+	size_t min = SIZE_MAX;
+
+	/* Whole stripe units of the smallest member */
+	for (int i = 0; i < sd->num_members; i++) {
+		struct block_dev *m = &sd->members[i].dev;
+		size_t count = m->backend->count(m);
+		if (count < min)
+			min = count;
+	}
+
+	return min / sd->unit * sd->unit * sd->num_members;
+}
+
+static int stripe_flush(struct block_dev *dev)
+{
+	struct stripe_disk *sd = dev->priv;
+	int ret = 0;
+
+	for (int i = 0; i < sd->num_members; i++) {
+		struct block_dev *m = &sd->members[i].dev;
+		if (m->backend->flush && m->backend->flush(m))
+			ret = -1;
+	}
+
+	return ret;
+}
+
+static int stripe_discard(struct block_dev *dev, size_t block, size_t count)
+{
+	struct stripe_disk *sd = stripe_get(dev);
+	int ret = 0;
+
+	/* Discards carry no data, so issue them unit by unit from here */
+	while (count > 0) {
+		size_t stripe = block / sd->unit;
+		size_t within = block % sd->unit;
+		struct block_dev *m = &sd->members[stripe % sd->num_members].dev;
+		size_t mblock = stripe / sd->num_members * sd->unit + within;
+		size_t len = sd->unit - within < count ? sd->unit - within : count;
+
+		if (m->backend->discard && m->backend->discard(m, mblock, len))
+			ret = -1;
+
+		block += len;
+		count -= len;
+	}
+
+	return ret;
+}
+
+const struct block_backend block_backend_stripe = {
+	.name = "stripe",
+	.open = stripe_open,
+	.close = stripe_close,
+	.read = stripe_read,
+	.write = stripe_write,
+	.count = stripe_count,
+	.flush = stripe_flush,
+	.discard = stripe_discard,
+};
@@ -0,0 +1,625 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "fat_scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FAT_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+/* Largest entry value that is still a reference into an @n-entry table */
+static uint16_t last_index(size_t n)
+{
+	return n - 1 > UINT16_MAX ? UINT16_MAX : (uint16_t)(n - 1);
+}
+
+/*
+ * Scalar kernels
+ */
+
+static size_t scalar_count_free(const uint16_t *fat, size_t n)
+{
+	size_t count = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (fat[i] == 0) {
+			count++;
+		}
+	}
+	return count;
+}
+
+static size_t scalar_find_free(const uint16_t *fat, size_t from, size_t n)
+{
+	for (size_t i = from; i < n; i++) {
+		if (fat[i] == 0) {
+			return i;
+		}
+	}
+	return n;
+}
+
+static size_t scalar_find_used(const uint16_t *fat, size_t from, size_t n)
+{
+	for (size_t i = from; i < n; i++) {
+		if (fat[i] != 0) {
+			return i;
+		}
+	}
+	return n;
+}
+
+static uint64_t scalar_free_mask(const uint16_t *fat)
+{
+	uint64_t mask = 0;
+	for (int i = 0; i < 64; i++) {
+		if (fat[i] == 0) {
+			mask |= 1ULL << i;
+		}
+	}
+	return mask;
+}
+
+static size_t scalar_validate(const uint16_t *fat, size_t n, uint16_t eoc)
+{
+	for (size_t i = 0; i < n; i++) {
+		if (fat[i] != eoc && fat[i] >= n) {
+			return i;
+		}
+	}
+	return n;
+}
+
+const struct fatKernels fat_kernels_scalar = {
+	.name = "scalar",
+	.count_free = scalar_count_free,
+	.find_free = scalar_find_free,
+	.find_used = scalar_find_used,
+	.free_mask = scalar_free_mask,
+	.validate = scalar_validate,
+};
+
+#ifdef FAT_SCAN_X86
+
+/*
+ * SSE2 kernels: 8 entries per step. Per-lane counters are 16-bit, so they
+ * are folded into the total before they can wrap.
+ */
+
+#define SSE2_LANES 8
+#define SSE2_FOLD (UINT16_MAX * SSE2_LANES)
+
+__attribute__((target("sse2")))
+static size_t sse2_fold(__m128i acc)
+{
+	uint16_t lanes[SSE2_LANES];
+	size_t sum = 0;
+
+	_mm_storeu_si128((__m128i *)lanes, acc);
+	for (int i = 0; i < SSE2_LANES; i++) {
+		sum += lanes[i];
+	}
+	return sum;
+}
+
+__attribute__((target("sse2")))
+static size_t sse2_count_free(const uint16_t *fat, size_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t count = 0, i = 0;
+
+	while (i + SSE2_LANES <= n) {
+		size_t end = i + SSE2_FOLD < n ? i + SSE2_FOLD : n;
+		__m128i acc = _mm_setzero_si128();
+		for (; i + SSE2_LANES <= end; i += SSE2_LANES) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(fat + i));
+			/* Matching lanes are all ones, i.e. -1 */
+			acc = _mm_sub_epi16(acc, _mm_cmpeq_epi16(v, zero));
+		}
+		count += sse2_fold(acc);
+	}
+	return count + scalar_count_free(fat + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static size_t sse2_find(const uint16_t *fat, size_t from, size_t n, bool used)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = from;
+
+	for (; i + SSE2_LANES <= n; i += SSE2_LANES) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(fat + i));
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(v, zero));
+		if (used) {
+			mask ^= 0xFFFF;
+		}
+		if (mask) {
+			return i + __builtin_ctz(mask) / 2;
+		}
+	}
+	return used ? scalar_find_used(fat, i, n) : scalar_find_free(fat, i, n);
+}
+
+static size_t sse2_find_free(const uint16_t *fat, size_t from, size_t n)
+{
+	return sse2_find(fat, from, n, false);
+}
+
+static size_t sse2_find_used(const uint16_t *fat, size_t from, size_t n)
+{
+	return sse2_find(fat, from, n, true);
+}
+
+__attribute__((target("sse2")))
+static uint64_t sse2_free_mask(const uint16_t *fat)
+{
+	const __m128i zero = _mm_setzero_si128();
+	uint64_t mask = 0;
+
+	for (int i = 0; i < 64; i += 2 * SSE2_LANES) {
+		__m128i lo = _mm_loadu_si128((const __m128i *)(fat + i));
+		__m128i hi = _mm_loadu_si128((const __m128i *)(fat + i + SSE2_LANES));
+		/* Narrow both comparisons to one byte per entry */
+		__m128i eq = _mm_packs_epi16(_mm_cmpeq_epi16(lo, zero),
+					     _mm_cmpeq_epi16(hi, zero));
+		mask |= (uint64_t)_mm_movemask_epi8(eq) << i;
+	}
+	return mask;
+}
+
+__attribute__((target("sse2")))
+static size_t sse2_validate(const uint16_t *fat, size_t n, uint16_t eoc)
+{
+	if (n == 0) {
+		return 0;
+	}
+
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i veoc = _mm_set1_epi16((short)eoc);
+	const __m128i limit = _mm_set1_epi16((short)last_index(n));
+	size_t i = 0;
+
+	for (; i + SSE2_LANES <= n; i += SSE2_LANES) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(fat + i));
+		/* v <= limit (unsigned) iff saturating v - limit is zero */
+		__m128i ok = _mm_or_si128(_mm_cmpeq_epi16(v, veoc),
+			_mm_cmpeq_epi16(_mm_subs_epu16(v, limit), zero));
+		unsigned int bad = _mm_movemask_epi8(ok) ^ 0xFFFF;
+		if (bad) {
+			return i + __builtin_ctz(bad) / 2;
+		}
+	}
+	for (; i < n; i++) {
+		if (fat[i] != eoc && fat[i] >= n) {
+			return i;
+		}
+	}
+	return n;
+}
+
+static const struct fatKernels fat_kernels_sse2 = {
+	.name = "sse2",
+	.count_free = sse2_count_free,
+	.find_free = sse2_find_free,
+	.find_used = sse2_find_used,
+	.free_mask = sse2_free_mask,
+	.validate = sse2_validate,
+};
+
+/*
+ * AVX2 kernels: same as SSE2, 16 entries per step
+ */
+
+#define AVX2_LANES 16
+#define AVX2_FOLD (UINT16_MAX * AVX2_LANES)
+
+__attribute__((target("avx2")))
+static size_t avx2_fold(__m256i acc)
+{
+	uint16_t lanes[AVX2_LANES];
+	size_t sum = 0;
+
+	_mm256_storeu_si256((__m256i *)lanes, acc);
+	for (int i = 0; i < AVX2_LANES; i++) {
+		sum += lanes[i];
+	}
+	return sum;
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_count_free(const uint16_t *fat, size_t n)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	size_t count = 0, i = 0;
+
+	while (i + AVX2_LANES <= n) {
+		size_t end = i + AVX2_FOLD < n ? i + AVX2_FOLD : n;
+		__m256i acc = _mm256_setzero_si256();
+		for (; i + AVX2_LANES <= end; i += AVX2_LANES) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)(fat + i));
+			acc = _mm256_sub_epi16(acc, _mm256_cmpeq_epi16(v, zero));
+		}
+		count += avx2_fold(acc);
+	}
+	return count + scalar_count_free(fat + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_find(const uint16_t *fat, size_t from, size_t n, bool used)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	size_t i = from;
+
+	for (; i + AVX2_LANES <= n; i += AVX2_LANES) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(fat + i));
+		unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi16(v, zero));
+		if (used) {
+			mask = ~mask;
+		}
+		if (mask) {
+			return i + __builtin_ctz(mask) / 2;
+		}
+	}
+	return used ? scalar_find_used(fat, i, n) : scalar_find_free(fat, i, n);
+}
+
+static size_t avx2_find_free(const uint16_t *fat, size_t from, size_t n)
+{
+	return avx2_find(fat, from, n, false);
+}
+
+static size_t avx2_find_used(const uint16_t *fat, size_t from, size_t n)
+{
+	return avx2_find(fat, from, n, true);
+}
+
+__attribute__((target("avx2")))
+static uint64_t avx2_free_mask(const uint16_t *fat)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	uint64_t mask = 0;
+
+	for (int i = 0; i < 64; i += 2 * AVX2_LANES) {
+		__m256i lo = _mm256_loadu_si256((const __m256i *)(fat + i));
+		__m256i hi = _mm256_loadu_si256((const __m256i *)(fat + i + AVX2_LANES));
+		/* Packing works per 128-bit lane, so restore entry order after */
+		__m256i eq = _mm256_packs_epi16(_mm256_cmpeq_epi16(lo, zero),
+						_mm256_cmpeq_epi16(hi, zero));
+		eq = _mm256_permute4x64_epi64(eq, 0xD8);
+		mask |= (uint64_t)(uint32_t)_mm256_movemask_epi8(eq) << i;
+	}
+	return mask;
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_validate(const uint16_t *fat, size_t n, uint16_t eoc)
+{
+	if (n == 0) {
+		return 0;
+	}
+
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i veoc = _mm256_set1_epi16((short)eoc);
+	const __m256i limit = _mm256_set1_epi16((short)last_index(n));
+	size_t i = 0;
+
+	for (; i + AVX2_LANES <= n; i += AVX2_LANES) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(fat + i));
+		__m256i ok = _mm256_or_si256(_mm256_cmpeq_epi16(v, veoc),
+			_mm256_cmpeq_epi16(_mm256_subs_epu16(v, limit), zero));
+		unsigned int bad = ~(unsigned int)_mm256_movemask_epi8(ok);
+		if (bad) {
+			return i + __builtin_ctz(bad) / 2;
+		}
+	}
+	for (; i < n; i++) {
+		if (fat[i] != eoc && fat[i] >= n) {
+			return i;
+		}
+	}
+	return n;
+}
+
+static const struct fatKernels fat_kernels_avx2 = {
+	.name = "avx2",
+	.count_free = avx2_count_free,
+	.find_free = avx2_find_free,
+	.find_used = avx2_find_used,
+	.free_mask = avx2_free_mask,
+	.validate = avx2_validate,
+};
+
+#endif /* FAT_SCAN_X86 */
+
+/* Supported sets, scalar first and best last */
+static const struct fatKernels *supported[3];
+static size_t numSupported;
+
+static void probe(void)
+{
+	if (numSupported) {
+		return;
+	}
+
+	size_t count = 0;
+	supported[count++] = &fat_kernels_scalar;
+#ifdef FAT_SCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		supported[count++] = &fat_kernels_sse2;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		supported[count++] = &fat_kernels_avx2;
+	}
+#endif
+	/* Racing first callers compute the same answer */
+	__atomic_store_n(&numSupported, count, __ATOMIC_RELEASE);
+}
+
+const struct fatKernels *const *fat_kernels_list(size_t *count)
+{
+	probe();
+	*count = __atomic_load_n(&numSupported, __ATOMIC_ACQUIRE);
+	return supported;
+}
+
+const struct fatKernels *fat_kernels(void)
+{
+	size_t count;
+	const struct fatKernels *const *list = fat_kernels_list(&count);
+	return list[count - 1];
+}
+
+size_t fat_find_free_run(const struct fatKernels *k, const uint16_t *fat,
+			 size_t from, size_t n, size_t len)
+{
+	size_t run = 0, runStart = from;
+
+	if (len == 0) {
+		return from < n ? from : n;
+	}
+
+	/* Skip the used prefix in one go */
+	from = k->find_free(fat, from, n);
+
+	for (size_t i = from; i < n; i += 64) {
+		uint64_t mask;
+		if (i + 64 <= n) {
+			mask = k->free_mask(fat + i);
+		} else {
+			/* Short tail: entries past the table count as used */
+			mask = 0;
+			for (size_t j = i; j < n; j++) {
+				if (fat[j] == 0) {
+					mask |= 1ULL << (j - i);
+				}
+			}
+		}
+
+		if (mask == UINT64_MAX) {
+			if (run == 0) {
+				runStart = i;
+			}
+			run += 64;
+			if (run >= len) {
+				return runStart;
+			}
+			continue;
+		}
+
+		/* Low free entries extend the run carried over from before */
+		size_t low = __builtin_ctzll(~mask);
+		if (run > 0 && run + low >= len) {
+			return runStart;
+		}
+
+		/* Runs contained in this word: bit p survives iff p..p+len-1 free */
+		if (len <= 64) {
+			uint64_t x = mask;
+			for (size_t have = 1; have < len; ) {
+				size_t shift = have < len - have ? have : len - have;
+				x &= x >> shift;
+				have += shift;
+			}
+			if (x) {
+				return i + __builtin_ctzll(x);
+			}
+		}
+
+		/* High free entries start the run carried into the next word */
+		run = mask ? __builtin_clzll(~mask) : 0;
+		runStart = i + 64 - run;
+	}
+	return n;
+}
+
+/*
+ * Chain walking
+ */
+
+/* Stretch of a chain walked by one thread, up to a block claimed before */
+struct walkSeg {
+	size_t len;
+	uint16_t last;			// Last block of the segment, @eoc if empty
+	uint16_t join;			// Claimed block it runs into, @eoc if none
+	bool broken;			// Stopped at a link to a free or missing block
+	/* Resolution */
+	int state;
+	size_t rest;			// Blocks after the segment, up to the chain's end
+};
+
+enum { SEG_NEW, SEG_VISITING, SEG_DONE };
+
+struct walkCtx {
+	const uint16_t *fat;
+	size_t n;
+	uint16_t eoc;
+	struct fatChain *chains;
+	size_t numChains;
+	struct walkSeg *segs;
+	uint64_t *claimed;
+	uint32_t *segOf;		// Segment that claimed each block
+	uint32_t *posOf;		// And where the block is in it
+	size_t next;			// Next chain to hand out
+};
+
+static void walk_seg(struct walkCtx *c, size_t i)
+{
+	struct walkSeg *s = &c->segs[i];
+	uint16_t b = c->chains[i].head;
+
+	s->last = c->eoc;
+	s->join = c->eoc;
+	while (b != c->eoc) {
+		if (b >= c->n || c->fat[b] == 0) {
+			s->broken = true;
+			return;
+		}
+		/* Whoever sets the bit first walks on, the others stop there */
+		uint64_t bit = 1ULL << (b % 64);
+		if (__atomic_fetch_or(&c->claimed[b / 64], bit, __ATOMIC_RELAXED) & bit) {
+			s->join = b;
+			return;
+		}
+		c->segOf[b] = i;
+		c->posOf[b] = s->len++;
+		s->last = b;
+		b = c->fat[b];
+	}
+}
+
+static void *walk_worker(void *arg)
+{
+	struct walkCtx *c = arg;
+
+	for (;;) {
+		size_t i = __atomic_fetch_add(&c->next, 1, __ATOMIC_RELAXED);
+		if (i >= c->numChains) {
+			return NULL;
+		}
+		walk_seg(c, i);
+	}
+}
+
+/* Chain outcome of segment @i once the one it runs into, if any, is known */
+static void walk_settle(struct walkCtx *c, size_t i, bool cycle)
+{
+	struct walkSeg *s = &c->segs[i];
+	struct fatChain *ch = &c->chains[i];
+
+	s->state = SEG_DONE;
+	if (cycle) {
+		s->rest = 0;
+		ch->end = FAT_CHAIN_CYCLE;
+		ch->fixAt = s->last;
+	} else if (s->join != c->eoc) {
+		size_t t = c->segOf[s->join];
+		s->rest = c->segs[t].len - c->posOf[s->join] + c->segs[t].rest;
+		ch->end = c->chains[t].end;
+		ch->fixAt = c->chains[t].fixAt;
+	} else {
+		s->rest = 0;
+		ch->end = s->broken ? FAT_CHAIN_BROKEN : FAT_CHAIN_EOC;
+		ch->fixAt = s->broken ? s->last : c->eoc;
+	}
+	ch->length = s->len + s->rest;
+}
+
+/*
+ * Follow every segment to the end of its chain, without recursion: a chain
+ * can run through as many segments as there are chains.
+ */
+static int walk_resolve(struct walkCtx *c)
+{
+	size_t *stack = malloc(c->numChains * sizeof(size_t));
+	if (stack == NULL) {
+		return -1;
+	}
+
+	for (size_t first = 0; first < c->numChains; first++) {
+		size_t top = 0;
+		stack[top++] = first;
+		while (top > 0) {
+			size_t i = stack[top - 1];
+			struct walkSeg *s = &c->segs[i];
+			if (s->state == SEG_DONE) {
+				top--;
+				continue;
+			}
+			if (s->state == SEG_NEW && s->join != c->eoc) {
+				size_t t = c->segOf[s->join];
+				/* Running into a segment still being followed closes a loop */
+				if (t == i || c->segs[t].state == SEG_VISITING) {
+					walk_settle(c, i, true);
+					top--;
+					continue;
+				}
+				if (c->segs[t].state == SEG_NEW) {
+					s->state = SEG_VISITING;
+					stack[top++] = t;
+					continue;
+				}
+			}
+			walk_settle(c, i, false);
+			top--;
+		}
+	}
+
+	free(stack);
+	return 0;
+}
+
+int fat_walk(const uint16_t *fat, size_t n, uint16_t eoc,
+	     struct fatChain *chains, size_t numChains, int nthreads,
+	     uint64_t *claimed)
+{
+	struct walkCtx c = {
+		.fat = fat, .n = n, .eoc = eoc,
+		.chains = chains, .numChains = numChains,
+		.claimed = claimed,
+	};
+	int ret = -1;
+
+	for (size_t w = 0; w < (n + 63) / 64; w++) {
+		claimed[w] = 0;
+	}
+	if (numChains == 0) {
+		return 0;
+	}
+
+	c.segs = calloc(numChains, sizeof(struct walkSeg));
+	c.segOf = malloc(n * sizeof(uint32_t));
+	c.posOf = malloc(n * sizeof(uint32_t));
+	if (c.segs == NULL || c.segOf == NULL || c.posOf == NULL) {
+		goto out;
+	}
+
+	/* The calling thread walks too */
+	pthread_t threads[FAT_WALK_MAX_THREADS];
+	int started = 0;
+	if (nthreads > FAT_WALK_MAX_THREADS) {
+		nthreads = FAT_WALK_MAX_THREADS;
+	}
+	if ((size_t)nthreads > numChains) {
+		nthreads = numChains;
+	}
+	while (started < nthreads - 1 &&
+	       pthread_create(&threads[started], NULL, walk_worker, &c) == 0) {
+		started++;
+	}
+	walk_worker(&c);
+	for (int t = 0; t < started; t++) {
+		pthread_join(threads[t], NULL);
+	}
+
+	ret = walk_resolve(&c);
+
+out:
+	free(c.segs);
+	free(c.segOf);
+	free(c.posOf);
+	return ret;
+}
@@ -0,0 +1,117 @@
+#ifndef _FAT_SCAN_H
+#define _FAT_SCAN_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/**
+ * struct fatKernels - Set of FAT scanning kernels for one instruction set
+ *
+ * Every kernel works on the first @n entries of @fat, where an entry of 0
+ * marks a free data block.
+ */
+struct fatKernels {
+	const char *name;
+
+	/* Number of free entries */
+	size_t (*count_free)(const uint16_t *fat, size_t n);
+
+	/* Index of the first free entry at or after @from, @n if none */
+	size_t (*find_free)(const uint16_t *fat, size_t from, size_t n);
+
+	/* Index of the first used entry at or after @from, @n if none */
+	size_t (*find_used)(const uint16_t *fat, size_t from, size_t n);
+
+	/* Bitmask of the free entries among the 64 starting at @fat */
+	uint64_t (*free_mask)(const uint16_t *fat);
+
+	/*
+	 * Index of the first entry that is neither free, nor @eoc, nor a valid
+	 * chain reference (below @n), @n if the whole table is sound
+	 */
+	size_t (*validate)(const uint16_t *fat, size_t n, uint16_t eoc);
+};
+
+/** Portable one-entry-at-a-time kernels */
+extern const struct fatKernels fat_kernels_scalar;
+
+/**
+ * fat_kernels_list - Kernel sets usable on this CPU
+ * @count: Filled with the number of sets
+ *
+ * Return: array of the kernel sets this CPU supports, scalar first and best
+ * last.
+ */
+const struct fatKernels *const *fat_kernels_list(size_t *count);
+
+/**
+ * fat_kernels - Best kernel set for this CPU
+ *
+ * Resolved once on first use by probing the CPU at runtime.
+ */
+const struct fatKernels *fat_kernels(void);
+
+/**
+ * fat_find_free_run - Find a run of free entries
+ * @k: Kernel set to scan with
+ * @fat: FAT array
+ * @from: First index to consider
+ * @n: Number of entries in @fat
+ * @len: Number of consecutive free entries wanted
+ *
+ * Return: index of the first entry of the first run of at least @len free
+ * entries at or after @from, @n if there is none.
+ */
+size_t fat_find_free_run(const struct fatKernels *k, const uint16_t *fat,
+			 size_t from, size_t n, size_t len);
+
+/** Most threads fat_walk() runs */
+#define FAT_WALK_MAX_THREADS 64
+
+/** How a chain walked by fat_walk() ends */
+enum fatChainEnd {
+	FAT_CHAIN_EOC,			// Properly, with an end-of-chain entry
+	FAT_CHAIN_BROKEN,		// On a link to a free entry, or past the table
+	FAT_CHAIN_CYCLE,		// Never: it loops back onto itself
+};
+
+/**
+ * struct fatChain - Chain walked by fat_walk()
+ *
+ * Only @head is read, the other fields are filled in.
+ */
+struct fatChain {
+	uint16_t head;			// First entry, or the end-of-chain value for an empty chain
+	enum fatChainEnd end;
+	size_t length;			// Entries up to the end, the break or the loop
+	/*
+	 * Entry to make the end of the chain for it to end properly, or the
+	 * end-of-chain value if it does or if @head itself is the bad link
+	 */
+	uint16_t fixAt;
+};
+
+/**
+ * fat_walk - Walk chains of a FAT in parallel
+ * @fat: FAT array
+ * @n: Number of entries in @fat
+ * @eoc: End-of-chain value
+ * @chains: Chains to walk
+ * @numChains: Number of chains in @chains
+ * @nthreads: Number of threads to walk them with, the calling one included
+ * @claimed: Bitset of @n bits, filled with the entries on any of the chains
+ *
+ * Chains may share their ends, the way copy-on-write clones do, and may be
+ * walked from the same head several times. The threads set the bit of each
+ * entry they reach in @claimed atomically, and stop on an entry some chain
+ * already reached, so that every entry is followed once whatever the
+ * sharing. How each chain ends, and its length, is then worked out from
+ * where the walks ran into each other, which also tells the loops apart.
+ *
+ * Return: -1 if memory runs out, 0 otherwise.
+ */
+int fat_walk(const uint16_t *fat, size_t n, uint16_t eoc,
+	     struct fatChain *chains, size_t numChains, int nthreads,
+	     uint64_t *claimed);
+
+#endif /* _FAT_SCAN_H */
@@ -0,0 +1,156 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "disk.h"
+#include "fs.h"
+
+#define flusher_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+struct flusherContext {
+	bool running;
+	bool stopping;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;		// Signalled when the flusher has to stop
+	struct fs_flusher_params params;
+	size_t keep;				// Dirty blocks left alone by the dirty ratio
+};
+
+static struct flusherContext ctx = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+};
+
+static const struct fs_flusher_params defaults = {
+	.interval_ms = 100,
+	.dirty_age_ms = 1000,
+	.dirty_ratio = 10,
+	.dirty_max_ratio = 40,
+	.commit_ms = 5000,
+};
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void *flusher(void *unused)
+{
+	(void)unused;
+	uint64_t lastCommit = now_ms();
+
+	pthread_mutex_lock(&ctx.lock);
+	while (!ctx.stopping) {
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += ctx.params.interval_ms / 1000;
+		until.tv_nsec += (ctx.params.interval_ms % 1000) * 1000000L;
+		if (until.tv_nsec >= 1000000000L) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&ctx.wake, &ctx.lock, &until);
+		if (ctx.stopping) {
+			break;
+		}
+		pthread_mutex_unlock(&ctx.lock);
+
+		/* Data beside the library lock, so that writers keep going meanwhile */
+		if (block_writeback(ctx.params.dirty_age_ms, ctx.keep) == -1) {
+			flusher_error("cannot write back dirty blocks");
+		}
+
+		/* Metadata only through fs_sync(), which orders it after the data */
+		uint64_t now = now_ms();
+		if (ctx.params.commit_ms && now - lastCommit >= ctx.params.commit_ms) {
+			if (fs_sync() == -1) {
+				flusher_error("cannot commit the file system");
+			}
+			lastCommit = now;
+		}
+
+		pthread_mutex_lock(&ctx.lock);
+	}
+	pthread_mutex_unlock(&ctx.lock);
+
+	return NULL;
+}
+
+int fs_flusher_start(const struct fs_flusher_params *params)
+{
+	size_t dirty, slots;
+
+	if (!params) {
+		params = &defaults;
+	}
+	if (params->interval_ms == 0 || params->dirty_max_ratio == 0 ||
+	    params->dirty_max_ratio > 100 || params->dirty_ratio > params->dirty_max_ratio) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&ctx.lock);
+	if (ctx.running) {
+		pthread_mutex_unlock(&ctx.lock);
+		flusher_error("flusher already running");
+		return -1;
+	}
+
+	/* Dirty blocks live in the block cache, which only a mount sets up */
+	if (block_cache_dirty(&dirty, &slots) == -1 || slots == 0) {
+		pthread_mutex_unlock(&ctx.lock);
+		flusher_error("no block cache to write back from");
+		return -1;
+	}
+
+	size_t dirtyMax = slots * params->dirty_max_ratio / 100;
+	if (dirtyMax == 0) {
+		dirtyMax = 1;
+	}
+	ctx.params = *params;
+	ctx.keep = slots * params->dirty_ratio / 100;
+	ctx.stopping = false;
+	if (block_cache_writeback(dirtyMax) == -1) {
+		pthread_mutex_unlock(&ctx.lock);
+		return -1;
+	}
+	if (pthread_create(&ctx.thread, NULL, flusher, NULL)) {
+		block_cache_writeback(0);
+		pthread_mutex_unlock(&ctx.lock);
+		flusher_error("cannot create flusher thread");
+		return -1;
+	}
+	ctx.running = true;
+	pthread_mutex_unlock(&ctx.lock);
+
+	return 0;
+}
+
+int fs_flusher_stop(void)
+{
+	pthread_mutex_lock(&ctx.lock);
+	if (!ctx.running || ctx.stopping) {
+		pthread_mutex_unlock(&ctx.lock);
+		return -1;
+	}
+	ctx.stopping = true;
+	pthread_cond_signal(&ctx.wake);
+	pthread_mutex_unlock(&ctx.lock);
+
+	pthread_join(ctx.thread, NULL);
+
+	/* Back to writing through, with every dirty block written back */
+	int ret = block_cache_writeback(0);
+
+	pthread_mutex_lock(&ctx.lock);
+	ctx.running = false;
+	pthread_mutex_unlock(&ctx.lock);
+
+	return ret;
+}
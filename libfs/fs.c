@@ -1,4 +1,7 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -6,11 +9,44 @@
 #include <inttypes.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <sys/stat.h>
+#include "dedup.h"
 #include "disk.h"
+#include "fat_scan.h"
 #include "fs.h"
+#include "lz.h"
+#include "pool.h"
 
-#define BLOCK_SIZE 4096
 #define FAT_EOC 0xFFFF
+/* Freed since the last sync, which the image may still refer to: not reused until then */
+#define FAT_PENDING 0xFFFE
+#define FAT_PER_BLOCK (blockSize / sizeof(uint16_t))
+
+/* Scratch slabs per mount; calls are serialised so a few are plenty */
+#define POOL_SLABS 8
+
+/* Largest final partial block that gets packed into a shared tail block */
+#define TAIL_MAX (blockSize / 2)
+
+/* Root entry flags */
+#define ENTRY_COMPRESS 0x1		// Compress the file when it is closed
+#define ENTRY_COMPRESSED 0x2	// Its chain holds a compressed stream
+
+/* Decompressed blocks kept around for reads */
+#define ZCACHE_SLOTS 8
+
+/* Superblock cleanUnmount value: the allocator summary matches the FAT */
+#define SUPER_CLEAN 1
+
+/* Block cache behind fs_read(), and how far it reads ahead (see fs_advise()) */
+#define CACHE_BYTES (4 << 20)
+#define READAHEAD_BYTES (64 << 10)
+#define READAHEAD_SEQ_BYTES (256 << 10)
+
+struct __attribute__((packed)) snapEntry {
+	char name[FS_FILENAME_LEN];
+	uint16_t rootBlock;			// First block of the saved root directory, 0 if unused
+};
 
 struct __attribute__((packed)) superBlock {
     char signature[8]; 			// Signature (must be equal to “ECS150FS”)
@@ -19,14 +55,22 @@ struct __attribute__((packed)) superBlock {
     uint16_t dataIndex;			// Data block start index
     uint16_t numDataBlocks;		// Amount of data blocks
     uint8_t numFATBlocks;		// Number of blocks for FAT
-    char padding[4079];			// Unused/Padding
+    uint8_t blockShift;			// Log2 of the block size, 0 for the original 4096
+    struct snapEntry snapshots[FS_SNAPSHOT_MAX];	// Within the first 512 bytes, like the rest
+    uint8_t cleanUnmount;		// SUPER_CLEAN if unmounted since the FAT last changed
+    uint16_t freeBlocks;		// Free data blocks, as of that unmount
+    uint16_t nextFree;			// No data block before this one was free then
+    char padding[3785];			// Unused/Padding
 };
 
 struct __attribute__((packed)) rootEntry {
 	char fileName[FS_FILENAME_LEN];
 	uint32_t fileSize;
 	uint16_t dataBlockIndex;
-	uint8_t padding[10];
+	uint16_t tailBlock;			// Shared block holding the last partial block, 0 if none
+	uint16_t tailOffset;		// Where in tailBlock those bytes start
+	uint8_t fileFlags;			// ENTRY_* flags
+	uint8_t padding[5];
 };
 
 struct __attribute__((packed)) rootDirectory {
@@ -36,7 +80,13 @@ struct __attribute__((packed)) rootDirectory {
 struct __attribute__((packed)) fileEntry {
 	char fileName[FS_FILENAME_LEN];
 	uint8_t fd;
-	uint8_t offset;
+	size_t offset;
+};
+
+struct fs_dir {
+	int next;						// Next root directory slot to look at
+	size_t prefixLen;
+	char prefix[FS_FILENAME_LEN];
 };
 
 struct __attribute__((packed)) fileDirectory {
@@ -47,445 +97,3495 @@ struct __attribute__((packed)) fileDirectory {
 
 /* Global Variables */
 struct superBlock super;
+static size_t blockSize;
 uint16_t *fat;
+static bool fatMapped;			// @fat is the FAT blocks mapped privately with block_map()
+
+/* Allocator summary: free data blocks, none of which is below nextFree */
+static size_t freeCount;
+static size_t nextFree;
+
+/* Blocks marked FAT_PENDING, counted as free but only reusable after the next sync */
+static uint16_t *pendingFree;
+static size_t numPending;
+
+/*
+ * What the image holds as of the last write of the metadata: FAT blocks
+ * changed since (FAT blocks number at most 255), and the root directory and
+ * superblock written. block_disk_writes() was syncedWrites at the last flush.
+ */
+static uint64_t fatDirty[4];
+static struct rootDirectory rootSynced;
+static struct superBlock superSynced;
+static long syncedWrites;
+
 struct rootDirectory root;
 struct fileDirectory open_files;
+struct bufPool pool;
+static int mountFlags;
+
+/*
+ * References to each data block: root entries (live or saved in a snapshot)
+ * starting their chain or packing their tail in it, FAT entries linking to
+ * it, and snapshots storing their root directory in it. Chains of cloned
+ * files converge, and a block with several references is shared.
+ */
+static uint16_t *refCount;
+
+/* Saved root directory of each snapshot in use */
+static struct rootDirectory *snapRoots;
+
+/* Content of the chain blocks, by hash; only allocated with FS_MOUNT_DEDUP */
+static struct dedupIndex dedupIdx;
+
+/* Decompressed block @index of the compressed file whose chain starts at @head */
+struct zCacheSlot {
+	bool valid;
+	uint16_t head;
+	size_t index;
+	char *data;
+};
+
+/* Compressed files: recently read blocks and the block map of the last file */
+static struct zCacheSlot zCache[ZCACHE_SLOTS];
+static int zCacheNext;
+static uint32_t *zMap;
+static uint16_t zMapHead = FAT_EOC;
+
+/* Last tail block read or written, shared by every file packed into it */
+static char *tailCache;
+static uint16_t tailCached;
+
+/*
+ * Data blocks of the chain of each open file, in file order, as far as they
+ * were looked up. An index holds as long as its chain starts at @head and no
+ * FAT entry was changed but to extend a chain, which bumps chainGen.
+ */
+struct chainIndex {
+	uint16_t head;
+	unsigned gen;
+	size_t len;
+	size_t cap;
+	uint16_t *blocks;
+};
+
+static struct chainIndex chainIdx[FS_OPEN_MAX_COUNT];
+static unsigned chainGen;
+
+/* How each open file is read, see fs_advise() */
+struct readState {
+	int advice;					// FS_ADVICE_* access pattern
+	size_t nextOffset;			// Where the last fs_read() stopped
+	size_t aheadEnd;			// Block of the file read ahead up to
+};
+
+static struct readState readState[FS_OPEN_MAX_COUNT];
+
+static void tail_release(struct rootEntry *file);
+static void tail_pack(struct rootEntry *file);
+static int dedup_file(struct rootEntry *file);
+static void fd_index_free(int fd);
+static int fd_entry(int fd);
+static void z_forget(void);
+static int discard_blocks(uint16_t *blocks, size_t count);
+static void z_pack(struct rootEntry *file);
+static int z_unpack(struct rootEntry *file);
+static size_t z_read(struct rootEntry *file, size_t offset, void *buf, size_t count);
+
+/*
+ * Library lock: every public entry point holds it for its whole duration so
+ * that the asynchronous workers and the caller's own thread never interleave
+ * on the globals above. Recursive because entry points call each other.
+ */
+static pthread_mutex_t fs_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+static int fs_lock(void)
+{
+	pthread_mutex_lock(&fs_mutex);
+	return 0;
+}
+
+static void fs_unlock(int *unused)
+{
+	(void)unused;
+	pthread_mutex_unlock(&fs_mutex);
+}
+
+/* Hold the library lock until the enclosing scope is left */
+#define FS_LOCKED() \
+	int __fs_guard __attribute__((cleanup(fs_unlock), unused)) = fs_lock()
 
 /* TODO: Phase 1 */
-int fs_mount(const char *diskname)
+/* Blocks the root directory spans: it takes several when they are small */
+static size_t root_blocks(size_t block_size)
 {
-	/* ECS150 Disk Format Error Check */
-	if (block_disk_open(diskname) == -1) {												// Disk can't be opened
-		return -1;
-	} else if (block_read(0, &super) == -1) {											// Superblock can't be read
-		return -1;
-	} else if (1 + super.numFATBlocks + 1 + super.numDataBlocks != super.totalBlocks) { // Incorrect total blocks
-		return -1;
-	} else if (super.totalBlocks != block_disk_count()) {								// Block count off
-		return -1;
-	} else if (memcmp("ECS150FS", super.signature, 8) != 0) {   						// Incorrect Signature
-        return -1;
-	} else if (super.numFATBlocks + 1 != super.rootIndex) {								// Incorrect fat block start index
- 		return -1;
-	} else if (super.rootIndex + 1 != super.dataIndex) {								// Incorrect data block start index
-		return -1;
+	size_t size = sizeof(struct rootDirectory);
+	return block_size < size ? size / block_size : 1;
+}
+
+/* Read the root directory, which does not fill the larger block sizes */
+static int root_read(void)
+{
+	if (blockSize <= sizeof(root)) {
+		return block_read_many(super.rootIndex, root_blocks(blockSize), &root);
 	}
 
-	/* FAT Array Mapping */
-	fat = (uint16_t*)malloc(super.numFATBlocks * BLOCK_SIZE * sizeof(uint16_t));
-	void *buf = (void*)malloc(BLOCK_SIZE);
-	for(int i = 1; i < super.rootIndex; i++) {
-		if(block_read(i, buf) == -1) {
-			return -1;
-		} else {
-			memcpy(fat + (i-1)*BLOCK_SIZE, buf, BLOCK_SIZE);
-		}
+	void *bounce = pool_get(&pool);
+	if (bounce == NULL) {
+		return -1;
 	}
+	int ret = block_read(super.rootIndex, bounce);
+	memcpy(&root, bounce, sizeof(root));
+	pool_put(&pool, bounce);
+	return ret;
+}
 
-	if (fat[0] != FAT_EOC) {
-		return -1; 
+static int root_write(void)
+{
+	rootSynced = root;
+	if (blockSize <= sizeof(root)) {
+		return block_write_many(super.rootIndex, root_blocks(blockSize), &root);
 	}
 
-	/* Meta Information */
-	if (block_read(super.rootIndex, &root) == -1) {
+	void *bounce = pool_get(&pool);
+	if (bounce == NULL) {
 		return -1;
 	}
-
-	/* Sucessful Mount! */
-	return 0; 
+	memset(bounce, 0, blockSize);
+	memcpy(bounce, &root, sizeof(root));
+	int ret = block_write(super.rootIndex, bounce);
+	pool_put(&pool, bounce);
+	return ret;
 }
 
-int fs_umount(void)
+/* Write the superblock back, cut or padded to a block */
+static int super_write(void)
 {
-	/* TODO: Phase 1 */
-	if (block_write(0, &super) == -1) {							// Superblock can't be read
-		return -1;
-	} else if (block_write(super.rootIndex, &root) == -1) {		// Root directory can't be written to
+	void *bounce = pool_get(&pool);
+	if (bounce == NULL) {
 		return -1;
 	}
+	memset(bounce, 0, blockSize);
+	memcpy(bounce, &super, blockSize < sizeof(super) ? blockSize : sizeof(super));
+	superSynced = super;
+	int ret = block_write(0, bounce);
+	pool_put(&pool, bounce);
+	return ret;
+}
 
-	for(int i = 1; i < super.rootIndex; i++) {
-		if (block_write(i, fat + (i-1) * BLOCK_SIZE) == -1){
-			return -1;
-		}
+/* Live root directory for @s -1, saved one of snapshot @s otherwise (NULL if unused) */
+static struct rootDirectory *root_dir(int s)
+{
+	if (s == -1) {
+		return &root;
 	}
+	return super.snapshots[s].rootBlock ? &snapRoots[s] : NULL;
+}
 
-	if (block_disk_close() == -1) {
+/* Read or write @size bytes kept in the chain starting at data block @block */
+static int chain_rw(uint16_t block, void *buf, size_t size, bool write)
+{
+	void *bounce = pool_get(&pool);
+	if (bounce == NULL) {
 		return -1;
 	}
 
-	/* Sucessful Unmount! */
-	return 0;
-}
-
-int free_fat() {
-	int num_free = 0;
-	for (int i = 0; i < super.numDataBlocks; i++){
-		if (fat[i] == 0) {
-			num_free++;
+	int ret = 0;
+	for (size_t done = 0; done < size && ret == 0; done += blockSize) {
+		size_t len = size - done < blockSize ? size - done : blockSize;
+		if (block == FAT_EOC || block >= super.numDataBlocks || fat[block] == 0) {
+			ret = -1;
+		} else if (write) {
+			memset(bounce, 0, blockSize);
+			memcpy(bounce, (char*)buf + done, len);
+			ret = block_write(super.dataIndex + block, bounce);
+		} else {
+			ret = block_read(super.dataIndex + block, bounce);
+			memcpy((char*)buf + done, bounce, len);
 		}
+		block = ret == 0 ? fat[block] : FAT_EOC;
 	}
-    return num_free;
+
+	pool_put(&pool, bounce);
+	return ret;
 }
 
-int free_dir() {
-	int num_free = 0;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++){
-		if (root.rootEntry[i].fileName[0] == '\0') {
-			num_free++;
+/* Number of contiguous runs the chain starting at @block is in, its length in @length */
+static size_t chain_runs(uint16_t block, size_t *length)
+{
+	size_t runs = 0, n = 0;
+	for (uint16_t prev = FAT_EOC; block != FAT_EOC; prev = block, block = fat[block], n++) {
+		/* Bounded, for the FAT may not have been checked yet (see fs_ready()) */
+		if (block >= super.numDataBlocks || n == super.numDataBlocks) {
+			break;
 		}
+		runs += prev == FAT_EOC || block != prev + 1;
 	}
-    return num_free;
+	if (length != NULL) {
+		*length = n;
+	}
+	return runs;
 }
 
-int fs_info(void)
+/* Whether the blocks root entry @e points at can be those of a file */
+static bool entry_valid(struct rootEntry *e)
 {
-	/* TODO: Phase 1 */
-	printf("FS Info:\n");
-	printf("total_blk_count=%i\n", super.totalBlocks);
-	printf("fat_blk_count=%i\n", super.numFATBlocks);
-	printf("rdir_blk=%i\n", super.numDataBlocks);
-	printf("data_blk=%i\n", super.rootIndex);
-	printf("data_blk_count=%i\n", super.dataIndex);
-	printf("fat_free_ratio=%d/%d\n", free_fat(), super.numDataBlocks);
-	printf("rdir_free_ratio=%d/%d\n", free_dir(), FS_FILE_MAX_COUNT);
+	if (e->dataBlockIndex != FAT_EOC && (e->dataBlockIndex == 0 ||
+	    e->dataBlockIndex >= super.numDataBlocks)) {
+		return false;
+	}
 
-	return 0;
+	/* Packed tails must sit inside a block no chain uses, compressed files have none */
+	if (e->tailBlock != 0 && ((e->fileFlags & ENTRY_COMPRESSED) ||
+	    e->tailBlock >= super.numDataBlocks ||
+	    fat[e->tailBlock] != FAT_EOC || e->fileSize % blockSize == 0 ||
+	    e->tailOffset + e->fileSize % blockSize > blockSize)) {
+		return false;
+	}
+
+	return true;
 }
 
-int fs_create(const char *filename)
+/* Count the references root entry @e holds: its first block and its tail */
+static void entry_get(struct rootEntry *e)
 {
-	/* TODO: Phase 2 */
-	if (filename == NULL || strlen(filename) > FS_FILENAME_LEN) {
-		return -1;
+	if (e->dataBlockIndex != FAT_EOC) {
+		refCount[e->dataBlockIndex]++;
+	}
+	if (e->tailBlock != 0) {
+		refCount[e->tailBlock]++;
 	}
+}
 
+/* Add the references to every data block to @refs, which has room for them all */
+static void ref_count(uint16_t *refs)
+{
+	size_t n = super.numDataBlocks;
 
-	/* Traverse root directory before creation (Check if file exists and if max file count not exceeded) */
-	int fileCount = 0;
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (strcmp((char*)root.rootEntry[i].fileName, filename) == 0) {
-			return -1; 
-		} 
-		if (root.rootEntry[i].fileName[0] != '\0') { // Non empty entry found, increment file count
-			fileCount++;										
+	/* Bounded, for the FAT may not have been checked yet (see fs_ready()) */
+	for (size_t b = 1; b < n; b++) {
+		if (fat[b] != 0 && fat[b] < n) {
+			refs[fat[b]]++;
+		}
+	}
+	for (int s = -1; s < FS_SNAPSHOT_MAX; s++) {
+		struct rootDirectory *dir = root_dir(s);
+		if (dir == NULL) {
+			continue;
+		}
+		if (s != -1 && super.snapshots[s].rootBlock < n) {
+			refs[super.snapshots[s].rootBlock]++;
+		}
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+			struct rootEntry *e = &dir->rootEntry[i];
+			if (e->fileName[0] == '\0') {
+				continue;
+			}
+			if (e->dataBlockIndex < n) {
+				refs[e->dataBlockIndex]++;
+			}
+			if (e->tailBlock != 0 && e->tailBlock < n) {
+				refs[e->tailBlock]++;
+			}
 		}
 	}
+}
 
-	/* Max File Count Exceeded */
-	if (fileCount >= FS_FILE_MAX_COUNT) {
+/* Count the references to every data block, nothing of which is on disk */
+static int ref_init(void)
+{
+	size_t n = super.numDataBlocks;
+	refCount = calloc(n, sizeof(uint16_t));
+	if (refCount == NULL) {
 		return -1;
 	}
+	ref_count(refCount);
 
-	/* Create File */
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (root.rootEntry[i].fileName[0] == '\0') {								// Empty entry found
-			memcpy(root.rootEntry[i].fileName, filename, FS_FILENAME_LEN); 		// Copy file name
-			root.rootEntry[i].fileSize = 0; 									// Set root dir size to 0
-			root.rootEntry[i].dataBlockIndex = FAT_EOC;  							// first data block starts from 0xFFFF
-			block_write(super.rootIndex, &root);
-			break;
+	/* Anything referring to a free block is damaged */
+	for (size_t b = 1; b < n; b++) {
+		if (refCount[b] != 0 && fat[b] == 0) {
+			free(refCount);
+			refCount = NULL;
+			return -1;
 		}
 	}
 
 	return 0;
 }
 
-int fs_delete(const char *filename)
+/*
+ * Check the whole FAT and count the references, which fs_mount() leaves to
+ * the first call that needs them: reading a file only goes through the FAT
+ * blocks its chain is in, checked by chain_sound() instead.
+ */
+static int fs_ready(void)
 {
-	/* TODO: Phase 2 */
-	if (filename == NULL) {
+	if (refCount != NULL) {
+		return 0;
+	}
+	const struct fatKernels *k = fat_kernels();
+	if (k->validate(fat, super.numDataBlocks, FAT_EOC) != super.numDataBlocks) {
 		return -1;
 	}
 
-	uint16_t index = FAT_EOC;
-	bool fileFound = false;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (strcmp((char*)root.rootEntry[i].fileName, filename) == 0) {
-			index = root.rootEntry[i].dataBlockIndex;
+	/* The allocator summary is left alone: the mount counted it unless it was clean */
+	return ref_init();
+}
 
-			/* Destroy Root Entry */
-			root.rootEntry[i].fileSize = 0;
-			root.rootEntry[i].dataBlockIndex = FAT_EOC;
-			root.rootEntry[i].fileName[0] = '\0';
-			block_write(super.rootIndex, &root);
-			fileFound = true;
-			break;
+/* Whether the chain of @file can be followed before fs_ready() has checked the FAT */
+static bool chain_sound(struct rootEntry *file)
+{
+	size_t steps = 0;
+	for (uint16_t b = file->dataBlockIndex; b != FAT_EOC; b = fat[b]) {
+		if (b == 0 || b >= super.numDataBlocks || fat[b] == 0 ||
+		    ++steps > super.numDataBlocks) {
+			return false;
 		}
 	}
+	return true;
+}
 
-	if (!fileFound) {
-		return -1;
+/* Let go of the FAT array, mapped or allocated */
+static void fat_release(void)
+{
+	if (fatMapped) {
+		block_unmap(fat, 1, super.numFATBlocks);
+	} else {
+		free(fat);
 	}
+	fat = NULL;
+	fatMapped = false;
+}
 
-	int next = 0;
+/* Open @diskname and read its superblock, checking the geometry it describes */
+static int super_load(const char *diskname)
+{
+	/* The superblock fits in the smallest block, whatever the format's size */
+	char head[BLOCK_SIZE_MIN];
+	if (block_disk_open(diskname) == -1) {												// Disk can't be opened
+		return -1;
+	} else if (block_disk_set_block_size(BLOCK_SIZE_MIN) == -1 ||
+	           block_read(0, head) == -1) {												// Superblock can't be read
+		goto err_close;
+	}
+	memset(&super, 0, sizeof(super));
+	memcpy(&super, head, sizeof(head));
+	if (super.blockShift > 16) {														// Unsupported block size
+		goto err_close;
+	}
+	blockSize = super.blockShift ? (size_t)1 << super.blockShift : BLOCK_SIZE;
 
-	while (index != FAT_EOC) {
-		next = fat[index];
-		fat[index] = 0;
-		index = next;
+	/* ECS150 Disk Format Error Check */
+	if (block_disk_set_block_size(blockSize) == -1) {									// Unsupported block size
+		goto err_close;
+	} else if (1 + super.numFATBlocks + root_blocks(blockSize) + super.numDataBlocks != super.totalBlocks) { // Incorrect total blocks
+		goto err_close;
+	} else if (super.totalBlocks != block_disk_count()) {								// Block count off
+		goto err_close;
+	} else if (memcmp("ECS150FS", super.signature, 8) != 0) {   						// Incorrect Signature
+		goto err_close;
+	} else if (super.numFATBlocks + 1 != super.rootIndex) {								// Incorrect fat block start index
+		goto err_close;
+	} else if (super.rootIndex + root_blocks(blockSize) != super.dataIndex) {			// Incorrect data block start index
+		goto err_close;
+	} else if (super.numFATBlocks * FAT_PER_BLOCK < super.numDataBlocks) {				// FAT too small
+		goto err_close;
 	}
 
 	return 0;
+
+err_close:
+	block_disk_close();
+	return -1;
 }
 
-int fs_ls(void)
+int fs_mount(const char *diskname)
 {
-	printf("FS ls:\n");
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (root.rootEntry[i].fileName[0] != '\0') {
-			struct rootEntry entry = root.rootEntry[i];
-			printf("File Name: %s\n Data Block Index: %i\n Size: %i\n", (char*)entry.fileName, entry.dataBlockIndex, entry.fileSize);
-		}
-	}
-	return 0;
+	return fs_mount_flags(diskname, 0);
 }
 
-int fs_open(const char *filename)
+int fs_mount_flags(const char *diskname, int flags)
 {
-	/* TODO: Phase 3 */
-	bool fileFound = false;
-	if (filename == NULL || open_files.numFilesOpen == FS_OPEN_MAX_COUNT) {
+	FS_LOCKED();
+
+	if (flags & ~(FS_MOUNT_DISCARD | FS_MOUNT_TAILPACK | FS_MOUNT_DEDUP | FS_MOUNT_COMPRESS)) {
 		return -1;
 	}
 
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (strcmp((char*)root.rootEntry[i].fileName, filename) == 0) {
-			fileFound = true;
+	if (super_load(diskname) == -1) {
+		return -1;
+	}
+
+	/* Per-mount scratch buffers, and the cache of data blocks read */
+	if (block_cache_init(CACHE_BYTES / blockSize) == -1 ||
+	    pool_init(&pool, POOL_SLABS, blockSize) == -1) {
+		goto err_close;
+	}
+	tailCache = malloc(blockSize);
+	tailCached = 0;
+	if (tailCache == NULL) {
+		goto err_pool;
+	}
+
+	/*
+	 * FAT Array Mapping: mapped when the backend can, so that only the FAT
+	 * blocks used are read. Privately, for the ones modified are only written
+	 * back by meta_write(), after the data they point to.
+	 * Otherwise FAT blocks are read straight into place.
+	 */
+	fat = block_map(1, super.numFATBlocks, BLOCK_MAP_PRIVATE);
+	fatMapped = fat != NULL;
+	if (fat == NULL) {
+		fat = (uint16_t*)malloc(super.numFATBlocks * blockSize);
+		if (fat == NULL) {
+			goto err_pool;
+		}
+		if (block_read_many(1, super.numFATBlocks, fat) == -1) {
+			goto err_free;
 		}
 	}
 
-	if (!fileFound) {
-		return -1;
+	/* The rest of the FAT is checked by fs_ready() */
+	if (fat[0] != FAT_EOC) {
+		goto err_free;
 	}
 
-	for (int fd = 0; fd < FS_OPEN_MAX_COUNT; fd++) {
-		if (root.rootEntry[fd].fileName[0] != '\0'){	
-			strcpy(open_files.fileEntry[fd].fileName, filename);
-			open_files.numFilesOpen++;
-			open_files.fileEntry[fd].offset = 0; 
-			return fd;
+	/* A clean unmount left the allocator summary, otherwise it takes a scan */
+	if (super.cleanUnmount == SUPER_CLEAN && super.freeBlocks < super.numDataBlocks &&
+	    super.nextFree >= 1 && super.nextFree <= super.numDataBlocks) {
+		freeCount = super.freeBlocks;
+		nextFree = super.nextFree;
+	} else {
+		super.cleanUnmount = 0;
+		freeCount = fat_kernels()->count_free(fat, super.numDataBlocks);
+		nextFree = fat_kernels()->find_free(fat, 1, super.numDataBlocks);
+	}
+
+	/* Meta Information */
+	if (root_read() == -1) {
+		goto err_free;
+	}
+	rootSynced = root;
+	superSynced = super;
+	memset(fatDirty, 0, sizeof(fatDirty));
+	syncedWrites = block_disk_writes();
+
+	/* Snapshots: saved root directories, each in a chain of its own */
+	snapRoots = calloc(FS_SNAPSHOT_MAX, sizeof(struct rootDirectory));
+	pendingFree = malloc(super.numDataBlocks * sizeof(uint16_t));
+	numPending = 0;
+	if (snapRoots == NULL || pendingFree == NULL) {
+		goto err_free;
+	}
+	for (int s = 0; s < FS_SNAPSHOT_MAX; s++) {
+		uint16_t b = super.snapshots[s].rootBlock;
+		if (b != 0 && (b >= super.numDataBlocks || fat[b] == 0 ||
+		               chain_rw(b, &snapRoots[s], sizeof(struct rootDirectory), false) == -1)) {
+			goto err_free;
 		}
 	}
 
+	for (int s = -1; s < FS_SNAPSHOT_MAX; s++) {
+		struct rootDirectory *dir = root_dir(s);
+		for (int i = 0; dir != NULL && i < FS_FILE_MAX_COUNT; i++) {
+			if (dir->rootEntry[i].fileName[0] != '\0' && !entry_valid(&dir->rootEntry[i])) {
+				goto err_free;
+			}
+		}
+	}
+	if ((flags & FS_MOUNT_DEDUP) && dedup_init(&dedupIdx, super.numDataBlocks) == -1) {
+		goto err_free;
+	}
+
+	/* Sucessful Mount! */
+	mountFlags = flags;
+	return 0;
+
+err_free:
+	free(refCount);
+	refCount = NULL;
+	free(snapRoots);
+	snapRoots = NULL;
+	free(pendingFree);
+	pendingFree = NULL;
+	fat_release();
+err_pool:
+	free(tailCache);
+	tailCache = NULL;
+	pool_destroy(&pool);
+err_close:
+	block_disk_close();
 	return -1;
 }
 
-int fs_close(int fd)
+/* Write the FAT blocks changed since the last call, then the root directory and superblock */
+static int meta_write(void)
 {
-	/* TODO: Phase 3 */
-	if (fd < 0 || fd > 31 || open_files.numFilesOpen == 0 || open_files.fileEntry[fd].fileName[0] == '\0') { // Out of bounds and File Existence Check
+	for (size_t b = 0; b < super.numFATBlocks; b++) {
+		if (!(fatDirty[b / 64] >> (b % 64) & 1)) {
+			continue;
+		}
+		size_t n = 1;
+		while (b + n < super.numFATBlocks && (fatDirty[(b + n) / 64] >> ((b + n) % 64) & 1)) {
+			n++;
+		}
+		if (block_write_many(1 + b, n, (char*)fat + b * blockSize) == -1) {
+			return -1;
+		}
+		b += n - 1;
+	}
+	memset(fatDirty, 0, sizeof(fatDirty));
+
+	if (memcmp(&root, &rootSynced, sizeof(root)) != 0 && root_write() == -1) {
 		return -1;
 	}
-	else {
-		open_files.fileEntry[fd].offset = 0;
-		open_files.fileEntry[fd].fileName[0] = '\0';
-		open_files.numFilesOpen--;
+	if (memcmp(&super, &superSynced, sizeof(super)) != 0 && super_write() == -1) {
+		return -1;
 	}
-
 	return 0;
 }
 
-int fs_stat(int fd)
+/*
+ * Make everything written so far durable. Data blocks are written to the
+ * image as they are, so they only need a flush, which comes first: the
+ * metadata then never reaches the disk before the blocks it points to.
+ */
+static int sync_all(void)
 {
-	/* TODO: Phase 3 */
-	if (fd < 0 || fd > 31 || open_files.numFilesOpen == 0 || open_files.fileEntry[fd].fileName[0] == '\0') { // Out of bounds and File Existence Check
+	bool fatChanged = false;
+	for (size_t i = 0; i < sizeof(fatDirty) / sizeof(fatDirty[0]); i++) {
+		fatChanged |= fatDirty[i] != 0;
+	}
+	bool metaChanged = fatChanged || memcmp(&root, &rootSynced, sizeof(root)) != 0 ||
+	                   memcmp(&super, &superSynced, sizeof(super)) != 0;
+
+	/* Nothing since the last sync: the callers queued behind it are covered */
+	if (!metaChanged && block_disk_writes() == syncedWrites) {
+		return 0;
+	}
+	if (block_disk_writes() != syncedWrites && block_disk_flush() == -1) {
 		return -1;
 	}
+	if (!metaChanged) {
+		syncedWrites = block_disk_writes();
+		return 0;
+	}
 
-	char *openFileName = open_files.fileEntry[fd].fileName;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (strcmp(root.rootEntry[i].fileName, openFileName) == 0) {
-			return root.rootEntry[i].fileSize;
+	/* The metadata written next no longer refers to the pending blocks */
+	size_t released = numPending;
+	numPending = 0;
+	for (size_t i = 0; i < released; i++) {
+		fat[pendingFree[i]] = 0;
+		if (pendingFree[i] < nextFree) {
+			nextFree = pendingFree[i];
 		}
 	}
-
-	return -1;
-}
-
-int fs_lseek(int fd, size_t offset)
-{
-	/* TODO: Phase 3 */
-	if (fd < 0 || fd > 31 || offset > root.rootEntry[fd].fileSize) {
+	if (meta_write() == -1 || block_disk_flush() == -1) {
+		/* Still pending, for the image may refer to them until a sync succeeds */
+		for (size_t i = 0; i < released; i++) {
+			fat[pendingFree[i]] = FAT_PENDING;
+		}
+		numPending = released;
 		return -1;
 	}
+	syncedWrites = block_disk_writes();
 
-	open_files.fileEntry[fd].offset = offset;
+	/* Discarding is only a hint, and only safe once nothing on disk refers to the blocks */
+	if (mountFlags & FS_MOUNT_DISCARD) {
+		discard_blocks(pendingFree, released);
+	}
 	return 0;
 }
 
-uint16_t dataBlockIndex(size_t offset, uint16_t start_index) 
+int fs_sync(void)
 {
-    uint16_t dataIndex = start_index;
-	uint16_t count = BLOCK_SIZE - 1;
-    while (dataIndex != FAT_EOC && count  < offset) {
-        if (fat[dataIndex] == FAT_EOC) {
-            return -1;
-		}
-        dataIndex = fat[dataIndex];
-        count += BLOCK_SIZE;
-    }
-    uint16_t val = dataIndex;
-	return val;
+	FS_LOCKED();
+
+	if (fat == NULL) {
+		return -1;
+	}
+	return sync_all();
 }
 
-uint16_t findOpenFAT()
+int fs_fsync(int fd)
 {
-	uint16_t index;
-	for (int i = 0; i < super.numDataBlocks; i++) {
-		if(fat[i] == 0) {
-			index = i;
-			return index;
-		}
+	FS_LOCKED();
+
+	/* The metadata of every file lives in the same FAT and root directory */
+	if (fd_entry(fd) == -1) {
+		return -1;
 	}
-	return -1;
+	return sync_all();
 }
 
-int fs_write(int fd, void *buf, size_t count)
+int fs_umount(void)
 {
-	/* TODO: Phase 4 */
-	char* name = open_files.fileEntry[fd].fileName;
-	if (fd < 0 || fd > 31 || open_files.numFilesOpen == 0 || name[0] == '\0') { // Out of bounds and File Existence Check
+	/* Before the lock, which the flusher's commits take */
+	fs_flusher_stop();
+	FS_LOCKED();
+
+	/* TODO: Phase 1 */
+	/* The superblock goes last: its summary only holds once the FAT is durable */
+	if (fat == NULL) {											// Nothing mounted
+		return -1;
+	} else if (sync_all() == -1) {								// Metadata can't be written to
 		return -1;
-	} else if (count <= 0 || buf == NULL) {
-		return 0;
 	}
-
-	/* Find File in Root Directory */
-	bool fileFound = false;
-	int startIndex;
-	struct rootEntry root_block;
-	int saveRoot;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (strcmp(root.rootEntry[i].fileName, name) == 0) {
-			fileFound = true;
-			root_block = root.rootEntry[i];
-			startIndex = root_block.dataBlockIndex;
-			saveRoot = i;
-			break;
-		}
+	super.cleanUnmount = SUPER_CLEAN;
+	super.freeBlocks = freeCount;
+	super.nextFree = nextFree;
+	if (super_write() == -1 || block_disk_flush() == -1) {		// Superblock can't be written to
+		return -1;
 	}
 
-	/* File Not Found */
-	if (!fileFound) {
+	fat_release();
+	if (block_disk_close() == -1) {
 		return -1;
 	}
 
-	/* File Empty: No Allocated Blocks, Find First Availiable Block in FAT */
-	if (fs_stat(fd) == 0) {
-		startIndex = findOpenFAT();
-		if (startIndex == -1) {
-			return -1;
-		}
-		root_block.dataBlockIndex = startIndex;
+	free(refCount);
+	refCount = NULL;
+	free(snapRoots);
+	snapRoots = NULL;
+	free(pendingFree);
+	pendingFree = NULL;
+	dedup_destroy(&dedupIdx);
+	z_forget();
+	for (int i = 0; i < ZCACHE_SLOTS; i++) {
+		free(zCache[i].data);
+		zCache[i].data = NULL;
 	}
+	free(tailCache);
+	tailCache = NULL;
+	pool_destroy(&pool);
 
-	bool increase = false;
-	int byte_count = 0;
-	uint8_t offset = open_files.fileEntry[fd].offset;
-	uint8_t dataIndex = dataBlockIndex(offset, startIndex);
-	uint8_t actualIndex = startIndex + super.dataIndex;
-	void *bounce = (void*)malloc(BLOCK_SIZE);
-	
-	size_t block_offset = offset % BLOCK_SIZE;
-	block_read((size_t)actualIndex, bounce);
-
-	for (long unsigned int i = 0; i < count; i++) {
-		open_files.fileEntry[fd].offset = offset;
+	/* Sucessful Unmount! */
+	return 0;
+}
 
-		if (offset >= fs_stat(fd)) {
-			increase = true;
+int free_fat() {
+	return freeCount;
+}
+
+int free_dir() {
+	int num_free = 0;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++){
+		if (root.rootEntry[i].fileName[0] == '\0') {
+			num_free++;
+		}
+	}
+    return num_free;
+}
+
+int fs_info(void)
+{
+	FS_LOCKED();
+
+	/* TODO: Phase 1 */
+	/* Reports from the allocator summary, without the whole-FAT check of fs_ready() */
+	if (fat == NULL) {
+		return -1;
+	}
+	printf("FS Info:\n");
+	printf("total_blk_count=%i\n", super.totalBlocks);
+	printf("fat_blk_count=%i\n", super.numFATBlocks);
+	printf("rdir_blk=%i\n", super.numDataBlocks);
+	printf("data_blk=%i\n", super.rootIndex);
+	printf("data_blk_count=%i\n", super.dataIndex);
+	printf("fat_free_ratio=%d/%d\n", free_fat(), super.numDataBlocks);
+	printf("rdir_free_ratio=%d/%d\n", free_dir(), FS_FILE_MAX_COUNT);
+	printf("blk_size=%zu\n", blockSize);
+	printf("pool_slab_size=%zu\n", pool.slabSize);
+	printf("pool_slab_usage=%d/%d\n", pool_used(&pool), pool.numSlabs);
+	printf("pool_slab_peak=%d\n", pool.peakUsed);
+	printf("pool_bytes=%zu\n", pool.numSlabs * pool.slabSize);
+	size_t hits, lookups;
+	if (block_cache_stats(&hits, &lookups) == 0) {
+		printf("cache_hit_ratio=%zu/%zu\n", hits, lookups);
+	}
+
+	/* Packed files and the distinct tail blocks they share */
+	int packed = 0, tailBlocks = 0;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		uint16_t b = root.rootEntry[i].tailBlock;
+		if (root.rootEntry[i].fileName[0] == '\0' || b == 0) {
+			continue;
+		}
+		packed++;
+		int j = 0;
+		while (j < i && (root.rootEntry[j].fileName[0] == '\0' ||
+		                 root.rootEntry[j].tailBlock != b)) {
+			j++;
+		}
+		tailBlocks += j == i;
+	}
+	printf("tail_packed_files=%d\n", packed);
+	printf("tail_blk_count=%d\n", tailBlocks);
+
+	/* Blocks used by more than one file, clone or snapshot */
+	int shared = 0, snapshots = 0;
+	uint16_t *refs = refCount != NULL ? refCount : calloc(super.numDataBlocks, sizeof(uint16_t));
+	if (refs == NULL) {
+		return -1;
+	}
+	if (refs != refCount) {
+		ref_count(refs);
+	}
+	for (size_t b = 1; b < super.numDataBlocks; b++) {
+		shared += refs[b] > 1;
+	}
+	if (refs != refCount) {
+		free(refs);
+	}
+	for (int s = 0; s < FS_SNAPSHOT_MAX; s++) {
+		snapshots += root_dir(s) != NULL;
+	}
+	int compressed = 0;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		compressed += root.rootEntry[i].fileName[0] != '\0' &&
+		              (root.rootEntry[i].fileFlags & ENTRY_COMPRESSED);
+	}
+	printf("compressed_files=%d\n", compressed);
+
+	/* Fragmentation: runs of the files' chains, and of the free blocks */
+	int fragmented = 0;
+	size_t runs = 0, chained = 0, freeRuns = 0, freeMax = 0;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (root.rootEntry[i].fileName[0] != '\0') {
+			size_t length, r = chain_runs(root.rootEntry[i].dataBlockIndex, &length);
+			fragmented += r > 1;
+			runs += r;
+			chained += length;
+		}
+	}
+	const struct fatKernels *k = fat_kernels();
+	for (size_t start = k->find_free(fat, nextFree, super.numDataBlocks); start < super.numDataBlocks; ) {
+		size_t end = k->find_used(fat, start, super.numDataBlocks);
+		freeRuns++;
+		freeMax = end - start > freeMax ? end - start : freeMax;
+		start = k->find_free(fat, end, super.numDataBlocks);
+	}
+	printf("fragmented_files=%d\n", fragmented);
+	printf("file_run_ratio=%zu/%zu\n", runs, chained);
+	printf("free_run_count=%zu\n", freeRuns);
+	printf("free_run_max=%zu\n", freeMax);
+	printf("shared_blk_count=%d\n", shared);
+	printf("dedup_indexed_blk_count=%zu\n", dedupIdx.numIndexed);
+	printf("snapshot_count=%d/%d\n", snapshots, FS_SNAPSHOT_MAX);
+
+	return 0;
+}
+
+/* Number of FAT blocks needed to describe @data_blocks data blocks */
+static size_t fat_blocks(size_t data_blocks, size_t block_size)
+{
+	size_t per_block = block_size / sizeof(uint16_t);
+	return (data_blocks + per_block - 1) / per_block;
+}
+
+int fs_mkfs(const char *diskname, size_t data_blocks, size_t block_size, int flags)
+{
+	FS_LOCKED();
+
+	if (block_size == 0) {
+		block_size = BLOCK_SIZE;
+	}
+
+	if (diskname == NULL || (flags & ~FS_MKFS_EXISTING)) {
+		return -1;
+	} else if (data_blocks > FS_DATA_BLOCKS_MAX) {
+		return -1;
+	} else if (data_blocks == 0 && !(flags & FS_MKFS_EXISTING)) {
+		return -1;
+	} else if (block_size < BLOCK_SIZE_MIN || block_size > BLOCK_SIZE_MAX ||
+	           (block_size & (block_size - 1))) {
+		return -1;
+	}
+	size_t rootBlocks = root_blocks(block_size);
+
+	/* New Image: sparse file of the exact size, nothing written yet */
+	if (!(flags & FS_MKFS_EXISTING)) {
+		size_t total = 1 + fat_blocks(data_blocks, block_size) + rootBlocks + data_blocks;
+		if (total > UINT16_MAX) {
+			return -1;
+		}
+		int fd = open(diskname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			return -1;
+		}
+		if (ftruncate(fd, (off_t)total * block_size) == -1) {
+			close(fd);
+			return -1;
+		}
+		close(fd);
+	}
+
+	if (block_disk_open(diskname) == -1) {
+		return -1;
+	} else if (block_disk_set_block_size(block_size) == -1) {
+		block_disk_close();
+		return -1;
+	}
+
+	/*
+	 * Existing Disk: use all of it. The FAT may then get one block more
+	 * than strictly needed, as mounting requires the sizes to add up.
+	 */
+	size_t count = block_disk_count();
+	size_t perFAT = block_size / sizeof(uint16_t);
+	size_t numFAT = fat_blocks(data_blocks, block_size);
+	if (flags & FS_MKFS_EXISTING) {
+		for (numFAT = 1; numFAT * perFAT + numFAT + 1 + rootBlocks < count; numFAT++) {
+		}
+		if (data_blocks == 0 && count > 1 + numFAT + rootBlocks) {
+			data_blocks = count - 1 - numFAT - rootBlocks;
+		}
+	}
+	size_t meta = 1 + numFAT + rootBlocks;
+	if (data_blocks == 0 || data_blocks > FS_DATA_BLOCKS_MAX ||
+	    numFAT > UINT8_MAX || count > UINT16_MAX || meta + data_blocks != count) {
+		block_disk_close();
+		return -1;
+	}
+
+	/* Superblock, FAT and root directory are adjacent: build them in one go */
+	char *buf = calloc(meta, block_size);
+	if (buf == NULL) {
+		block_disk_close();
+		return -1;
+	}
+	struct superBlock *sb = (struct superBlock*)buf;
+	memcpy(sb->signature, "ECS150FS", 8);
+	sb->totalBlocks = count;
+	sb->numFATBlocks = numFAT;
+	sb->rootIndex = 1 + numFAT;
+	sb->dataIndex = 1 + numFAT + rootBlocks;
+	sb->numDataBlocks = data_blocks;
+	sb->blockShift = block_size == BLOCK_SIZE ? 0 : __builtin_ctzl(block_size);
+	sb->cleanUnmount = SUPER_CLEAN;
+	sb->freeBlocks = data_blocks - 1;
+	sb->nextFree = 1;
+	((uint16_t*)(buf + block_size))[0] = FAT_EOC;
+
+	int ret = block_write_many(0, meta, buf);
+	free(buf);
+
+	/* Stale data of a previous file system is of no use any more */
+	if (ret == 0 && (flags & FS_MKFS_EXISTING)) {
+		ret = block_discard(meta, data_blocks);
+	}
+
+	if (block_disk_close() == -1) {
+		ret = -1;
+	}
+	return ret == -1 ? -1 : (int)data_blocks;
+}
+
+int fs_create(const char *filename)
+{
+	FS_LOCKED();
+
+	/* TODO: Phase 2 */
+	if (filename == NULL || filename[0] == '\0' || strlen(filename) >= FS_FILENAME_LEN) {
+		return -1;
+	}
+
+	/* Traverse root directory before creation (Check if file exists and if max file count not exceeded) */
+	int fileCount = 0;
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (strcmp((char*)root.rootEntry[i].fileName, filename) == 0) {
+			return -1; 
+		} 
+		if (root.rootEntry[i].fileName[0] != '\0') { // Non empty entry found, increment file count
+			fileCount++;										
+		}
+	}
+
+	/* Max File Count Exceeded */
+	if (fileCount >= FS_FILE_MAX_COUNT) {
+		return -1;
+	}
+
+	/* Create File */
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (root.rootEntry[i].fileName[0] == '\0') {								// Empty entry found
+			memset(&root.rootEntry[i], 0, sizeof(struct rootEntry));
+			strcpy(root.rootEntry[i].fileName, filename); 						// Copy file name
+			root.rootEntry[i].fileSize = 0; 									// Set root dir size to 0
+			root.rootEntry[i].dataBlockIndex = FAT_EOC;  							// first data block starts from 0xFFFF
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static int cmp_block(const void *a, const void *b)
+{
+	return *(const uint16_t*)a - *(const uint16_t*)b;
+}
+
+/* Discard data blocks @blocks, coalesced into contiguous extents */
+static int discard_blocks(uint16_t *blocks, size_t count)
+{
+	int ret = 0;
+
+	qsort(blocks, count, sizeof(uint16_t), cmp_block);
+	for (size_t i = 0; i < count; ) {
+		size_t len = 1;
+		while (i + len < count && blocks[i + len] == blocks[i] + len) {
+			len++;
+		}
+		if (block_discard(super.dataIndex + blocks[i], len) == -1) {
+			ret = -1;
+		}
+		i += len;
+	}
+
+	return ret;
+}
+
+/*
+ * Note that chain block @block now holds the block at @buf, or something
+ * unknown if @buf is NULL. Tail blocks are never indexed: their free bytes
+ * get filled later on.
+ */
+static void dedup_note(uint16_t block, const void *buf)
+{
+	if (dedupIdx.hash != NULL) {
+		dedup_insert(&dedupIdx, block, buf ? dedup_hash(buf, blockSize) : 0);
+	}
+}
+
+/*
+ * Clear the clean flag on disk before the first change to the allocator of
+ * the mount, durably: a crash between the FAT and superblock writes of the
+ * next sync must not leave the old summary marked clean.
+ */
+static void fs_dirty(void)
+{
+	if (super.cleanUnmount == SUPER_CLEAN) {
+		super.cleanUnmount = 0;
+		if (super_write() == 0) {
+			block_disk_flush();
+		}
+	}
+}
+
+/* The FAT block holding the entry of @block has to be written back */
+static void fat_touch(uint16_t block)
+{
+	size_t b = block / FAT_PER_BLOCK;
+	fatDirty[b / 64] |= 1ULL << (b % 64);
+}
+
+/* Take free data block @block, as the end of a chain for now */
+static void fat_take(uint16_t block)
+{
+	fs_dirty();
+	fat_touch(block);
+	fat[block] = FAT_EOC;
+	freeCount--;
+	if (block == nextFree) {
+		nextFree++;
+	}
+}
+
+/* Give data block @block back to the free pool, as of the next sync */
+static void fat_give(uint16_t block)
+{
+	fs_dirty();
+	fat_touch(block);
+	chainGen++;
+	fat[block] = FAT_PENDING;
+	pendingFree[numPending++] = block;
+	freeCount++;
+}
+
+/* Link @block to @next, which outdates the chain indexes unless @block ended its chain */
+static void fat_link(uint16_t block, uint16_t next)
+{
+	if (fat[block] != FAT_EOC) {
+		chainGen++;
+	}
+	fat_touch(block);
+	fat[block] = next;
+}
+
+/* Return a data block no chain or tail uses any more to the free pool */
+static void release_block(uint16_t block)
+{
+	fat_give(block);
+	refCount[block] = 0;
+	dedup_note(block, NULL);
+}
+
+/*
+ * Drop a reference to the chain starting at @block. The blocks nothing else
+ * refers to any more are freed. Return the number of blocks freed.
+ */
+static size_t chain_put(uint16_t block)
+{
+	size_t n = 0;
+	while (block != FAT_EOC && --refCount[block] == 0) {
+		uint16_t next = fat[block];
+		fat_give(block);
+		dedup_note(block, NULL);
+		n++;
+		block = next;
+	}
+	return n;
+}
+
+/* Drop the references root entry @e holds, freeing what only it used */
+static void entry_put(struct rootEntry *e)
+{
+	tail_release(e);
+	chain_put(e->dataBlockIndex);
+	e->dataBlockIndex = FAT_EOC;
+}
+
+int fs_delete(const char *filename)
+{
+	FS_LOCKED();
+
+	/* TODO: Phase 2 */
+	if (filename == NULL || fat == NULL || fs_ready() == -1) {
+		return -1;
+	}
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (strcmp((char*)root.rootEntry[i].fileName, filename) == 0) {
+			/* Blocks still used by clones or snapshots stay */
+			entry_put(&root.rootEntry[i]);
+
+			/* Destroy Root Entry */
+			root.rootEntry[i].fileSize = 0;
+			root.rootEntry[i].fileName[0] = '\0';
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+int fs_trim(void)
+{
+	FS_LOCKED();
+
+	if (fat == NULL || fs_ready() == -1) {
+		return -1;
+	}
+
+	/* Walk the free runs of the FAT, entry 0 is never a data block */
+	const struct fatKernels *k = fat_kernels();
+	size_t n = super.numDataBlocks;
+	int discarded = 0;
+	for (size_t start = k->find_free(fat, nextFree, n); start < n; ) {
+		size_t end = k->find_used(fat, start, n);
+		if (block_discard(super.dataIndex + start, end - start) == -1) {
+			return -1;
+		}
+		discarded += end - start;
+		start = k->find_free(fat, end, n);
+	}
+
+	return discarded;
+}
+
+int fs_ls(void)
+{
+	FS_LOCKED();
+
+	printf("FS ls:\n");
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (root.rootEntry[i].fileName[0] != '\0') {
+			struct rootEntry entry = root.rootEntry[i];
+			printf("File Name: %s\n Data Block Index: %i\n Size: %i\n", (char*)entry.fileName, entry.dataBlockIndex, entry.fileSize);
+		}
+	}
+	return 0;
+}
+
+struct fs_dir *fs_opendir(const char *prefix)
+{
+	FS_LOCKED();
+
+	if (fat == NULL || (prefix && strlen(prefix) >= FS_FILENAME_LEN)) {
+		return NULL;
+	}
+
+	struct fs_dir *dir = calloc(1, sizeof(*dir));
+	if (dir == NULL) {
+		return NULL;
+	}
+	if (prefix) {
+		dir->prefixLen = strlen(prefix);
+		memcpy(dir->prefix, prefix, dir->prefixLen);
+	}
+
+	return dir;
+}
+
+int fs_readdir(struct fs_dir *dir, struct fs_dirent *entry)
+{
+	FS_LOCKED();
+
+	if (fat == NULL || dir == NULL || entry == NULL) {
+		return -1;
+	}
+
+	while (dir->next < FS_FILE_MAX_COUNT) {
+		struct rootEntry *e = &root.rootEntry[dir->next++];
+		if (e->fileName[0] == '\0' ||
+		    memcmp(e->fileName, dir->prefix, dir->prefixLen) != 0) {
+			continue;
+		}
+
+		memcpy(entry->name, e->fileName, FS_FILENAME_LEN);
+		entry->name[FS_FILENAME_LEN - 1] = '\0';
+		entry->size = e->fileSize;
+		entry->first_block = e->dataBlockIndex;
+		entry->tail_block = e->tailBlock ? e->tailBlock : FS_BLOCK_NONE;
+		entry->tail_offset = e->tailOffset;
+		entry->compressed = (e->fileFlags & ENTRY_COMPRESSED) != 0;
+		entry->runs = chain_runs(e->dataBlockIndex, NULL);
+		return 1;
+	}
+
+	return 0;
+}
+
+int fs_closedir(struct fs_dir *dir)
+{
+	if (dir == NULL) {
+		return -1;
+	}
+
+	free(dir);
+	return 0;
+}
+
+/* Root directory slot of @filename, or -1 if there is no such file */
+static int find_entry(const char *filename)
+{
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (root.rootEntry[i].fileName[0] != '\0' &&
+		    strcmp(root.rootEntry[i].fileName, filename) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* Root directory slot of the file behind @fd, or -1 if @fd is not open */
+static int fd_entry(int fd)
+{
+	if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || open_files.numFilesOpen == 0 ||
+	    open_files.fileEntry[fd].fileName[0] == '\0') { // Out of bounds and File Existence Check
+		return -1;
+	}
+	return find_entry(open_files.fileEntry[fd].fileName);
+}
+
+int fs_map(const char *filename, uint16_t *blocks, size_t count)
+{
+	FS_LOCKED();
+
+	if (fat == NULL || filename == NULL) {
+		return -1;
+	}
+	int entry = find_entry(filename);
+	if (entry == -1) {
+		return -1;
+	}
+
+	struct rootEntry *file = &root.rootEntry[entry];
+	if ((file->fileFlags & ENTRY_COMPRESSED) || (refCount == NULL && !chain_sound(file))) {
+		return -1;
+	}
+	size_t want = (file->fileSize + blockSize - 1) / blockSize;
+	size_t n = 0;
+	for (uint16_t i = file->dataBlockIndex; i != FAT_EOC && n < want; i = fat[i]) {
+		if (n < count) {
+			blocks[n] = i;
+		}
+		n++;
+	}
+
+	return n;
+}
+
+int fs_read_block(uint16_t block, void *buf)
+{
+	FS_LOCKED();
+
+	if (fat == NULL || buf == NULL || block >= super.numDataBlocks) {
+		return -1;
+	}
+
+	return block_read(block + super.dataIndex, buf);
+}
+
+int fs_block_size(void)
+{
+	FS_LOCKED();
+
+	if (fat == NULL) {
+		return -1;
+	}
+
+	return blockSize;
+}
+
+int fs_open(const char *filename)
+{
+	FS_LOCKED();
+
+	/* TODO: Phase 3 */
+	if (fat == NULL || filename == NULL || open_files.numFilesOpen == FS_OPEN_MAX_COUNT) {
+		return -1;
+	}
+
+	/* Only this file's chain needs to be sound to read it */
+	int entry = find_entry(filename);
+	if (entry == -1 || (refCount == NULL && !chain_sound(&root.rootEntry[entry]))) {
+		return -1;
+	}
+
+	for (int fd = 0; fd < FS_OPEN_MAX_COUNT; fd++) {
+		if (open_files.fileEntry[fd].fileName[0] == '\0'){
+			strcpy(open_files.fileEntry[fd].fileName, filename);
+			open_files.numFilesOpen++;
+			open_files.fileEntry[fd].offset = 0;
+			readState[fd] = (struct readState){ FS_ADVICE_NORMAL, 0, 0 };
+			return fd;
+		}
+	}
+
+	return -1;
+}
+
+int fs_close(int fd)
+{
+	FS_LOCKED();
+
+	/* TODO: Phase 3 */
+	if (fd < 0 || fd > 31 || open_files.numFilesOpen == 0 || open_files.fileEntry[fd].fileName[0] == '\0') { // Out of bounds and File Existence Check
+		return -1;
+	}
+	else {
+		int entry = fd_entry(fd);
+		open_files.fileEntry[fd].offset = 0;
+		open_files.fileEntry[fd].fileName[0] = '\0';
+		open_files.numFilesOpen--;
+		fd_index_free(fd);
+
+		/* Compress, pack and deduplicate once the last descriptor goes away */
+		if ((mountFlags & (FS_MOUNT_TAILPACK | FS_MOUNT_DEDUP | FS_MOUNT_COMPRESS)) &&
+		    entry != -1 && fs_ready() == 0) {
+			bool stillOpen = false;
+			for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+				if (strcmp(open_files.fileEntry[i].fileName,
+				           root.rootEntry[entry].fileName) == 0) {
+					stillOpen = true;
+				}
+			}
+			if (!stillOpen && (mountFlags & FS_MOUNT_COMPRESS)) {
+				z_pack(&root.rootEntry[entry]);
+			}
+			if (!stillOpen && (mountFlags & FS_MOUNT_TAILPACK)) {
+				tail_pack(&root.rootEntry[entry]);
+			}
+			if (!stillOpen && (mountFlags & FS_MOUNT_DEDUP)) {
+				dedup_file(&root.rootEntry[entry]);
+			}
+		}
+	}
+
+	return 0;
+}
+
+int fs_stat(int fd)
+{
+	FS_LOCKED();
+
+	/* TODO: Phase 3 */
+	int entry = fd_entry(fd);
+	if (entry == -1) {
+		return -1;
+	}
+
+	return root.rootEntry[entry].fileSize;
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	FS_LOCKED();
+
+	/* TODO: Phase 3 */
+	int entry = fd_entry(fd);
+	if (entry == -1 || offset > root.rootEntry[entry].fileSize) {
+		return -1;
+	}
+
+	open_files.fileEntry[fd].offset = offset;
+	return 0;
+}
+
+/*
+ * Data block @*index of the chain starting at @head, through the index of
+ * open file @fd. If the chain is shorter, return its last block and set
+ * @*index to where that is, or return FAT_EOC if the chain is empty.
+ */
+static uint16_t fd_block(int fd, uint16_t head, size_t *index)
+{
+	struct chainIndex *idx = &chainIdx[fd];
+	if (idx->head != head || idx->gen != chainGen) {
+		idx->head = head;
+		idx->gen = chainGen;
+		idx->len = 0;
+	}
+	if (head == FAT_EOC) {
+		return FAT_EOC;
+	}
+	if (idx->len == 0 && (idx->cap > 0 || (idx->blocks = malloc(64 * sizeof(uint16_t))) != NULL)) {
+		idx->cap = idx->cap > 0 ? idx->cap : 64;
+		idx->blocks[idx->len++] = head;
+	}
+
+	/* Extend from the last block known, a chain never being longer than the disk */
+	while (idx->len > 0 && idx->len <= *index && idx->len < super.numDataBlocks &&
+	       fat[idx->blocks[idx->len - 1]] != FAT_EOC) {
+		if (idx->len == idx->cap) {
+			uint16_t *blocks = realloc(idx->blocks, 2 * idx->cap * sizeof(uint16_t));
+			if (blocks == NULL) {
+				break;
+			}
+			idx->blocks = blocks;
+			idx->cap *= 2;
+		}
+		idx->blocks[idx->len] = fat[idx->blocks[idx->len - 1]];
+		idx->len++;
+	}
+	if (*index < idx->len) {
+		return idx->blocks[*index];
+	}
+
+	/* Out of memory or past the end: walk on from the last block known */
+	size_t at = idx->len > 0 ? idx->len - 1 : 0;
+	uint16_t block = idx->len > 0 ? idx->blocks[at] : head;
+	while (at < *index && at < super.numDataBlocks && fat[block] != FAT_EOC) {
+		block = fat[block];
+		at++;
+	}
+	*index = at;
+	return block;
+}
+
+/* Data block holding byte @offset of the chain starting at @start_index, open as @fd */
+uint16_t dataBlockIndex(int fd, size_t offset, uint16_t start_index)
+{
+	size_t index = offset / blockSize;
+	uint16_t dataIndex = fd_block(fd, start_index, &index);
+	return index == offset / blockSize ? dataIndex : FAT_EOC;
+}
+
+/* Forget the chain index of open file @fd */
+static void fd_index_free(int fd)
+{
+	free(chainIdx[fd].blocks);
+	chainIdx[fd] = (struct chainIndex){ 0 };
+}
+
+uint16_t findOpenFAT()
+{
+	/* Nothing is free below the hint, which can move up to what is found */
+	size_t index = fat_kernels()->find_free(fat, nextFree, super.numDataBlocks);
+	nextFree = index;
+	return index < super.numDataBlocks ? index : FAT_EOC;
+}
+
+/* Claim a free data block as a one-block chain, FAT_EOC if the disk is full */
+static uint16_t alloc_block(void)
+{
+	uint16_t index = findOpenFAT();
+
+	/* Blocks freed since the last sync come back with the next one */
+	if (index == FAT_EOC && numPending > 0 && sync_all() == 0) {
+		index = findOpenFAT();
+	}
+	if (index != FAT_EOC) {
+		fat_take(index);
+		refCount[index] = 1;		// For whatever links to it next
+	}
+	return index;
+}
+
+/* Logical index of the first shared block of @file up to @last, SIZE_MAX if none */
+static size_t first_shared(struct rootEntry *file, size_t last)
+{
+	size_t n = 0;
+	for (uint16_t b = file->dataBlockIndex; b != FAT_EOC && n <= last; b = fat[b], n++) {
+		if (refCount[b] > 1) {
+			return n;
+		}
+	}
+	return SIZE_MAX;
+}
+
+/*
+ * Copy on write: give @file blocks of its own up to logical block @last (or
+ * to the end of its chain if that comes first), so that they can be written
+ * or the chain extended. Chains can only share their ends, hence every block
+ * from the first shared one on is copied; the blocks past @last stay shared.
+ * Blocks @whole_from to @whole_to (excluded) are about to be overwritten
+ * completely, they get a block of their own but their content is not copied.
+ * Every copy is allocated and filled before the chain is relinked to any, so
+ * that a failure leaves the chain as it was.
+ */
+static int cow_unshare(struct rootEntry *file, size_t last, size_t whole_from,
+		       size_t whole_to)
+{
+	size_t n = first_shared(file, last);
+	if (n == SIZE_MAX) {
+		return 0;
+	}
+	uint16_t prev = FAT_EOC, block = file->dataBlockIndex;
+	for (size_t i = 0; i < n; i++) {
+		prev = block;
+		block = fat[block];
+	}
+
+	size_t count = 0;
+	for (uint16_t b = block; b != FAT_EOC && n + count <= last; b = fat[b]) {
+		count++;
+	}
+	if (count > freeCount) {
+		return -1;
+	}
+	uint16_t *copies = malloc(count * sizeof(uint16_t));
+	void *bounce = pool_get(&pool);
+	if (copies == NULL || bounce == NULL) {
+		free(copies);
+		pool_put(&pool, bounce);
+		return -1;
+	}
+
+	size_t made = 0;
+	bool ok = true;
+	for (uint16_t b = block; ok && made < count; b = fat[b]) {
+		uint16_t copy = alloc_block();
+		if (copy == FAT_EOC) {
+			ok = false;
+			break;
+		}
+		copies[made] = copy;
+		size_t i = n + made++;
+		if (i < whole_from || i >= whole_to) {
+			ok = block_read(super.dataIndex + b, bounce) == 0 &&
+			     block_write(super.dataIndex + copy, bounce) == 0;
+			if (ok) {
+				dedup_note(copy, bounce);
+			}
+		}
+	}
+	pool_put(&pool, bounce);
+	if (!ok) {
+		while (made > 0) {
+			release_block(copies[--made]);
+		}
+		free(copies);
+		return -1;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		/* The copy takes the block's place, and links to the same next one */
+		uint16_t copy = copies[i], next = fat[block];
+		fat_link(copy, next);
+		if (next != FAT_EOC) {
+			refCount[next]++;
+		}
+		if (prev == FAT_EOC) {
+			file->dataBlockIndex = copy;
+		} else {
+			fat_link(prev, copy);
+		}
+		refCount[block]--;
+
+		prev = copy;
+		block = next;
+	}
+
+	free(copies);
+	return 0;
+}
+
+/*
+ * Tail packing: the last partial block of a file can live at tailOffset in a
+ * shared tail block instead of in a block of its own. A tail block is marked
+ * FAT_EOC without being part of any chain; the root entries pointing at it,
+ * snapshots' included, tell which bytes are in use. Files are packed when closed (with
+ * FS_MOUNT_TAILPACK) and unpacked again before they are modified.
+ */
+
+/* Number of bytes of @file stored in its tail block */
+static size_t tail_len(struct rootEntry *file)
+{
+	return file->tailBlock ? file->fileSize % blockSize : 0;
+}
+
+/* Bring tail block @block into the tail cache */
+static int tail_load(uint16_t block)
+{
+	if (tailCached == block) {
+		return 0;
+	}
+	if (block_read(super.dataIndex + block, tailCache) == -1) {
+		tailCached = 0;
+		return -1;
+	}
+	tailCached = block;
+	return 0;
+}
+
+struct tailExtent {
+	uint16_t block;
+	uint32_t start;
+	uint32_t end;				// Can be the block size itself, up to 64 KiB
+};
+
+static int cmp_extent(const void *a, const void *b)
+{
+	const struct tailExtent *x = a, *y = b;
+	if (x->block != y->block) {
+		return x->block - y->block;
+	}
+	return (int)x->start - (int)y->start;
+}
+
+/* Find @len free bytes in a tail block (first fit), or start a new one */
+static int tail_place(size_t len, uint16_t *block, uint16_t *offset)
+{
+	struct tailExtent ext[FS_FILE_MAX_COUNT * (FS_SNAPSHOT_MAX + 1)];
+	int n = 0;
+
+	for (int s = -1; s < FS_SNAPSHOT_MAX; s++) {
+		struct rootDirectory *dir = root_dir(s);
+		for (int i = 0; dir != NULL && i < FS_FILE_MAX_COUNT; i++) {
+			struct rootEntry *e = &dir->rootEntry[i];
+			if (e->fileName[0] != '\0' && e->tailBlock != 0) {
+				ext[n].block = e->tailBlock;
+				ext[n].start = e->tailOffset;
+				ext[n].end = e->tailOffset + tail_len(e);
+				n++;
+			}
+		}
+	}
+	qsort(ext, n, sizeof(*ext), cmp_extent);
+
+	for (int i = 0; i < n; ) {
+		size_t cursor = 0;
+		int j = i;
+		for (; j < n && ext[j].block == ext[i].block; j++) {
+			if (ext[j].start >= cursor + len) {
+				break;
+			}
+			if (ext[j].end > cursor) {
+				cursor = ext[j].end;
+			}
+		}
+		if (cursor + len <= blockSize) {
+			*block = ext[i].block;
+			*offset = cursor;
+			return 0;
+		}
+		while (j < n && ext[j].block == ext[i].block) {
+			j++;
+		}
+		i = j;
+	}
+
+	/* A fresh tail block starts out zeroed, no need to read it */
+	uint16_t fresh = alloc_block();
+	if (fresh == FAT_EOC) {
+		return -1;
+	}
+	refCount[fresh] = 0;		// Until a tail is placed in it
+	memset(tailCache, 0, blockSize);
+	tailCached = fresh;
+	*block = fresh;
+	*offset = 0;
+	return 0;
+}
+
+/* Detach @file from its tail block, freeing the block if nobody else uses it */
+static void tail_release(struct rootEntry *file)
+{
+	uint16_t block = file->tailBlock;
+	if (block == 0) {
+		return;
+	}
+	file->tailBlock = 0;
+	file->tailOffset = 0;
+
+	/* Other files, clones or snapshots may have their tail in it too */
+	if (--refCount[block] > 0) {
+		return;
+	}
+	if (tailCached == block) {
+		tailCached = 0;
+	}
+	release_block(block);
+}
+
+/* Move the last partial block of @file into a shared tail block */
+static void tail_pack(struct rootEntry *file)
+{
+	size_t len = file->fileSize % blockSize;
+	if (file->tailBlock != 0 || len == 0 || len > TAIL_MAX ||
+	    (file->fileFlags & ENTRY_COMPRESSED)) {
+		return;
+	}
+
+	/* Packing relinks the chain, which must then be the file's alone */
+	if (first_shared(file, SIZE_MAX) != SIZE_MAX) {
+		return;
+	}
+
+	/* Find the partial block; blocks reserved past it mean more is coming */
+	uint16_t prev = FAT_EOC, last = file->dataBlockIndex;
+	for (size_t n = file->fileSize / blockSize; n > 0 && last != FAT_EOC; n--) {
+		prev = last;
+		last = fat[last];
+	}
+	if (last == FAT_EOC || fat[last] != FAT_EOC) {
+		return;
+	}
+
+	void *bounce = pool_get(&pool);
+	if (bounce == NULL) {
+		return;
+	}
+	uint16_t block, offset;
+	if (block_read(super.dataIndex + last, bounce) == -1 ||
+	    tail_place(len, &block, &offset) == -1) {
+		pool_put(&pool, bounce);
+		return;
+	}
+	if (tail_load(block) == -1) {
+		pool_put(&pool, bounce);
+		return;
+	}
+	memcpy(tailCache + offset, bounce, len);
+	pool_put(&pool, bounce);
+	if (block_write(super.dataIndex + block, tailCache) == -1) {
+		tailCached = 0;
+		/* Free the block unless other files were already packed in it */
+		if (refCount[block] == 0) {
+			release_block(block);
+		}
+		return;
+	}
+
+	if (prev == FAT_EOC) {
+		file->dataBlockIndex = FAT_EOC;
+	} else {
+		fat_link(prev, FAT_EOC);
+	}
+	release_block(last);
+	refCount[block]++;
+	file->tailBlock = block;
+	file->tailOffset = offset;
+}
+
+/* Give the tail of @file a block of its own again, at the end of its chain */
+static int tail_unpack(struct rootEntry *file)
+{
+	size_t len = tail_len(file);
+	if (len == 0) {
+		return 0;
+	}
+
+	/* The tail goes after the last block, which must be the file's alone */
+	if (cow_unshare(file, SIZE_MAX, 0, 0) == -1 || tail_load(file->tailBlock) == -1) {
+		return -1;
+	}
+	void *bounce = pool_get(&pool);
+	if (bounce == NULL) {
+		return -1;
+	}
+	uint16_t block = alloc_block();
+	if (block == FAT_EOC) {
+		pool_put(&pool, bounce);
+		return -1;
+	}
+	memset(bounce, 0, blockSize);
+	memcpy(bounce, tailCache + file->tailOffset, len);
+	int ret = block_write(super.dataIndex + block, bounce);
+	if (ret == 0) {
+		dedup_note(block, bounce);
+	}
+	pool_put(&pool, bounce);
+	if (ret == -1) {
+		release_block(block);
+		return -1;
+	}
+
+	if (file->dataBlockIndex == FAT_EOC) {
+		file->dataBlockIndex = block;
+	} else {
+		uint16_t last = file->dataBlockIndex;
+		while (fat[last] != FAT_EOC) {
+			last = fat[last];
+		}
+		fat_link(last, block);
+	}
+	tail_release(file);
+	return 0;
+}
+
+/*
+ * Compression: the chain of a compressed file holds a stream made of its
+ * block map, then of each of its blocks compressed (or stored as is when that
+ * does not make it smaller), back to back. The map, padded to a whole block,
+ * has the end offset of each compressed block in the rest of the stream.
+ * Files flagged with ENTRY_COMPRESS are compressed when closed (with
+ * FS_MOUNT_COMPRESS), and decompressed again before they are modified.
+ */
+
+/* Number of blocks the content of @file spans */
+static size_t file_blocks(struct rootEntry *file)
+{
+	return (file->fileSize + blockSize - 1) / blockSize;
+}
+
+/* Bytes of @file in its block @index */
+static size_t file_block_len(struct rootEntry *file, size_t index)
+{
+	size_t left = file->fileSize - index * blockSize;
+	return left < blockSize ? left : blockSize;
+}
+
+/* Blocks taken by the map at the start of the stream of @file */
+static size_t z_map_blocks(struct rootEntry *file)
+{
+	return (file_blocks(file) * sizeof(uint32_t) + blockSize - 1) / blockSize;
+}
+
+/* Drop the cached blocks and map, for a new stream can reuse their chain */
+static void z_forget(void)
+{
+	for (int i = 0; i < ZCACHE_SLOTS; i++) {
+		zCache[i].valid = false;
+	}
+	free(zMap);
+	zMap = NULL;
+	zMapHead = FAT_EOC;
+}
+
+/* Walk of the chain of a compressed file, for the span of one call */
+struct zReader {
+	struct rootEntry *file;
+	size_t at;					// Chain position of @block
+	uint16_t block;
+	size_t loaded;				// Chain position held in @raw, SIZE_MAX if none
+	char *raw;
+	char *packed;				// One compressed block, gathered from @raw
+};
+
+/* Bring chain position @pos into @r->raw */
+static int z_load(struct zReader *r, size_t pos)
+{
+	if (r->loaded == pos) {
+		return 0;
+	}
+	if (pos < r->at) {
+		r->at = 0;
+		r->block = r->file->dataBlockIndex;
+	}
+	for (; r->at < pos && r->block != FAT_EOC; r->at++) {
+		r->block = fat[r->block];
+	}
+	r->loaded = SIZE_MAX;
+	if (r->block == FAT_EOC || block_read(super.dataIndex + r->block, r->raw) == -1) {
+		return -1;
+	}
+	r->loaded = pos;
+	return 0;
+}
+
+/* Block @index of the compressed file of @r, decompressed; NULL on error */
+static char *z_block(struct zReader *r, size_t index)
+{
+	struct rootEntry *file = r->file;
+	for (int i = 0; i < ZCACHE_SLOTS; i++) {
+		if (zCache[i].valid && zCache[i].head == file->dataBlockIndex &&
+		    zCache[i].index == index) {
+			return zCache[i].data;
+		}
+	}
+
+	/* Where the block is, from the map */
+	if (zMapHead != file->dataBlockIndex) {
+		free(zMap);
+		zMapHead = FAT_EOC;
+		zMap = malloc(file_blocks(file) * sizeof(uint32_t));
+		if (zMap == NULL || chain_rw(file->dataBlockIndex, zMap,
+		                             file_blocks(file) * sizeof(uint32_t), false) == -1) {
+			return NULL;
+		}
+		zMapHead = file->dataBlockIndex;
+	}
+	size_t start = index ? zMap[index - 1] : 0;
+	size_t len = zMap[index] - start;
+	size_t want = file_block_len(file, index);
+	if (zMap[index] < start || len > want) {
+		return NULL;
+	}
+
+	/* Gather it, it may straddle two blocks of the chain */
+	size_t pos = z_map_blocks(file) * blockSize + start;
+	for (size_t done = 0; done < len; ) {
+		if (z_load(r, (pos + done) / blockSize) == -1) {
+			return NULL;
+		}
+		size_t within = (pos + done) % blockSize;
+		size_t chunk = blockSize - within < len - done ? blockSize - within : len - done;
+		memcpy(r->packed + done, r->raw + within, chunk);
+		done += chunk;
+	}
+
+	struct zCacheSlot *slot = &zCache[zCacheNext];
+	if (slot->data == NULL && (slot->data = malloc(blockSize)) == NULL) {
+		return NULL;
+	}
+	slot->valid = false;
+	if (len == want) {
+		memcpy(slot->data, r->packed, len);
+	} else if (lz_decompress(r->packed, len, slot->data, want) != (long)want) {
+		return NULL;
+	}
+	memset(slot->data + want, 0, blockSize - want);
+	slot->valid = true;
+	slot->head = file->dataBlockIndex;
+	slot->index = index;
+	zCacheNext = (zCacheNext + 1) % ZCACHE_SLOTS;
+	return slot->data;
+}
+
+/* Read @count bytes at @offset of compressed @file, return how many were */
+static size_t z_read(struct rootEntry *file, size_t offset, void *buf, size_t count)
+{
+	struct zReader r = { file, 0, file->dataBlockIndex, SIZE_MAX,
+	                     pool_get(&pool), pool_get(&pool) };
+	size_t bytes = 0;
+
+	while (r.raw != NULL && r.packed != NULL && bytes < count) {
+		size_t within = (offset + bytes) % blockSize;
+		char *data = z_block(&r, (offset + bytes) / blockSize);
+		if (data == NULL) {
+			break;
+		}
+		size_t chunk = blockSize - within < count - bytes ? blockSize - within : count - bytes;
+		memcpy((char*)buf + bytes, data + within, chunk);
+		bytes += chunk;
+	}
+
+	pool_put(&pool, r.raw);
+	pool_put(&pool, r.packed);
+	return bytes;
+}
+
+/* Add a free block at the end of the chain from @head to @last, FAT_EOC if full */
+static uint16_t chain_append(uint16_t *head, uint16_t *last)
+{
+	uint16_t block = alloc_block();
+	if (block == FAT_EOC) {
+		return FAT_EOC;
+	}
+	if (*last == FAT_EOC) {
+		*head = block;
+	} else {
+		fat_link(*last, block);
+	}
+	*last = block;
+	return block;
+}
+
+/* Replace the blocks of @file with a compressed stream, if that saves any */
+static void z_pack(struct rootEntry *file)
+{
+	size_t n = file_blocks(file);
+	if (!(file->fileFlags & ENTRY_COMPRESS) || (file->fileFlags & ENTRY_COMPRESSED) || n == 0) {
+		return;
+	}
+
+	uint32_t *map = malloc(n * sizeof(uint32_t));
+	char *in = pool_get(&pool);
+	char *out = pool_get(&pool);
+	char *packed = pool_get(&pool);
+	uint16_t head = FAT_EOC, last = FAT_EOC;
+	bool ok = map != NULL && in != NULL && out != NULL && packed != NULL;
+
+	/* The map comes first, it is written once complete */
+	for (size_t i = z_map_blocks(file); ok && i > 0; i--) {
+		ok = chain_append(&head, &last) != FAT_EOC;
+	}
+
+	size_t end = 0, used = z_map_blocks(file);
+	uint16_t src = file->dataBlockIndex;
+	for (size_t i = 0; ok && i < n; i++) {
+		size_t len = file_block_len(file, i);
+		if (src != FAT_EOC) {
+			ok = block_read(super.dataIndex + src, in) == 0;
+			src = fat[src];
+		} else {
+			/* Only the last block can be missing from the chain: a packed tail */
+			ok = file->tailBlock != 0 && tail_load(file->tailBlock) == 0;
+			if (ok) {
+				memcpy(in, tailCache + file->tailOffset, len);
+			}
+		}
+
+		/* Blocks that do not shrink are stored as they are */
+		size_t plen = ok ? lz_compress(in, len, packed, len - 1) : 0;
+		const char *data = plen ? packed : in;
+		if (plen == 0) {
+			plen = len;
+		}
+
+		for (size_t done = 0; ok && done < plen; ) {
+			size_t within = end % blockSize;
+			size_t chunk = blockSize - within < plen - done ? blockSize - within : plen - done;
+			memcpy(out + within, data + done, chunk);
+			done += chunk;
+			end += chunk;
+			if (end % blockSize == 0 || (i == n - 1 && done == plen)) {
+				/* Only worth it if it ends up smaller */
+				memset(out + end % blockSize, 0, end % blockSize ? blockSize - end % blockSize : 0);
+				ok = ++used < n && chain_append(&head, &last) != FAT_EOC &&
+				     block_write(super.dataIndex + last, out) == 0;
+			}
+		}
+		map[i] = end;
+	}
+	if (ok) {
+		ok = chain_rw(head, map, n * sizeof(uint32_t), true) == 0;
+	}
+
+	free(map);
+	pool_put(&pool, in);
+	pool_put(&pool, out);
+	pool_put(&pool, packed);
+	if (!ok) {
+		chain_put(head);
+		return;
+	}
+
+	/* Swap the chains, the old one stays for clones and snapshots using it */
+	struct rootEntry old = *file;
+	entry_put(&old);
+	file->dataBlockIndex = head;
+	file->tailBlock = 0;
+	file->tailOffset = 0;
+	file->fileFlags |= ENTRY_COMPRESSED;
+	z_forget();
+}
+
+/* Give @file plain blocks again, in a chain of its own */
+static int z_unpack(struct rootEntry *file)
+{
+	if (!(file->fileFlags & ENTRY_COMPRESSED)) {
+		return 0;
+	}
+
+	struct zReader r = { file, 0, file->dataBlockIndex, SIZE_MAX,
+	                     pool_get(&pool), pool_get(&pool) };
+	uint16_t head = FAT_EOC, last = FAT_EOC;
+	bool ok = r.raw != NULL && r.packed != NULL;
+	for (size_t i = 0; ok && i < file_blocks(file); i++) {
+		char *data = z_block(&r, i);
+		ok = data != NULL && chain_append(&head, &last) != FAT_EOC &&
+		     block_write(super.dataIndex + last, data) == 0;
+		if (ok) {
+			dedup_note(last, data);
+		}
+	}
+	pool_put(&pool, r.raw);
+	pool_put(&pool, r.packed);
+	if (!ok) {
+		chain_put(head);
+		return -1;
+	}
+
+	struct rootEntry old = *file;
+	entry_put(&old);
+	file->dataBlockIndex = head;
+	file->fileFlags &= ~ENTRY_COMPRESSED;
+	return 0;
+}
+
+int fs_reserve(int fd, size_t size)
+{
+	FS_LOCKED();
+
+	int entry = fd_entry(fd);
+	if (entry == -1 || fs_ready() == -1) {
+		return -1;
+	}
+	struct rootEntry *file = &root.rootEntry[entry];
+	if (z_unpack(file) == -1 || tail_unpack(file) == -1) {
+		return -1;
+	}
+
+	/* Count the blocks the chain already has */
+	size_t have = 0;
+	for (uint16_t i = file->dataBlockIndex; i != FAT_EOC; i = fat[i]) {
+		have++;
+	}
+
+	size_t want = (size + blockSize - 1) / blockSize;
+	if (want <= have) {
+		return 0;
+	}
+	size_t need = want - have;
+	if (need > (size_t)free_fat()) {
+		return -1;
+	}
+
+	/* New blocks get linked after the last one, which must be the file's alone */
+	if (cow_unshare(file, SIZE_MAX, 0, 0) == -1) {
+		return -1;
+	}
+	uint16_t last = FAT_EOC;
+	for (uint16_t i = file->dataBlockIndex; i != FAT_EOC; i = fat[i]) {
+		last = i;
+	}
+
+	/* Prefer one contiguous run, fall back to first fit block by block */
+	const struct fatKernels *k = fat_kernels();
+	size_t run = fat_find_free_run(k, fat, nextFree, super.numDataBlocks, need);
+	for (size_t n = 0; n < need; n++) {
+		uint16_t next;
+		if (run < super.numDataBlocks) {
+			next = run + n;
+			fat_take(next);
+			refCount[next] = 1;
+		} else {
+			next = alloc_block();
+			if (next == FAT_EOC) {
+				return -1;
+			}
+		}
+
+		if (last == FAT_EOC) {
+			file->dataBlockIndex = next;
+		} else {
+			fat_link(last, next);
+		}
+		last = next;
+	}
+
+	return 0;
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+	FS_LOCKED();
+
+	/* TODO: Phase 4 */
+	int entry = fd_entry(fd);
+	if (entry == -1 || buf == NULL || fs_ready() == -1) {
+		return -1;
+	} else if (count == 0) {
+		return 0;
+	}
+
+	struct rootEntry *file = &root.rootEntry[entry];
+	size_t offset = open_files.fileEntry[fd].offset;
+
+	/*
+	 * Packed and compressed files are only ever modified in blocks of their
+	 * own. Without room for those, nothing is written and the file stays as is
+	 */
+	if (z_unpack(file) == -1 || tail_unpack(file) == -1) {
+		return 0;
+	}
+
+	/* So are shared ones, which get copies of the blocks about to change */
+	if (cow_unshare(file, (offset + count - 1) / blockSize,
+	                (offset + blockSize - 1) / blockSize, (offset + count) / blockSize) == -1) {
+		return 0;
+	}
+
+	/* File Empty: No Allocated Blocks, Find First Availiable Block in FAT */
+	if (file->dataBlockIndex == FAT_EOC) {
+		file->dataBlockIndex = alloc_block();
+		if (file->dataBlockIndex == FAT_EOC) {
+			return 0;
+		}
+	}
+
+	/* Go to the block holding @offset, extending the chain if needed */
+	size_t at = offset / blockSize;
+	uint16_t dataIndex = fd_block(fd, file->dataBlockIndex, &at);
+	for (size_t n = offset / blockSize - at; n > 0; n--) {
+		if (fat[dataIndex] == FAT_EOC) {
+			uint16_t next = alloc_block();
+			if (next == FAT_EOC) {
+				return 0;
+			}
+			fat_link(dataIndex, next);
+		}
+		dataIndex = fat[dataIndex];
+	}
+
+	void *bounce = NULL;
+	size_t written = 0;
+	while (written < count) {
+		size_t block_offset = offset % blockSize;
+		size_t chunk = blockSize - block_offset;
+		if (chunk > count - written) {
+			chunk = count - written;
+		}
+		size_t actualIndex = dataIndex + super.dataIndex;
+
+		if (chunk == blockSize) {
+			/* Whole blocks: extend over the chain while it stays contiguous */
+			uint16_t first = dataIndex;
+			size_t n = 1;
+			while ((count - written) / blockSize > n) {
+				if (fat[dataIndex] == FAT_EOC) {
+					uint16_t next = alloc_block();
+					if (next == FAT_EOC) {
+						break;
+					}
+					fat_link(dataIndex, next);
+				}
+				if (fat[dataIndex] != dataIndex + 1) {
+					break;
+				}
+				dataIndex++;
+				n++;
+			}
+			if (block_write_many(actualIndex, n, (char*)buf + written) == -1) {
+				break;
+			}
+			for (size_t i = 0; i < n; i++) {
+				dedup_note(first + i, (char*)buf + written + i * blockSize);
+			}
+			chunk = n * blockSize;
+		} else {
+			/* Partial block: read-modify-write through a scratch slab */
+			if (bounce == NULL && (bounce = pool_get(&pool)) == NULL) {
+				break;
+			}
+			if (offset - block_offset < file->fileSize) {
+				if (block_read(actualIndex, bounce) == -1) {
+					break;
+				}
+			} else {
+				memset(bounce, 0, blockSize);
+			}
+			memcpy((char*)bounce + block_offset, (char*)buf + written, chunk);
+			if (block_write(actualIndex, bounce) == -1) {
+				break;
+			}
+			dedup_note(dataIndex, bounce);
+		}
+
+		written += chunk;
+		offset += chunk;
+		if (offset > file->fileSize) {
+			file->fileSize = offset;
+		}
+
+		if (written < count) {
+			if (fat[dataIndex] == FAT_EOC) {
+				uint16_t next = alloc_block();
+				if (next == FAT_EOC) {
+					break;
+				}
+				fat_link(dataIndex, next);
+			}
+			dataIndex = fat[dataIndex];
+		}
+	}
+
+	pool_put(&pool, bounce);
+	open_files.fileEntry[fd].offset = offset;
+	return written;
+}
+
+/* Number of blocks from data block @block on that are adjacent, at most @max */
+static size_t run_length(uint16_t block, size_t max)
+{
+	size_t n = 1;
+	while (n < max && fat[block] == block + 1) {
+		block++;
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Read blocks @from to @to - 1 of the chain of @file, open as @fd, into the
+ * block cache, or evict them from it if @drop.
+ */
+static int chain_cache(int fd, struct rootEntry *file, size_t from, size_t to, bool drop,
+                       int flags)
+{
+	while (from < to) {
+		size_t at = from;
+		uint16_t block = fd_block(fd, file->dataBlockIndex, &at);
+		if (block == FAT_EOC || at != from) {
+			break;
+		}
+		size_t n = run_length(block, to - from);
+		if (drop) {
+			block_cache_drop(super.dataIndex + block, n);
+		} else if (block_prefetch(super.dataIndex + block, n, flags) == -1) {
+			return -1;
+		}
+		from += n;
+	}
+	return 0;
+}
+
+/* Read ahead of @fd, which fs_read() just left at @offset having started at @start */
+static void read_ahead(int fd, struct rootEntry *file, size_t start, size_t offset)
+{
+	struct readState *rs = &readState[fd];
+	bool follows = start == rs->nextOffset;
+	rs->nextOffset = offset;
+	if (!follows) {
+		rs->aheadEnd = 0;
+	}
+
+	size_t window = 0;
+	if (rs->advice == FS_ADVICE_SEQUENTIAL || rs->advice == FS_ADVICE_NOREUSE) {
+		window = READAHEAD_SEQ_BYTES;
+	} else if (rs->advice == FS_ADVICE_NORMAL && follows) {
+		window = READAHEAD_BYTES;
+	}
+	if (window == 0 || offset >= file->fileSize) {
+		return;
+	}
+
+	/* Go on once half of what was read ahead is used, in requests of half a window */
+	size_t first = offset / blockSize;
+	size_t last = (offset + window + blockSize - 1) / blockSize;
+	size_t blocks = (file->fileSize + blockSize - 1) / blockSize;
+	last = last < blocks ? last : blocks;
+	if (rs->aheadEnd < first) {
+		rs->aheadEnd = first;
+	}
+	if (rs->aheadEnd < last && rs->aheadEnd - first <= (last - first) / 2) {
+		chain_cache(fd, file, rs->aheadEnd, last, false,
+		            rs->advice == FS_ADVICE_NOREUSE ? BLOCK_CACHE_ONCE : 0);
+		rs->aheadEnd = last;
+	}
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	FS_LOCKED();
+
+	/* TODO: Phase 4 */
+	int entry = fd_entry(fd);
+	if (entry == -1 || buf == NULL) {
+		return -1;
+	}
+
+	struct rootEntry *file = &root.rootEntry[entry];
+	size_t offset = open_files.fileEntry[fd].offset;
+	if (offset >= file->fileSize) {
+		return 0;
+	}
+	if (count > file->fileSize - offset) {
+		count = file->fileSize - offset;
+	}
+
+	if (file->fileFlags & ENTRY_COMPRESSED) {
+		size_t bytes = z_read(file, offset, buf, count);
+		open_files.fileEntry[fd].offset = offset + bytes;
+		return bytes;
+	}
+
+	/* Blocks read to the end are not read again when told so */
+	size_t start = offset;
+	int once = readState[fd].advice == FS_ADVICE_NOREUSE ? BLOCK_CACHE_ONCE : 0;
+	uint16_t dataIndex = dataBlockIndex(fd, offset, file->dataBlockIndex);
+	void *bounce = NULL;
+	size_t bytes = 0;
+	while (bytes < count && dataIndex != FAT_EOC) {
+		size_t block_offset = offset % blockSize;
+		size_t chunk = blockSize - block_offset;
+		if (chunk > count - bytes) {
+			chunk = count - bytes;
+		}
+		size_t actualIndex = dataIndex + super.dataIndex;
+
+		if (chunk == blockSize) {
+			/* Whole blocks: one request for the contiguous part of the chain */
+			size_t n = 1;
+			while ((count - bytes) / blockSize > n &&
+			       fat[dataIndex] == dataIndex + 1) {
+				dataIndex++;
+				n++;
+			}
+			if (block_read_cached(actualIndex, n, (char*)buf + bytes, once) == -1) {
+				break;
+			}
+			chunk = n * blockSize;
+		} else {
+			if (bounce == NULL && (bounce = pool_get(&pool)) == NULL) {
+				break;
+			}
+			if (block_read_cached(actualIndex, 1, bounce,
+			                      block_offset + chunk == blockSize ? once : 0) == -1) {
+				break;
+			}
+			memcpy((char*)buf + bytes, (char*)bounce + block_offset, chunk);
+		}
+
+		bytes += chunk;
+		offset += chunk;
+		dataIndex = fat[dataIndex];
+	}
+
+	/* Whatever is left lives in the file's tail block */
+	if (bytes < count && file->tailBlock != 0 && tail_load(file->tailBlock) == 0) {
+		memcpy((char*)buf + bytes, tailCache + file->tailOffset + offset % blockSize,
+		       count - bytes);
+		offset += count - bytes;
+		bytes = count;
+	}
+
+	pool_put(&pool, bounce);
+	open_files.fileEntry[fd].offset = offset;
+	read_ahead(fd, file, start, offset);
+	return bytes;
+}
+
+int fs_advise(int fd, size_t offset, size_t len, int advice)
+{
+	FS_LOCKED();
+
+	int entry = fd_entry(fd);
+	if (entry == -1 || advice < FS_ADVICE_NORMAL || advice > FS_ADVICE_DONTNEED) {
+		return -1;
+	}
+	if (advice < FS_ADVICE_WILLNEED) {
+		readState[fd].advice = advice;
+		readState[fd].aheadEnd = 0;
+		return 0;
+	}
+
+	struct rootEntry *file = &root.rootEntry[entry];
+	if ((file->fileFlags & ENTRY_COMPRESSED) || offset >= file->fileSize) {
+		return 0;
+	}
+	size_t end = len == 0 || len > file->fileSize - offset ? file->fileSize : offset + len;
+	return chain_cache(fd, file, offset / blockSize, (end + blockSize - 1) / blockSize,
+	                   advice == FS_ADVICE_DONTNEED, 0);
+}
+
+/* Largest run of blocks moved by one request when copying */
+#define COPY_MAX_BLOCKS 64
+
+/* fs_read()/fs_write() at @offset, leaving the descriptor's offset alone */
+static int rw_at(int fd, void *buf, size_t count, size_t offset, bool write)
+{
+	size_t saved = open_files.fileEntry[fd].offset;
+	open_files.fileEntry[fd].offset = offset;
+	int ret = write ? fs_write(fd, buf, count) : fs_read(fd, buf, count);
+	open_files.fileEntry[fd].offset = saved;
+	return ret;
+}
+
+/*
+ * Copy @count whole blocks into @fd_out at block-aligned @off_out, from block
+ * aligned @off_in in @fd_in, or from @host_off in @host_fd if @fd_in is -1.
+ * Return the number of bytes copied, or -1.
+ */
+static long copy_blocks(int fd_in, size_t off_in, int host_fd, off_t host_off,
+			int fd_out, size_t off_out, size_t count)
+{
+	/* Reserving first lays the destination out in as few runs as possible */
+	if (fs_reserve(fd_out, off_out + count * blockSize) == -1) {
+		return -1;
+	}
+	struct rootEntry *out = &root.rootEntry[fd_entry(fd_out)];
+	size_t first = off_out / blockSize;
+	if (cow_unshare(out, first + count - 1, first, first + count) == -1) {
+		return -1;
+	}
+	uint16_t dst = dataBlockIndex(fd_out, off_out, out->dataBlockIndex);
+	uint16_t src = FAT_EOC;
+	if (fd_in != -1) {
+		struct rootEntry *in = &root.rootEntry[fd_entry(fd_in)];
+		src = dataBlockIndex(fd_in, off_in, in->dataBlockIndex);
+	}
+
+	char *stage = NULL;
+	size_t done = 0;
+	while (done < count && dst != FAT_EOC) {
+		/* Largest run that is contiguous on both sides */
+		size_t n = run_length(dst, count - done);
+		int ret;
+		if (fd_in == -1) {
+			ret = block_copy_from_fd(super.dataIndex + dst, n, host_fd,
+						 host_off + done * blockSize);
+		} else {
+			if (src == FAT_EOC) {
+				break;
+			}
+			n = run_length(src, n < COPY_MAX_BLOCKS ? n : COPY_MAX_BLOCKS);
+			if (stage == NULL && (stage = malloc(COPY_MAX_BLOCKS * blockSize)) == NULL) {
+				break;
+			}
+			ret = block_read_many(super.dataIndex + src, n, stage);
+			if (ret == 0) {
+				ret = block_write_many(super.dataIndex + dst, n, stage);
+			}
+			src = fat[src + n - 1];
+		}
+		if (ret == -1) {
+			break;
+		}
+		for (size_t i = 0; i < n; i++) {
+			dedup_note(dst + i, fd_in == -1 ? NULL : stage + i * blockSize);
+		}
+
+		done += n;
+		dst = fat[dst + n - 1];
+	}
+	free(stage);
+
+	size_t end = off_out + done * blockSize;
+	if (end > out->fileSize) {
+		out->fileSize = end;
+	}
+	return done == 0 && count > 0 ? -1 : (long)(done * blockSize);
+}
+
+int fs_copy_file_range(int fd_in, size_t off_in, int fd_out, size_t off_out,
+		       size_t len)
+{
+	FS_LOCKED();
+
+	int in = fd_entry(fd_in);
+	int out = fd_entry(fd_out);
+	if (in == -1 || out == -1 || off_out > root.rootEntry[out].fileSize || fs_ready() == -1) {
+		return -1;
+	}
+	size_t size = root.rootEntry[in].fileSize;
+	if (off_in >= size) {
+		return 0;
+	}
+	if (len > size - off_in) {
+		len = size - off_in;
+	}
+	if (in == out && off_in < off_out + len && off_out < off_in + len) {
+		return -1;
+	}
+
+	void *bounce = NULL;
+	size_t done = 0;
+	while (done < len) {
+		size_t from = off_in + done, to = off_out + done;
+		long n;
+
+		if (from % blockSize == 0 && to % blockSize == 0 && len - done >= blockSize &&
+		    !(root.rootEntry[in].fileFlags & ENTRY_COMPRESSED)) {
+			/* Both sides aligned: whole blocks, block to block */
+			n = copy_blocks(fd_in, from, -1, 0, fd_out, to, (len - done) / blockSize);
+		} else {
+			/* Up to the next source block boundary, through a scratch slab */
+			size_t chunk = blockSize - from % blockSize;
+			if (chunk > len - done) {
+				chunk = len - done;
+			}
+			if (bounce == NULL && (bounce = pool_get(&pool)) == NULL) {
+				break;
+			}
+			n = rw_at(fd_in, bounce, chunk, from, false);
+			if (n > 0) {
+				n = rw_at(fd_out, bounce, n, to, true);
+			}
+		}
+		if (n <= 0) {
+			break;
+		}
+		done += n;
+	}
+
+	pool_put(&pool, bounce);
+	return done == 0 && len > 0 ? -1 : (int)done;
+}
+
+int fs_import_range(int host_fd, off_t host_off, int fd_out, size_t off_out,
+		    size_t len)
+{
+	FS_LOCKED();
+
+	int out = fd_entry(fd_out);
+	if (out == -1 || host_off < 0 || off_out > root.rootEntry[out].fileSize || fs_ready() == -1) {
+		return -1;
+	}
+
+	/* Whole blocks are copied blindly, so never ask for more than there is */
+	struct stat st;
+	if (fstat(host_fd, &st) == -1) {
+		return -1;
+	}
+	if (S_ISREG(st.st_mode)) {
+		if (host_off >= st.st_size) {
+			return 0;
+		}
+		if (len > (size_t)(st.st_size - host_off)) {
+			len = st.st_size - host_off;
+		}
+	}
+
+	void *bounce = NULL;
+	size_t done = 0;
+	while (done < len) {
+		size_t to = off_out + done;
+		long n;
+
+		if (to % blockSize == 0 && len - done >= blockSize) {
+			/* Whole blocks: the backend may let the host kernel copy them */
+			n = copy_blocks(-1, 0, host_fd, host_off + done, fd_out, to,
+					(len - done) / blockSize);
+		} else {
+			size_t chunk = blockSize - to % blockSize;
+			if (chunk > len - done) {
+				chunk = len - done;
+			}
+			if (bounce == NULL && (bounce = pool_get(&pool)) == NULL) {
+				break;
+			}
+			n = pread(host_fd, bounce, chunk, host_off + done);
+			if (n > 0) {
+				n = rw_at(fd_out, bounce, n, to, true);
+			}
+		}
+		if (n <= 0) {
+			break;
+		}
+		done += n;
+	}
+
+	pool_put(&pool, bounce);
+	return done == 0 && len > 0 ? -1 : (int)done;
+}
+
+int fs_clone(const char *src, const char *dst)
+{
+	FS_LOCKED();
+
+	if (fat == NULL || src == NULL || fs_ready() == -1) {
+		return -1;
+	}
+	int from = find_entry(src);
+	if (from == -1 || fs_create(dst) == -1) {
+		return -1;
+	}
+
+	/* Same blocks, tail included; whichever file is written first copies them */
+	struct rootEntry *clone = &root.rootEntry[find_entry(dst)];
+	*clone = root.rootEntry[from];
+	strcpy(clone->fileName, dst);
+	entry_get(clone);
+
+	return 0;
+}
+
+/* Snapshot slot named @name, or -1 if there is none */
+static int find_snapshot(const char *name)
+{
+	for (int s = 0; s < FS_SNAPSHOT_MAX; s++) {
+		if (super.snapshots[s].rootBlock != 0 &&
+		    strncmp(super.snapshots[s].name, name, FS_FILENAME_LEN) == 0) {
+			return s;
+		}
+	}
+	return -1;
+}
+
+int fs_snapshot(const char *name)
+{
+	FS_LOCKED();
+
+	if (fat == NULL || name == NULL || name[0] == '\0' ||
+	    strlen(name) >= FS_FILENAME_LEN || find_snapshot(name) != -1 || fs_ready() == -1) {
+		return -1;
+	}
+	int s = 0;
+	while (s < FS_SNAPSHOT_MAX && super.snapshots[s].rootBlock != 0) {
+		s++;
+	}
+	if (s == FS_SNAPSHOT_MAX) {
+		return -1;
+	}
+
+	/* The root directory is saved as it is, in a chain of its own */
+	uint16_t head = FAT_EOC, last = FAT_EOC;
+	for (size_t n = (sizeof(root) + blockSize - 1) / blockSize; n > 0; n--) {
+		uint16_t block = alloc_block();
+		if (block == FAT_EOC) {
+			chain_put(head);
+			return -1;
+		}
+		if (last == FAT_EOC) {
+			head = block;
+		} else {
+			fat_link(last, block);
+		}
+		last = block;
+	}
+	if (chain_rw(head, &root, sizeof(root), true) == -1) {
+		chain_put(head);
+		return -1;
+	}
+
+	/* Its files now hold references to the blocks of the live ones */
+	snapRoots[s] = root;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (root.rootEntry[i].fileName[0] != '\0') {
+			entry_get(&root.rootEntry[i]);
+		}
+	}
+	memset(&super.snapshots[s], 0, sizeof(super.snapshots[s]));
+	strcpy(super.snapshots[s].name, name);
+	super.snapshots[s].rootBlock = head;
+
+	return 0;
+}
+
+int fs_snapshot_restore(const char *name)
+{
+	FS_LOCKED();
+
+	if (fat == NULL || name == NULL || open_files.numFilesOpen != 0 || fs_ready() == -1) {
+		return -1;
+	}
+	int s = find_snapshot(name);
+	if (s == -1) {
+		return -1;
+	}
+
+	/* What the snapshot uses survives dropping the live files */
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (root.rootEntry[i].fileName[0] != '\0') {
+			entry_put(&root.rootEntry[i]);
+		}
+	}
+	root = snapRoots[s];
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (root.rootEntry[i].fileName[0] != '\0') {
+			entry_get(&root.rootEntry[i]);
+		}
+	}
+
+	return 0;
+}
+
+int fs_snapshot_delete(const char *name)
+{
+	FS_LOCKED();
+
+	if (fat == NULL || name == NULL || fs_ready() == -1) {
+		return -1;
+	}
+	int s = find_snapshot(name);
+	if (s == -1) {
+		return -1;
+	}
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (snapRoots[s].rootEntry[i].fileName[0] != '\0') {
+			entry_put(&snapRoots[s].rootEntry[i]);
+		}
+	}
+	chain_put(super.snapshots[s].rootBlock);
+	memset(&super.snapshots[s], 0, sizeof(super.snapshots[s]));
+
+	return 0;
+}
+
+int fs_snapshot_list(char (*names)[FS_FILENAME_LEN], int count)
+{
+	FS_LOCKED();
+
+	if (fat == NULL) {
+		return -1;
+	}
+
+	int n = 0;
+	for (int s = 0; s < FS_SNAPSHOT_MAX; s++) {
+		if (super.snapshots[s].rootBlock == 0) {
+			continue;
 		}
+		if (n < count) {
+			memcpy(names[n], super.snapshots[s].name, FS_FILENAME_LEN);
+			names[n][FS_FILENAME_LEN - 1] = '\0';
+		}
+		n++;
+	}
+
+	return n;
+}
+
+/* Whether data blocks @a and @b hold the same bytes, @a being already in @buf */
+static bool same_block(const void *buf, uint16_t b, void *scratch)
+{
+	return block_read(super.dataIndex + b, scratch) == 0 &&
+	       memcmp(buf, scratch, blockSize) == 0;
+}
+
+/*
+ * Deduplication: a block of a file can be replaced by an identical block
+ * of another chain, provided that block links to the same next block. Chains
+ * can thus only merge from their ends, so a file is walked from its last
+ * block backwards, for as long as a stand-in is found. Return the number of
+ * blocks freed, or -1.
+ */
+static int dedup_file(struct rootEntry *file)
+{
+	size_t n = 0;
+	for (uint16_t b = file->dataBlockIndex; b != FAT_EOC; b = fat[b]) {
+		n++;
+	}
+	if (n == 0) {
+		return 0;
+	}
+
+	uint16_t *blocks = malloc(n * sizeof(uint16_t));
+	void *mine = pool_get(&pool);
+	void *theirs = pool_get(&pool);
+	if (blocks == NULL || mine == NULL || theirs == NULL) {
+		free(blocks);
+		pool_put(&pool, mine);
+		pool_put(&pool, theirs);
+		return -1;
+	}
+	n = 0;
+	for (uint16_t b = file->dataBlockIndex; b != FAT_EOC; b = fat[b]) {
+		blocks[n++] = b;
+	}
 
-		if (block_offset >= BLOCK_SIZE) {
-			block_offset = 0;
-			if (increase) {
-				int fatIndex = findOpenFAT();
-				if (fatIndex == -1) {
-					return byte_count;
+	int freed = 0;
+	for (size_t k = n; k-- > 0; ) {
+		uint16_t b = blocks[k];
+		uint16_t next = fat[b];
+		uint64_t hash = dedupIdx.hash[b];
+		uint16_t c = DEDUP_NONE;
+
+		if (hash != 0 && block_read(super.dataIndex + b, mine) == 0) {
+			for (c = dedup_first(&dedupIdx, hash); c != DEDUP_NONE;
+			     c = dedup_next(&dedupIdx, c)) {
+				if (c != b && fat[c] == next && same_block(mine, c, theirs)) {
+					break;
 				}
-				fat[dataIndex] = fatIndex;
-				dataIndex = fatIndex;
-			} else {
-				dataIndex = dataBlockIndex(offset, startIndex);
 			}
-			uint8_t actualIndex = dataIndex + super.dataIndex;
-            block_read((size_t )actualIndex, bounce);
 		}
-		
-		memcpy(bounce + block_offset, buf + i, 1);
-		uint8_t actualIndex = startIndex + super.dataIndex;
-		block_write((size_t )actualIndex, bounce);
-		
-		if (increase) {
-			root_block.fileSize++;
-			root.rootEntry[saveRoot] = root_block;
+
+		if (c == DEDUP_NONE) {
+			/* Already shared: the blocks before can still merge */
+			if (refCount[b] > 1) {
+				continue;
+			}
+			break;
+		}
+
+		/* Link to the stand-in instead, then drop this block's reference */
+		if (k == 0) {
+			file->dataBlockIndex = c;
+		} else {
+			fat_link(blocks[k - 1], c);
+		}
+		refCount[c]++;
+		if (chain_put(b) > 0) {
+			freed++;
 		}
-		block_offset++;
-		offset++;
-		byte_count++;
+		blocks[k] = c;
 	}
-	return byte_count;
 
+	free(blocks);
+	pool_put(&pool, mine);
+	pool_put(&pool, theirs);
+	return freed;
 }
 
-int fs_read(int fd, void *buf, size_t count)
+/* Index every chain block of every file, snapshots' included, by content */
+static int dedup_scan(void)
 {
-	/* TODO: Phase 4 */
-		/* TODO: Phase 4 */
-	char* name = open_files.fileEntry[fd].fileName;
-	if (fd < 0 || fd > 31 || open_files.numFilesOpen == 0 || name[0] == '\0') { // Out of bounds and File Existence Check
+	char *stage = malloc(COPY_MAX_BLOCKS * blockSize);
+	if (stage == NULL) {
+		return -1;
+	}
+
+	int ret = 0;
+	for (int s = -1; s < FS_SNAPSHOT_MAX && ret == 0; s++) {
+		struct rootDirectory *dir = root_dir(s);
+		for (int i = 0; dir != NULL && i < FS_FILE_MAX_COUNT && ret == 0; i++) {
+			if (dir->rootEntry[i].fileName[0] == '\0') {
+				continue;
+			}
+			/* Shared blocks are only read once */
+			uint16_t b = dir->rootEntry[i].dataBlockIndex;
+			while (b != FAT_EOC && dedupIdx.hash[b] == 0) {
+				size_t len = run_length(b, COPY_MAX_BLOCKS);
+				if (block_read_many(super.dataIndex + b, len, stage) == -1) {
+					ret = -1;
+					break;
+				}
+				for (size_t j = 0; j < len; j++) {
+					dedup_note(b + j, stage + j * blockSize);
+				}
+				b = fat[b + len - 1];
+			}
+		}
+	}
+
+	free(stage);
+	return ret;
+}
+
+int fs_dedup(void)
+{
+	FS_LOCKED();
+
+	if (fat == NULL || fs_ready() == -1) {
+		return -1;
+	}
+
+	/* Without FS_MOUNT_DEDUP, the index only lives for this pass */
+	bool online = dedupIdx.hash != NULL;
+	if (!online && dedup_init(&dedupIdx, super.numDataBlocks) == -1) {
+		return -1;
+	}
+
+	int freed = dedup_scan();
+	for (int i = 0; i < FS_FILE_MAX_COUNT && freed != -1; i++) {
+		if (root.rootEntry[i].fileName[0] != '\0') {
+			int n = dedup_file(&root.rootEntry[i]);
+			freed = n == -1 ? -1 : freed + n;
+		}
+	}
+
+	if (!online) {
+		dedup_destroy(&dedupIdx);
+	}
+	return freed;
+}
+
+int fs_compress(const char *filename, int enable)
+{
+	FS_LOCKED();
+
+	if (fat == NULL || filename == NULL || fs_ready() == -1) {
+		return -1;
+	}
+	int entry = find_entry(filename);
+	if (entry == -1) {
 		return -1;
-	} else if (count <= 0 || buf == NULL || fs_stat(fd) == 0) {
+	}
+	struct rootEntry *file = &root.rootEntry[entry];
+
+	if (!enable) {
+		file->fileFlags &= ~ENTRY_COMPRESS;
+		return z_unpack(file);
+	}
+
+	/* Files that are not open are compressed right away */
+	file->fileFlags |= ENTRY_COMPRESS;
+	bool open = false;
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if (strcmp(open_files.fileEntry[i].fileName, file->fileName) == 0) {
+			open = true;
+		}
+	}
+	if (!open && (mountFlags & FS_MOUNT_COMPRESS)) {
+		z_pack(file);
+	}
+
+	return 0;
+}
+
+/*
+ * Checking: fs_fsck() loads the metadata the way fs_mount() does, but fixes
+ * what it finds in memory instead of giving up, so that one problem does not
+ * hide or multiply the next ones. The fixes only reach the disk on request.
+ */
+
+/* Where the chains fs_fsck() walks start from */
+struct fsckChain {
+	struct rootEntry *file;		// File starting it, NULL for a snapshot's storage
+	int snap;					// Snapshot the file or storage is in, -1 for the live root
+};
+
+/* Drop the packed tail of @file, and the bytes in it */
+static void fsck_drop_tail(struct rootEntry *file)
+{
+	if (!(file->fileFlags & ENTRY_COMPRESSED)) {
+		file->fileSize -= tail_len(file);
+	}
+	file->tailBlock = 0;
+	file->tailOffset = 0;
+}
+
+/* Forget snapshot @s, whose blocks are then leaked unless shared */
+static void fsck_drop_snapshot(int s)
+{
+	memset(&super.snapshots[s], 0, sizeof(super.snapshots[s]));
+	memset(&snapRoots[s], 0, sizeof(snapRoots[s]));
+}
+
+/* Every chain in use: the files, live or in a snapshot, and the snapshots' storage */
+static size_t fsck_chains(struct fatChain *chains, struct fsckChain *from)
+{
+	size_t count = 0;
+	for (int s = -1; s < FS_SNAPSHOT_MAX; s++) {
+		struct rootDirectory *dir = root_dir(s);
+		if (dir == NULL) {
+			continue;
+		}
+		if (s != -1) {
+			chains[count].head = super.snapshots[s].rootBlock;
+			from[count++] = (struct fsckChain){ NULL, s };
+		}
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+			if (dir->rootEntry[i].fileName[0] != '\0') {
+				chains[count].head = dir->rootEntry[i].dataBlockIndex;
+				from[count++] = (struct fsckChain){ &dir->rootEntry[i], s };
+			}
+		}
+	}
+	return count;
+}
+
+/* Cut the chains that do not end properly, return whether there were any */
+static bool fsck_fix_chains(struct fatChain *chains, struct fsckChain *from,
+                            size_t count, struct fs_fsck_report *report)
+{
+	size_t rootChain = (sizeof(struct rootDirectory) + blockSize - 1) / blockSize;
+	bool fixed = false;
+
+	for (size_t c = 0; c < count; c++) {
+		struct fatChain *ch = &chains[c];
+		if (from[c].snap != -1 && super.snapshots[from[c].snap].rootBlock == 0) {
+			continue;					// Dropped while fixing an earlier chain
+		}
+		if (ch->end != FAT_CHAIN_EOC && ch->fixAt != FAT_EOC) {
+			/* Chains sharing the bad end share the fix, count it once */
+			if (fat[ch->fixAt] != FAT_EOC) {
+				fat[ch->fixAt] = FAT_EOC;
+				if (ch->end == FAT_CHAIN_CYCLE) {
+					report->cycles++;
+				} else {
+					report->broken_chains++;
+				}
+			}
+			fixed = true;
+		} else if (ch->end != FAT_CHAIN_EOC) {
+			/* The start itself is a free block */
+			report->broken_chains++;
+			if (from[c].file != NULL) {
+				from[c].file->dataBlockIndex = FAT_EOC;
+			} else {
+				fsck_drop_snapshot(from[c].snap);
+				report->bad_snapshots++;
+			}
+			fixed = true;
+		} else if (from[c].file == NULL && ch->length < rootChain) {
+			fsck_drop_snapshot(from[c].snap);
+			report->bad_snapshots++;
+			fixed = true;
+		}
+	}
+	return fixed;
+}
+
+/*
+ * Blocks the chain of @file, @length blocks long, must have at least for its
+ * size. A compressed stream needs its map, and as many blocks as the map says
+ * it spans; SIZE_MAX if the map makes no sense.
+ */
+static int fsck_need(struct rootEntry *file, size_t length, size_t *need)
+{
+	if (!(file->fileFlags & ENTRY_COMPRESSED)) {
+		*need = file->tailBlock != 0 ? file->fileSize / blockSize : file_blocks(file);
 		return 0;
 	}
 
-	uint8_t offset = open_files.fileEntry[fd].offset;
-	/* Find File in Root Directory */
-	bool fileFound = false;
-	uint8_t startIndex;
-	struct rootEntry root_block;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (strcmp(root.rootEntry[i].fileName, name) == 0) {
-			fileFound = true;
-			root_block = root.rootEntry[i];
-			startIndex = root_block.dataBlockIndex;
-			break;
+	size_t n = file_blocks(file), mapBlocks = z_map_blocks(file);
+	*need = mapBlocks;
+	if (n == 0 || length < mapBlocks) {
+		return 0;
+	}
+	uint32_t *map = malloc(mapBlocks * blockSize);
+	if (map == NULL || chain_rw(file->dataBlockIndex, map, mapBlocks * blockSize, false) == -1) {
+		free(map);
+		return -1;
+	}
+	*need += (map[n - 1] + blockSize - 1) / blockSize;
+	for (size_t i = 0, end = 0; i < n; end = map[i++]) {
+		if (map[i] < end || map[i] - end > file_block_len(file, i)) {
+			*need = SIZE_MAX;
+		}
+	}
+	free(map);
+	return 0;
+}
+
+/* Tail extent of a file, as fs_fsck() compares them */
+struct fsckTail {
+	struct tailExtent ext;		// First, to sort with cmp_extent()
+	struct rootEntry *file;
+};
+
+/* Drop the tails overlapping another one, other than the same bytes shared by clones */
+static void fsck_fix_tails(struct fs_fsck_report *report)
+{
+	struct fsckTail tails[FS_FILE_MAX_COUNT * (FS_SNAPSHOT_MAX + 1)];
+	int n = 0;
+
+	for (int s = -1; s < FS_SNAPSHOT_MAX; s++) {
+		struct rootDirectory *dir = root_dir(s);
+		for (int i = 0; dir != NULL && i < FS_FILE_MAX_COUNT; i++) {
+			struct rootEntry *e = &dir->rootEntry[i];
+			if (e->fileName[0] != '\0' && e->tailBlock != 0) {
+				tails[n].ext.block = e->tailBlock;
+				tails[n].ext.start = e->tailOffset;
+				tails[n].ext.end = e->tailOffset + tail_len(e);
+				tails[n++].file = e;
+			}
+		}
+	}
+	qsort(tails, n, sizeof(tails[0]), cmp_extent);
+
+	struct tailExtent *kept = NULL;
+	for (int t = 0; t < n; t++) {
+		struct tailExtent *x = &tails[t].ext;
+		if (kept != NULL && kept->block == x->block && x->start < kept->end &&
+		    (x->start != kept->start || x->end != kept->end)) {
+			fsck_drop_tail(tails[t].file);
+			report->bad_tails++;
+			continue;
 		}
+		kept = x;
+	}
+}
+
+int fs_fsck(const char *diskname, int flags, int nthreads, struct fs_fsck_report *report)
+{
+	FS_LOCKED();
+
+	if (fat != NULL || report == NULL || (flags & ~FS_FSCK_REPAIR)) {
+		return -1;
+	}
+	memset(report, 0, sizeof(*report));
+	if (nthreads < 1) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = cpus > 0 ? cpus : 1;
 	}
-	/* File Not Found */
-	if (!fileFound) {
+	if (super_load(diskname) == -1) {
 		return -1;
 	}
-	int bytes = 0;
-	int dataIndex = dataBlockIndex(offset, startIndex);
-	int actualIndex = startIndex + super.dataIndex;
-	void *bounce = (void*)malloc(BLOCK_SIZE);
-	block_read((size_t)actualIndex, bounce);
-	size_t block_offset = offset % BLOCK_SIZE;
 
-	for (long unsigned int i = 0; i < count; i++) {
-		open_files.fileEntry[fd].offset = offset;
+	size_t n = super.numDataBlocks;
+	size_t maxChains = FS_FILE_MAX_COUNT * (FS_SNAPSHOT_MAX + 1) + FS_SNAPSHOT_MAX;
+	struct fatChain *chains = malloc(maxChains * sizeof(struct fatChain));
+	struct fsckChain *from = malloc(maxChains * sizeof(struct fsckChain));
+	uint64_t *claimed = malloc((n + 63) / 64 * sizeof(uint64_t));
+	int ret = -1;
+
+	if (pool_init(&pool, POOL_SLABS, blockSize) == -1) {
+		goto out_close;
+	}
+	fat = malloc(super.numFATBlocks * blockSize);
+	snapRoots = calloc(FS_SNAPSHOT_MAX, sizeof(struct rootDirectory));
+	if (chains == NULL || from == NULL || claimed == NULL || fat == NULL ||
+	    snapRoots == NULL || block_read_many(1, super.numFATBlocks, fat) == -1 ||
+	    root_read() == -1) {
+		goto out;
+	}
+
+	/* FAT entries pointing past the data blocks end their chain instead */
+	if (fat[0] != FAT_EOC) {
+		fat[0] = FAT_EOC;
+		report->bad_fat_entries++;
+	}
+	for (size_t b = 1; b < n; b++) {
+		if (fat[b] != 0 && fat[b] != FAT_EOC && fat[b] >= n) {
+			fat[b] = FAT_EOC;
+			report->bad_fat_entries++;
+		}
+	}
+
+	/* Snapshots whose root directory cannot be read are dropped */
+	for (int s = 0; s < FS_SNAPSHOT_MAX; s++) {
+		uint16_t b = super.snapshots[s].rootBlock;
+		if (b != 0 && (b >= n || chain_rw(b, &snapRoots[s], sizeof(struct rootDirectory), false) == -1)) {
+			fsck_drop_snapshot(s);
+			report->bad_snapshots++;
+		}
+	}
+
+	/* Entries starting past the data blocks, or with a tail that cannot be theirs */
+	for (int s = -1; s < FS_SNAPSHOT_MAX; s++) {
+		struct rootDirectory *dir = root_dir(s);
+		for (int i = 0; dir != NULL && i < FS_FILE_MAX_COUNT; i++) {
+			struct rootEntry *e = &dir->rootEntry[i];
+			if (e->fileName[0] == '\0') {
+				continue;
+			}
+			report->files++;
+			if (e->dataBlockIndex != FAT_EOC && (e->dataBlockIndex == 0 || e->dataBlockIndex >= n)) {
+				e->dataBlockIndex = FAT_EOC;
+				report->bad_entries++;
+			}
+			if (!entry_valid(e)) {
+				fsck_drop_tail(e);
+				report->bad_tails++;
+			}
+		}
+	}
+
+	/* Walk every chain, cutting the broken and looping ones until all end properly */
+	size_t count;
+	do {
+		count = fsck_chains(chains, from);
+		if (fat_walk(fat, n, FAT_EOC, chains, count, nthreads, claimed) == -1) {
+			goto out;
+		}
+	} while (fsck_fix_chains(chains, from, count, report));
+
+	/* Chains may be longer than the size, for reserved blocks, but not shorter */
+	for (size_t c = 0; c < count; c++) {
+		struct rootEntry *e = from[c].file;
+		size_t need;
+		if (e == NULL) {
+			continue;
+		}
+		if (fsck_need(e, chains[c].length, &need) == -1) {
+			goto out;
+		}
+		if (chains[c].length >= need) {
+			continue;
+		}
+		report->bad_sizes++;
+		if (e->fileFlags & ENTRY_COMPRESSED) {
+			/* A truncated stream cannot be decoded */
+			e->dataBlockIndex = FAT_EOC;
+			e->fileSize = 0;
+			e->fileFlags &= ~ENTRY_COMPRESSED;
+		} else {
+			fsck_drop_tail(e);
+			e->fileSize = chains[c].length * blockSize;
+		}
+	}
 
-		if (offset >= fs_stat(fd)) {
-			return bytes;
+	/* Tails go in blocks no chain uses, without overlapping */
+	for (int s = -1; s < FS_SNAPSHOT_MAX; s++) {
+		struct rootDirectory *dir = root_dir(s);
+		for (int i = 0; dir != NULL && i < FS_FILE_MAX_COUNT; i++) {
+			struct rootEntry *e = &dir->rootEntry[i];
+			if (e->fileName[0] != '\0' && e->tailBlock != 0 &&
+			    (claimed[e->tailBlock / 64] >> (e->tailBlock % 64) & 1)) {
+				fsck_drop_tail(e);
+				report->bad_tails++;
+			}
 		}
+	}
+	fsck_fix_tails(report);
 
-		if (block_offset >= BLOCK_SIZE) {
-			block_offset = 0;
-			dataIndex = dataBlockIndex(offset, startIndex);
-			if (dataIndex == -1) {
-				return bytes;
+	/* Whatever was fixed above may have let go of blocks: walk once more for the leaks */
+	count = fsck_chains(chains, from);
+	if (fat_walk(fat, n, FAT_EOC, chains, count, nthreads, claimed) == -1) {
+		goto out;
+	}
+	for (int s = -1; s < FS_SNAPSHOT_MAX; s++) {
+		struct rootDirectory *dir = root_dir(s);
+		for (int i = 0; dir != NULL && i < FS_FILE_MAX_COUNT; i++) {
+			uint16_t b = dir->rootEntry[i].tailBlock;
+			if (dir->rootEntry[i].fileName[0] != '\0' && b != 0) {
+				claimed[b / 64] |= 1ULL << (b % 64);
 			}
-			actualIndex = dataIndex + super.dataIndex;
-            block_read((size_t)actualIndex, bounce);
 		}
-		memcpy(buf + i, bounce + block_offset, 1);
+	}
+	for (size_t b = 1; b < n; b++) {
+		if (fat[b] != 0 && !(claimed[b / 64] >> (b % 64) & 1)) {
+			fat[b] = 0;
+			report->leaked_blocks++;
+		}
+	}
+
+	/* The image is now consistent, so the references can be counted */
+	if (ref_init() == -1) {
+		goto out;
+	}
+	for (size_t b = 1; b < n; b++) {
+		report->used_blocks += fat[b] != 0;
+		report->shared_blocks += refCount[b] > 1;
+	}
 
-		block_offset++;
-		offset++;
-		bytes++;
+	/* A clean summary may lag behind on the hint, never on the count */
+	size_t freeBlocks = n - 1 - report->used_blocks;
+	size_t firstFree = fat_kernels()->find_free(fat, 1, n);
+	if (super.cleanUnmount == SUPER_CLEAN &&
+	    (super.freeBlocks != freeBlocks || super.nextFree == 0 || super.nextFree > firstFree)) {
+		report->bad_summary++;
 	}
 
-	return bytes;
-}
\ No newline at end of file
+	size_t problems = report->bad_fat_entries + report->bad_snapshots + report->bad_entries +
+	                  report->broken_chains + report->cycles + report->bad_sizes +
+	                  report->bad_tails + report->leaked_blocks + report->bad_summary;
+	ret = problems;
+
+	if ((flags & FS_FSCK_REPAIR) && problems > 0) {
+		/* Snapshots keep their own copy of the entries, rewrite the ones fixed */
+		struct rootDirectory *saved = malloc(sizeof(struct rootDirectory));
+		for (int s = 0; s < FS_SNAPSHOT_MAX && ret != -1; s++) {
+			uint16_t b = super.snapshots[s].rootBlock;
+			if (b == 0) {
+				continue;
+			}
+			if (saved == NULL || chain_rw(b, saved, sizeof(*saved), false) == -1 ||
+			    (memcmp(saved, &snapRoots[s], sizeof(*saved)) != 0 &&
+			     chain_rw(b, &snapRoots[s], sizeof(*saved), true) == -1)) {
+				ret = -1;
+			}
+		}
+		free(saved);
+
+		/* As at unmount, the superblock and its summary go after the FAT */
+		super.cleanUnmount = SUPER_CLEAN;
+		super.freeBlocks = freeBlocks;
+		super.nextFree = firstFree;
+		if (ret == -1 || root_write() == -1 ||
+		    block_write_many(1, super.numFATBlocks, fat) == -1 ||
+		    block_disk_flush() == -1 || super_write() == -1 ||
+		    block_disk_flush() == -1) {
+			ret = -1;
+		} else {
+			report->repaired = 1;
+		}
+	}
+
+out:
+	free(refCount);
+	refCount = NULL;
+	free(snapRoots);
+	snapRoots = NULL;
+	free(fat);
+	fat = NULL;
+	pool_destroy(&pool);
+out_close:
+	block_disk_close();
+	free(chains);
+	free(from);
+	free(claimed);
+	return ret;
+}
+
+/*
+ * Defragmentation: fs_defrag() moves whole chains into as few runs as the free
+ * blocks allow, copying them before letting go of the old blocks.
+ */
+
+/* Run of free data blocks */
+struct freeRun {
+	uint16_t start;
+	uint16_t len;
+};
+
+static int cmp_run_len(const void *a, const void *b)
+{
+	const struct freeRun *x = a, *y = b;
+	return (int)y->len - (int)x->len;
+}
+
+static int cmp_run_start(const void *a, const void *b)
+{
+	const struct freeRun *x = a, *y = b;
+	return (int)x->start - (int)y->start;
+}
+
+/*
+ * Where to move a chain of @len blocks: the first free run that holds it all,
+ * or else the fewest, longest, free runs. Return the number of runs filled in
+ * @runs, in block order, 0 if the free blocks are too few.
+ */
+static size_t defrag_plan(size_t len, struct freeRun *runs)
+{
+	const struct fatKernels *k = fat_kernels();
+	size_t n = super.numDataBlocks;
+
+	size_t first = fat_find_free_run(k, fat, nextFree, n, len);
+	if (first < n) {
+		runs[0] = (struct freeRun){ first, len };
+		return 1;
+	}
+
+	size_t count = 0;
+	for (size_t start = k->find_free(fat, nextFree, n); start < n; ) {
+		size_t end = k->find_used(fat, start, n);
+		runs[count++] = (struct freeRun){ start, end - start };
+		start = k->find_free(fat, end, n);
+	}
+	qsort(runs, count, sizeof(runs[0]), cmp_run_len);
+
+	size_t used = 0, have = 0;
+	while (used < count && have < len) {
+		have += runs[used++].len;
+	}
+	if (have < len) {
+		return 0;
+	}
+	runs[used - 1].len -= have - len;
+	qsort(runs, used, sizeof(runs[0]), cmp_run_start);
+	return used;
+}
+
+/* Move the @len blocks of @file into @runs, return -1 if it cannot be copied */
+static int defrag_move(struct rootEntry *file, size_t len, struct freeRun *runs, size_t numRuns)
+{
+	char *stage = malloc(COPY_MAX_BLOCKS * blockSize);
+	if (stage == NULL) {
+		return -1;
+	}
+
+	/* Take the blocks first, then copy along both chains a contiguous piece at a time */
+	size_t r, within = 0, done = 0;
+	for (r = 0; r < numRuns; r++) {
+		for (size_t i = 0; i < runs[r].len; i++) {
+			fat_take(runs[r].start + i);
+		}
+	}
+	uint16_t src = file->dataBlockIndex;
+	r = 0;
+	int ret = 0;
+	while (done < len && ret == 0) {
+		size_t max = runs[r].len - within < COPY_MAX_BLOCKS ? runs[r].len - within : COPY_MAX_BLOCKS;
+		size_t n = run_length(src, max);
+		uint16_t dst = runs[r].start + within;
+		ret = block_read_many(super.dataIndex + src, n, stage);
+		if (ret == 0) {
+			ret = block_write_many(super.dataIndex + dst, n, stage);
+		}
+		for (size_t i = 0; ret == 0 && i < n; i++) {
+			dedup_note(dst + i, stage + i * blockSize);
+		}
+		src = fat[src + n - 1];
+		done += n;
+		within += n;
+		if (within == runs[r].len) {
+			r++;
+			within = 0;
+		}
+	}
+	free(stage);
+
+	if (ret == -1) {
+		for (r = 0; r < numRuns; r++) {
+			for (size_t i = 0; i < runs[r].len; i++) {
+				fat_give(runs[r].start + i);
+				dedup_note(runs[r].start + i, NULL);
+			}
+		}
+		return -1;
+	}
+
+	/* Link the copy, then let go of the old chain, which nothing else uses */
+	uint16_t old = file->dataBlockIndex, last = FAT_EOC;
+	for (r = 0; r < numRuns; r++) {
+		for (size_t i = 0; i < runs[r].len; i++) {
+			uint16_t b = runs[r].start + i;
+			if (last == FAT_EOC) {
+				file->dataBlockIndex = b;
+			} else {
+				fat_link(last, b);
+			}
+			refCount[b] = 1;
+			last = b;
+		}
+	}
+	while (old != FAT_EOC) {
+		uint16_t next = fat[old];
+		release_block(old);
+		old = next;
+	}
+	if (file->fileFlags & ENTRY_COMPRESSED) {
+		z_forget();
+	}
+	return 0;
+}
+
+/* File fs_defrag() may move */
+struct fragFile {
+	int entry;
+	size_t runs;
+	size_t len;
+};
+
+/* Files by decreasing share of their blocks that start a run */
+static int cmp_frag(const void *a, const void *b)
+{
+	const struct fragFile *x = a, *y = b;
+	uint64_t l = (uint64_t)x->runs * y->len, r = (uint64_t)y->runs * x->len;
+	return (l < r) - (l > r);
+}
+
+int fs_defrag(size_t budget)
+{
+	FS_LOCKED();
+
+	if (fat == NULL || fs_ready() == -1) {
+		return -1;
+	}
+
+	/* Rank the files, worst first; shared chains stay where the others use them */
+	struct fragFile order[FS_FILE_MAX_COUNT];
+	int count = 0;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		struct rootEntry *e = &root.rootEntry[i];
+		if (e->fileName[0] == '\0' || first_shared(e, SIZE_MAX) != SIZE_MAX) {
+			continue;
+		}
+		order[count].entry = i;
+		order[count].runs = chain_runs(e->dataBlockIndex, &order[count].len);
+		count += order[count].runs > 1;
+	}
+	qsort(order, count, sizeof(order[0]), cmp_frag);
+
+	struct freeRun *plan = malloc(super.numDataBlocks / 2 * sizeof(struct freeRun) + sizeof(struct freeRun));
+	if (plan == NULL) {
+		return -1;
+	}
+	size_t moved = 0;
+	for (int o = 0; o < count; o++) {
+		struct rootEntry *file = &root.rootEntry[order[o].entry];
+		size_t len = order[o].len;
+		if (len > budget - moved) {
+			continue;
+		}
+		size_t numRuns = defrag_plan(len, plan);
+		if (numRuns == 0 || numRuns >= order[o].runs) {
+			continue;
+		}
+		if (defrag_move(file, len, plan, numRuns) == -1) {
+			free(plan);
+			return -1;
+		}
+		moved += len;
+	}
+	free(plan);
+
+	return moved;
+}
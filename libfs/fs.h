@@ -2,6 +2,8 @@
 #define _FS_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+#include <sys/types.h> /* for off_t definition */
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
@@ -20,22 +22,118 @@
  * contains. A file system needs to be mounted before files can be read from it
  * with fs_read() or written to it with fs_write().
  *
+ * @diskname is handed to block_disk_open() and can therefore select another
+ * block device backend, e.g. "stripe:16:a.fs+b.fs" to mount a file system
+ * striped across several images.
+ *
+ * The FAT is mapped rather than read when the backend can (see block_map()),
+ * so that mounting reads none of it: only the FAT blocks the chains of the
+ * files used run through are read, and only those modified are written back,
+ * by fs_sync().
+ * Likewise, checking the whole FAT and counting the references to each block
+ * are left to the first call that modifies the file system, which fails if
+ * the FAT turns out to be damaged. fs_open() only checks the chain of the
+ * file it opens, and fs_info() checks none.
+ *
+ * The number of free data blocks and where the first of them lies are taken
+ * from the superblock when the file system was cleanly unmounted (see
+ * fs_umount()), and counted from the FAT otherwise.
+ *
  * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
  * file system can be located. 0 otherwise.
  */
 int fs_mount(const char *diskname);
 
+/** Discard the data blocks of deleted files (see fs_mount_flags()) */
+#define FS_MOUNT_DISCARD 0x1
+
+/** Pack the small tails of files into shared blocks (see fs_mount_flags()) */
+#define FS_MOUNT_TAILPACK 0x2
+
+/** Share the data blocks identical to blocks of other files (see fs_mount_flags()) */
+#define FS_MOUNT_DEDUP 0x4
+
+/** Compress the files flagged with fs_compress() (see fs_mount_flags()) */
+#define FS_MOUNT_COMPRESS 0x8
+
+/**
+ * fs_mount_flags - Mount a file system with options
+ * @diskname: Name of the virtual disk file
+ * @flags: Bitwise OR of FS_MOUNT_* options
+ *
+ * Same as fs_mount(), which is fs_mount_flags() with @flags 0. With
+ * %FS_MOUNT_DISCARD, the blocks freed are handed to block_discard() by the
+ * next fs_sync(), so that a sparse host image gives their storage back.
+ *
+ * With %FS_MOUNT_TAILPACK, closing the last file descriptor on a file whose
+ * final partial block holds at most half a block moves those bytes into a
+ * tail block shared with other files, freeing the block. Many small files
+ * then fit, and are read, in a single block. A packed file gets its tail back
+ * into a block of its own as soon as it is written to. Packed files can be
+ * read whatever the flags of later mounts.
+ *
+ * With %FS_MOUNT_DEDUP, fs_write() hashes every block it writes into an
+ * in-memory index, and closing the last file descriptor on a file replaces
+ * its blocks with identical blocks of other files where it can, the way
+ * fs_dedup() does. Only the blocks written during the mount are considered.
+ *
+ * With %FS_MOUNT_COMPRESS, closing the last file descriptor on a file flagged
+ * with fs_compress() compresses it, if that takes fewer blocks.
+ *
+ * Return: -1 if @flags is invalid, or in the cases fs_mount() fails. 0
+ * otherwise.
+ */
+int fs_mount_flags(const char *diskname, int flags);
+
 /**
  * fs_umount - Unmount file system
  *
  * Unmount the currently mounted file system and close the underlying virtual
- * disk file.
+ * disk file. A running flusher is stopped first (see fs_flusher_stop()).
+ *
+ * Everything is made durable the way fs_sync() does, then the superblock is
+ * written and flushed last, marked clean and with the number of free data
+ * blocks, so that the next mount need not count them. The mark is
+ * cleared on disk before the first block is allocated or freed after a
+ * mount, so that a file system never unmounted keeps none.
  *
  * Return: -1 if no FS is currently mounted, or if the virtual disk cannot be
  * closed, or if there are still open file descriptors. 0 otherwise.
  */
 int fs_umount(void);
 
+/**
+ * fs_sync - Make the file system durable
+ *
+ * File data goes to the virtual disk as fs_write() is called, or to the block
+ * cache while the flusher runs (see fs_flusher_start()), while the FAT, root
+ * directory and superblock stay in memory until this call or fs_umount()
+ * writes them, the FAT included when it is mapped (see fs_mount()).
+ * Flush the data written so far to stable storage, then write the metadata
+ * changed since the last call and flush again. A crash at any point leaves
+ * either the previous metadata or the new one, and never metadata pointing
+ * to data that did not make it.
+ *
+ * Calls that find nothing written since the last one return at once, so
+ * that threads syncing one after the other share a single flush.
+ *
+ * Return: -1 if no FS is currently mounted, or if writing or flushing fails.
+ * 0 otherwise.
+ */
+int fs_sync(void);
+
+/**
+ * fs_fsync - Make an open file durable
+ * @fd: File descriptor
+ *
+ * Same as fs_sync(): the metadata of every file is kept together, so that of
+ * @fd cannot be written on its own.
+ *
+ * Return: -1 if no FS is currently mounted, if file descriptor @fd is invalid,
+ * or in the cases fs_sync() fails. 0 otherwise.
+ */
+int fs_fsync(int fd);
+
 /**
  * fs_info - Display information about file system
  *
@@ -45,6 +143,47 @@ int fs_umount(void);
  */
 int fs_info(void);
 
+/**
+ * Largest number of data blocks a file system can hold. Block sizes below
+ * %BLOCK_SIZE need more FAT and root directory blocks, which lowers it a bit.
+ */
+#define FS_DATA_BLOCKS_MAX 65501
+
+/** Format the disk as it is instead of creating a host image */
+#define FS_MKFS_EXISTING 0x1
+
+/**
+ * fs_mkfs - Create a file system
+ * @diskname: Name of the virtual disk file
+ * @data_blocks: Number of data blocks
+ * @block_size: Block size in bytes, or 0 for %BLOCK_SIZE
+ * @flags: Bitwise OR of FS_MKFS_* options
+ *
+ * Create host image @diskname (replacing any previous file of that name),
+ * sized for @data_blocks data blocks, and write an empty file system into it.
+ * The image is extended sparsely and only the superblock, FAT and root
+ * directory blocks are written, in a single request, so formatting takes the
+ * same time whatever the size.
+ *
+ * @block_size is recorded in the superblock and can be any power of two
+ * between %BLOCK_SIZE_MIN and %BLOCK_SIZE_MAX. Larger blocks mean a smaller
+ * FAT and fewer requests for large files, smaller ones less space lost at
+ * the end of small files. The root directory spans several blocks when they
+ * are smaller than it.
+ *
+ * With %FS_MKFS_EXISTING, @diskname is instead opened as is (it can have a
+ * backend prefix, see block_disk_open()) and formatted in place. @data_blocks
+ * must then match the disk's size, or be 0 to use the whole disk; the data
+ * area is discarded (see block_discard()).
+ *
+ * Return: -1 if @data_blocks, @block_size or @flags is invalid, if the layout
+ * does not fit the format's 16-bit block indices, if a disk is currently open,
+ * or if the disk cannot be created, sized or written. Otherwise the number of
+ * data blocks of the new file system.
+ */
+int fs_mkfs(const char *diskname, size_t data_blocks, size_t block_size,
+	    int flags);
+
 /**
  * fs_create - Create a new file
  * @filename: File name
@@ -65,7 +204,11 @@ int fs_create(const char *filename);
  * @filename: File name
  *
  * Delete the file named @filename from the root directory of the mounted file
- * system.
+ * system. Data blocks the file shares with clones or snapshots (see
+ * fs_clone()) are kept for them. The freed data blocks are only reused, or
+ * discarded when mounted with %FS_MOUNT_DISCARD, once the deletion has been
+ * written by fs_sync(), or by the sync a full disk forces: until then the
+ * image on disk may still refer to them.
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
  * Return: -1 if @filename is invalid, if there is no file named @filename to
@@ -73,6 +216,18 @@ int fs_create(const char *filename);
  */
 int fs_delete(const char *filename);
 
+/**
+ * fs_trim - Discard every free data block
+ *
+ * Hand every free data block of the mounted file system to block_discard(),
+ * one request per contiguous extent, whether or not the file system was
+ * mounted with %FS_MOUNT_DISCARD.
+ *
+ * Return: -1 if no FS is currently mounted or if discarding fails, otherwise
+ * the number of blocks discarded.
+ */
+int fs_trim(void);
+
 /**
  * fs_ls - List files on file system
  *
@@ -82,6 +237,107 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/** Block index of a file that has no data block */
+#define FS_BLOCK_NONE 0xFFFF
+
+/**
+ * struct fs_dirent - Root directory entry as returned by fs_readdir()
+ * @name: NULL-terminated file name
+ * @size: File size in bytes
+ * @first_block: Index of the file's first data block, %FS_BLOCK_NONE if empty
+ * @tail_block: Data block holding the file's packed tail, %FS_BLOCK_NONE if
+ *   it is not packed (see %FS_MOUNT_TAILPACK)
+ * @tail_offset: Byte offset of the packed tail in @tail_block
+ * @compressed: Whether the file's blocks hold its content compressed (see
+ *   fs_compress()), in which case it can only be read with fs_read()
+ * @runs: Number of runs of contiguous data blocks the file's blocks are in,
+ *   1 for a file that is not fragmented (see fs_defrag())
+ */
+struct fs_dirent {
+	char name[FS_FILENAME_LEN];
+	size_t size;
+	uint16_t first_block;
+	uint16_t tail_block;
+	uint16_t tail_offset;
+	int compressed;
+	size_t runs;
+};
+
+/** Opaque directory stream returned by fs_opendir() */
+struct fs_dir;
+
+/**
+ * fs_opendir - Open a directory stream on the root directory
+ * @prefix: Only list files whose name starts with @prefix, or NULL for all
+ *
+ * Open a stream that walks the root directory one file at a time with
+ * fs_readdir(), without any formatting. Files created or deleted while the
+ * stream is open may or may not be returned.
+ *
+ * Return: NULL if no FS is currently mounted, if @prefix is too long, or if the
+ * stream cannot be allocated. Otherwise, return the directory stream.
+ */
+struct fs_dir *fs_opendir(const char *prefix);
+
+/**
+ * fs_readdir - Read the next directory entry
+ * @dir: Directory stream
+ * @entry: Filled with the next matching entry
+ *
+ * Return: -1 if no FS is currently mounted, or if @dir or @entry is NULL. 0 if
+ * the end of the directory was reached. 1 if @entry was filled.
+ */
+int fs_readdir(struct fs_dir *dir, struct fs_dirent *entry);
+
+/**
+ * fs_closedir - Close a directory stream
+ * @dir: Directory stream
+ *
+ * Return: -1 if @dir is NULL. 0 otherwise.
+ */
+int fs_closedir(struct fs_dir *dir);
+
+/**
+ * fs_map - Get the data blocks of a file
+ * @filename: File name
+ * @blocks: Filled with the data block index of each block of the file
+ * @count: Number of entries @blocks can hold
+ *
+ * Fill @blocks with the index of the data block holding each successive block
+ * (see fs_block_size()) of file @filename, in file order. Only the blocks covering
+ * the file's size are reported, not blocks reserved beyond it. The packed tail
+ * of a file is not one of its blocks either (see struct fs_dirent).
+ *
+ * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
+ * there is no file named @filename, or if the file is compressed, as its blocks
+ * do not hold its content as is. Otherwise, return the number of data blocks
+ * the file spans, which can be larger than @count, in which case only the first
+ * @count entries of @blocks are filled.
+ */
+int fs_map(const char *filename, uint16_t *blocks, size_t count);
+
+/**
+ * fs_read_block - Read a data block
+ * @block: Data block index, as reported by fs_map()
+ * @buf: Data buffer of at least one block (see fs_block_size())
+ *
+ * Read data block @block of the mounted file system into @buf. Together with
+ * fs_map(), this lets a caller read many files in an order of its choosing,
+ * e.g. sorted by block.
+ *
+ * Return: -1 if no FS is currently mounted, or if @block is out of bounds, or
+ * if the block cannot be read. 0 otherwise.
+ */
+int fs_read_block(uint16_t block, void *buf);
+
+/**
+ * fs_block_size - Get the block size of the mounted file system
+ *
+ * Return: -1 if no FS is currently mounted, otherwise the size in bytes of its
+ * blocks, as chosen when it was created with fs_mkfs().
+ */
+int fs_block_size(void);
+
 /**
  * fs_open - Open a file
  * @filename: File name
@@ -133,12 +389,32 @@ int fs_stat(int fd);
  * descriptor @fd to the argument @offset. To append to a file, one can call
  * fs_lseek(fd, fs_stat(fd));
  *
+ * Every descriptor keeps the blocks of its file's chain as it goes through
+ * them, so that reading or writing at an offset seen before takes no walk of
+ * the FAT. Moving, sharing or freeing blocks of any file drops those lists.
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (i.e., out of bounds, or not currently open), or if @offset is larger
  * than the current file size. 0 otherwise.
  */
 int fs_lseek(int fd, size_t offset);
 
+/**
+ * fs_reserve - Preallocate data blocks for a file
+ * @fd: File descriptor
+ * @size: Number of bytes the file should have room for
+ *
+ * Extend the chain of data blocks of the file referenced by file descriptor
+ * @fd so that it can hold @size bytes, without changing the file's size. The
+ * new blocks are taken as one contiguous run when the disk has one. Later
+ * calls to fs_write() fill the reserved blocks before allocating new ones.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if the disk does not have
+ * enough free blocks. 0 otherwise.
+ */
+int fs_reserve(int fd, size_t size);
+
 /**
  * fs_write - Write to a file
  * @fd: File descriptor
@@ -182,4 +458,454 @@ int fs_write(int fd, void *buf, size_t count);
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/** No particular access pattern, the default (see fs_advise()) */
+#define FS_ADVICE_NORMAL 0
+
+/** Reads go forward through the file (see fs_advise()) */
+#define FS_ADVICE_SEQUENTIAL 1
+
+/** Reads go anywhere in the file (see fs_advise()) */
+#define FS_ADVICE_RANDOM 2
+
+/** What is read is not read again (see fs_advise()) */
+#define FS_ADVICE_NOREUSE 3
+
+/** A range is about to be read (see fs_advise()) */
+#define FS_ADVICE_WILLNEED 4
+
+/** A range is not going to be read any time soon (see fs_advise()) */
+#define FS_ADVICE_DONTNEED 5
+
+/**
+ * fs_advise - Tell how a file is going to be read
+ * @fd: File descriptor
+ * @offset: Offset of the range @advice is about
+ * @len: Length of the range, 0 for up to the end of the file
+ * @advice: One of the FS_ADVICE_* values
+ *
+ * fs_read() keeps the blocks it reads in a block cache shared by every file,
+ * and reads ahead of a descriptor going through its file in order. Which
+ * blocks are cached and how far ahead it reads follows the advice given for
+ * the descriptor:
+ * - %FS_ADVICE_NORMAL: read ahead a little once reads follow each other
+ * - %FS_ADVICE_SEQUENTIAL: read ahead further, from the first read on
+ * - %FS_ADVICE_RANDOM: never read ahead
+ * - %FS_ADVICE_NOREUSE: read ahead like %FS_ADVICE_SEQUENTIAL, but keep
+ *   nothing read in the cache, e.g. for a scan that would otherwise evict
+ *   the blocks other readers use
+ *
+ * These four apply to the whole file, from the next fs_read() on, until
+ * another one is given or @fd is closed. The other two act on the range
+ * right away, and leave the access pattern of @fd as it was:
+ * - %FS_ADVICE_WILLNEED: read the blocks of the range into the cache
+ * - %FS_ADVICE_DONTNEED: evict the blocks of the range from the cache
+ *
+ * Compressed files are read through a cache of their own, which no advice
+ * changes.
+ *
+ * Return: -1 if no FS is currently mounted, if file descriptor @fd is invalid,
+ * if @advice is unknown, or if the blocks of a %FS_ADVICE_WILLNEED range
+ * cannot be read. 0 otherwise.
+ */
+int fs_advise(int fd, size_t offset, size_t len, int advice);
+
+/**
+ * fs_copy_file_range - Copy data between files
+ * @fd_in: File descriptor to copy from
+ * @off_in: Offset in @fd_in to start copying from
+ * @fd_out: File descriptor to copy to
+ * @off_out: Offset in @fd_out to start copying to
+ * @len: Number of bytes to copy
+ *
+ * Copy @len bytes at offset @off_in of the file referenced by @fd_in to offset
+ * @off_out of the file referenced by @fd_out, extending it if needed. The file
+ * offsets of both file descriptors are left untouched.
+ *
+ * Parts where both offsets are block-aligned are copied block to block inside
+ * the virtual disk, one request per run of blocks that is contiguous in both
+ * files. Only the unaligned edges go through the byte-level paths.
+ *
+ * Return: -1 if no FS is currently mounted, or if a file descriptor is
+ * invalid, or if @off_out is past the end of @fd_out, or if both ranges are in
+ * the same file and overlap, or if nothing could be copied. Otherwise return
+ * the number of bytes copied, which can be smaller than @len if the source
+ * file ends first or the disk runs full.
+ */
+int fs_copy_file_range(int fd_in, size_t off_in, int fd_out, size_t off_out,
+		       size_t len);
+
+/**
+ * fs_import_range - Copy data from a host file
+ * @host_fd: Host file descriptor to copy from
+ * @host_off: Offset in @host_fd to start copying from
+ * @fd_out: File descriptor to copy to
+ * @off_out: Offset in @fd_out to start copying to
+ * @len: Number of bytes to copy
+ *
+ * Same as fs_copy_file_range(), with a host file as the source. Whole blocks
+ * are handed to block_copy_from_fd(), so that with a host image file the host
+ * kernel copies them straight from @host_fd (see copy_file_range(2)).
+ *
+ * Return: -1 if no FS is currently mounted, or if @fd_out is invalid, or if
+ * @off_out is past the end of @fd_out, or if nothing could be copied.
+ * Otherwise return the number of bytes copied.
+ */
+int fs_import_range(int host_fd, off_t host_off, int fd_out, size_t off_out,
+		    size_t len);
+
+/**
+ * fs_dedup - Deduplicate the data blocks of every file
+ *
+ * Read every data block of the mounted file system, and let the files share
+ * the blocks that hold identical bytes, as if they were clones (see
+ * fs_clone()). A chain of blocks can only share its end with other chains,
+ * so a block is only shared along with the blocks after it: files with
+ * identical content are merged entirely, files with identical ends partly.
+ * Blocks are told apart by a hash of their content, and compared before being
+ * shared.
+ *
+ * Return: -1 if no FS is currently mounted, or if the blocks cannot be read or
+ * indexed. Otherwise, return the number of blocks freed.
+ */
+int fs_dedup(void);
+
+/**
+ * fs_defrag - Defragment the files
+ * @budget: Most data blocks to move, or SIZE_MAX for no limit
+ *
+ * Blocks are allocated one at a time from the first free one, so that files
+ * written alongside others, or after deletions, end up in many runs of
+ * contiguous blocks (see &struct fs_dirent), which are read with as many
+ * requests. Move the blocks of the most fragmented files into the first free
+ * run that holds them all, or else into the fewest longest free runs there
+ * are, when that makes fewer runs. Each block moved is read and written
+ * once, and a file is only moved if its blocks all fit in what is left of
+ * @budget, so that a pass can be bounded. Blocks shared with clones or
+ * snapshots (see fs_clone()) are left in place.
+ *
+ * Return: -1 if no FS is currently mounted, or if a file cannot be moved.
+ * Otherwise, return the number of blocks moved.
+ */
+int fs_defrag(size_t budget);
+
+/**
+ * fs_compress - Set whether a file is kept compressed
+ * @filename: File name
+ * @enable: Non-zero to compress the file, 0 to stop compressing it
+ *
+ * Flag file @filename, persistently, for compression. Flagged files are
+ * compressed when closed on a file system mounted with %FS_MOUNT_COMPRESS, and
+ * right away when not open on one. Each block is compressed separately with a built-in
+ * LZ4-style codec, and the compressed blocks are stored back to back behind a
+ * map of where each one ends, so that several of them share a physical
+ * block. fs_read() decompresses the blocks it needs into a small cache. Blocks
+ * that do not shrink are stored as they are, and files that would not take
+ * fewer blocks are not compressed at all.
+ *
+ * Writing to a compressed file first decompresses it entirely, so that it is
+ * modified in place as any other file; it is compressed again when closed.
+ * Clearing the flag decompresses the file right away.
+ *
+ * Return: -1 if no FS is currently mounted, if @filename is invalid, if there
+ * is no file named @filename, or if the file cannot be decompressed. 0
+ * otherwise.
+ */
+int fs_compress(const char *filename, int enable);
+
+/**
+ * fs_clone - Create a copy-on-write copy of a file
+ * @src: Name of the file to copy
+ * @dst: Name of the new file
+ *
+ * Create file @dst with the same content as file @src, without copying any
+ * data: both files share the data blocks (and packed tail) of @src. Writing to
+ * either file first gives it copies of the blocks involved. Since a chain of
+ * blocks can only share its end with others, that copies every block from
+ * the start of the write back to the first shared block, usually the first
+ * block of the file; the blocks after the write stay shared.
+ *
+ * Return: -1 if no FS is currently mounted, if there is no file named @src,
+ * or in the cases fs_create() fails for @dst. 0 otherwise.
+ */
+int fs_clone(const char *src, const char *dst);
+
+/** Maximum number of snapshots a file system keeps */
+#define FS_SNAPSHOT_MAX 16
+
+/**
+ * fs_snapshot - Take a snapshot of the file system
+ * @name: Snapshot name, at most %FS_FILENAME_LEN characters including the NULL
+ *   character
+ *
+ * Save the current root directory as snapshot @name. Like fs_clone() does for
+ * one file, every file of the snapshot shares the blocks of the live one it
+ * was taken from, so that taking a snapshot only writes a copy of the root
+ * directory. The blocks of files later modified or deleted stay allocated
+ * for as long as a snapshot uses them.
+ *
+ * Return: -1 if no FS is currently mounted, if @name is invalid or already in
+ * use, if there are already %FS_SNAPSHOT_MAX snapshots, or if the root
+ * directory cannot be saved. 0 otherwise.
+ */
+int fs_snapshot(const char *name);
+
+/**
+ * fs_snapshot_restore - Bring the file system back to a snapshot
+ * @name: Snapshot name
+ *
+ * Replace every file of the file system with the files of snapshot @name, as
+ * they were when it was taken. The snapshot itself is kept, and can be
+ * restored again later.
+ *
+ * Return: -1 if no FS is currently mounted, if there is no snapshot named
+ * @name, if files are currently open, or if the root directory cannot be
+ * written. 0 otherwise.
+ */
+int fs_snapshot_restore(const char *name);
+
+/**
+ * fs_snapshot_delete - Delete a snapshot
+ * @name: Snapshot name
+ *
+ * Delete snapshot @name, freeing the blocks that only its files used.
+ *
+ * Return: -1 if no FS is currently mounted, or if there is no snapshot named
+ * @name. 0 otherwise.
+ */
+int fs_snapshot_delete(const char *name);
+
+/**
+ * fs_snapshot_list - Get the names of the snapshots
+ * @names: Filled with the NULL-terminated name of each snapshot
+ * @count: Number of names @names can hold
+ *
+ * Return: -1 if no FS is currently mounted. Otherwise, return the number of
+ * snapshots, which can be larger than @count, in which case only the first
+ * @count names are filled.
+ */
+int fs_snapshot_list(char (*names)[FS_FILENAME_LEN], int count);
+
+/** Write the fixes to the disk (see fs_fsck()) */
+#define FS_FSCK_REPAIR 0x1
+
+/**
+ * struct fs_fsck_report - What fs_fsck() found
+ *
+ * Every problem counted is fixed the same way whether or not the fixes are
+ * written, so that one problem is counted once and not again through the
+ * ones it causes.
+ */
+struct fs_fsck_report {
+	size_t files;			// Files, live or in a snapshot
+	size_t used_blocks;		// Data blocks in use, once fixed
+	size_t shared_blocks;	// Data blocks rightfully used by several files or snapshots
+	size_t bad_fat_entries;	// FAT entries pointing past the data blocks, made to end their chain
+	size_t bad_snapshots;	// Snapshots whose root directory cannot be read, dropped
+	size_t bad_entries;		// Files starting past the data blocks, emptied
+	size_t broken_chains;	// Chains running into a free block, cut before it
+	size_t cycles;			// Chains looping back onto themselves, cut where they do
+	size_t bad_sizes;		// Files larger than their chain, truncated to it
+	size_t bad_tails;		// Packed tails in a chain's block or over another, dropped
+	size_t leaked_blocks;	// Blocks in use but part of nothing, freed
+	size_t bad_summary;		// Clean unmount summary not matching the FAT, rewritten
+	int repaired;			// Whether the fixes were written
+};
+
+/**
+ * fs_fsck - Check a file system
+ * @diskname: Name of the virtual disk file
+ * @flags: Bitwise OR of FS_FSCK_* options
+ * @nthreads: Number of threads to walk the chains with, or 0 for one per CPU
+ * @report: Filled with what was found
+ *
+ * Check the file system in virtual disk file @diskname, which must not be
+ * mounted, beyond what fs_mount() does: that every chain of data blocks,
+ * of a file (live or in a snapshot) or of a snapshot's root directory, ends
+ * without running into a free block or looping, that it has enough blocks
+ * for the file's size (it may have more, reserved with fs_reserve()), that
+ * packed tails neither sit in a chain's block nor overlap, and that every
+ * block in use is part of something. Chains may rightfully share blocks,
+ * those of clones and snapshots do.
+ *
+ * The chains are walked in parallel by @nthreads threads, which mark the
+ * blocks they reach in a shared bitset: each block is followed once, however
+ * many files share it, and the whole check takes a few milliseconds even on
+ * the largest file systems.
+ *
+ * With %FS_FSCK_REPAIR, the fixes described in &struct fs_fsck_report are
+ * written back, after which the file system can be mounted.
+ *
+ * Return: -1 if a file system is currently mounted, if @flags or @report is
+ * invalid, in the cases fs_mount() fails on the superblock, or if the fixes
+ * cannot be written. Otherwise, return the number of problems found (0 for a
+ * sound file system).
+ */
+int fs_fsck(const char *diskname, int flags, int nthreads, struct fs_fsck_report *report);
+
+/** Maximum number of asynchronous requests in flight */
+#define FS_ASYNC_MAX_COUNT 64
+
+/** Maximum number of asynchronous worker threads */
+#define FS_ASYNC_MAX_THREADS 16
+
+/**
+ * fs_async_cb_t - Asynchronous completion callback
+ * @req: Request handle returned at submission
+ * @ret: Return value of the underlying fs_read() or fs_write()
+ * @arg: Opaque argument given at submission
+ *
+ * Called from a worker thread once request @req has completed. The request
+ * handle is released as soon as the callback returns.
+ */
+typedef void (*fs_async_cb_t)(int req, int ret, void *arg);
+
+/**
+ * fs_async_init - Start the asynchronous I/O workers
+ * @nthreads: Number of worker threads
+ *
+ * Spawn @nthreads worker threads that carry out requests submitted with
+ * fs_read_async() and fs_write_async(). Requests targeting the same file
+ * descriptor are always performed in submission order, requests on different
+ * file descriptors may complete in any order.
+ *
+ * Each worker holds the global library lock for the whole of its fs_read()
+ * or fs_write(), like any other caller, so requests never run in parallel
+ * inside the library: @nthreads > 1 only lets callbacks run beside the next
+ * request.
+ *
+ * Return: -1 if the workers are already running, or if @nthreads is not in
+ * [1, %FS_ASYNC_MAX_THREADS], or if the threads cannot be created. 0 otherwise.
+ */
+int fs_async_init(int nthreads);
+
+/**
+ * fs_async_exit - Stop the asynchronous I/O workers
+ *
+ * Wait for every submitted request to complete, then join the worker threads.
+ * Completions that were never reaped are discarded.
+ *
+ * Return: -1 if the workers are not running. 0 otherwise.
+ */
+int fs_async_exit(void);
+
+/**
+ * fs_read_async - Submit an asynchronous read
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @cb: Completion callback, or NULL
+ * @arg: Opaque argument passed to @cb
+ *
+ * Queue a fs_read() of @count bytes from @fd into @buf and return without
+ * waiting for it. @buf must stay valid until the request completes. If @cb is
+ * NULL, the completion is instead queued for fs_async_poll() or
+ * fs_async_wait().
+ *
+ * Return: -1 if the workers are not running, or if @buf is NULL, or if there
+ * are already %FS_ASYNC_MAX_COUNT requests in flight. Otherwise, return the
+ * request handle.
+ */
+int fs_read_async(int fd, void *buf, size_t count, fs_async_cb_t cb, void *arg);
+
+/**
+ * fs_write_async - Submit an asynchronous write
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @cb: Completion callback, or NULL
+ * @arg: Opaque argument passed to @cb
+ *
+ * Same as fs_read_async(), but queue a fs_write() of @count bytes from @buf.
+ *
+ * Return: -1 if the workers are not running, or if @buf is NULL, or if there
+ * are already %FS_ASYNC_MAX_COUNT requests in flight. Otherwise, return the
+ * request handle.
+ */
+int fs_write_async(int fd, void *buf, size_t count, fs_async_cb_t cb,
+		   void *arg);
+
+/**
+ * fs_async_poll - Reap a completed request
+ * @req: Filled with the handle of the completed request
+ * @ret: Filled with the request's return value
+ *
+ * Reap the oldest completed request that was submitted without a callback.
+ * Never blocks.
+ *
+ * Return: -1 if the workers are not running, or if no completion is pending.
+ * 0 otherwise.
+ */
+int fs_async_poll(int *req, int *ret);
+
+/**
+ * fs_async_wait - Wait for a request to complete
+ * @req: Request handle
+ *
+ * Block until request @req, submitted without a callback, has completed and
+ * reap it.
+ *
+ * Return: -1 if the workers are not running, or if @req is not a pending
+ * request submitted without a callback, or if fs_async_exit() is called
+ * before the request completes. Otherwise, return the request's return
+ * value (which can itself be -1).
+ */
+int fs_async_wait(int req);
+
+/**
+ * fs_async_fd - Get the completion notification descriptor
+ *
+ * Return a host file descriptor that polls readable while completions are
+ * waiting to be reaped with fs_async_poll(), so that the completion queue can
+ * be plugged into an event loop.
+ *
+ * Return: -1 if the workers are not running. Otherwise, return the descriptor.
+ */
+int fs_async_fd(void);
+
+/**
+ * struct fs_flusher_params - Thresholds of the background flusher
+ * @interval_ms: Time between two passes of the flusher
+ * @dirty_age_ms: Blocks dirty for that long are written back at the next pass
+ * @dirty_ratio: Percentage of the block cache left dirty after a pass, the
+ *   oldest blocks beyond it are written back
+ * @dirty_max_ratio: Percentage of the block cache that can be dirty at all,
+ *   writers that would go past it write the oldest blocks back themselves
+ * @commit_ms: Time between two fs_sync() calls of the flusher, 0 for none
+ */
+struct fs_flusher_params {
+	unsigned int interval_ms;
+	unsigned int dirty_age_ms;
+	unsigned int dirty_ratio;
+	unsigned int dirty_max_ratio;
+	unsigned int commit_ms;
+};
+
+/**
+ * fs_flusher_start - Start the background flusher
+ * @params: Thresholds, or NULL for the defaults (a pass every 100 ms, blocks
+ *   dirty for 1 s, 10% and 40% of the cache, a commit every 5 s)
+ *
+ * Switch the block cache of the mounted file system to write-back mode, so
+ * that fs_write() returns once the data is in memory, and spawn a thread that
+ * writes the dirty blocks back to the disk as they age or pile up. Metadata
+ * is only written by the commits, through fs_sync(); data written back in
+ * between is not flushed, so fs_sync() is still what makes anything durable.
+ *
+ * Return: -1 if the flusher is already running, if no FS is currently
+ * mounted, if @params are out of range, or if the thread cannot be created.
+ * 0 otherwise.
+ */
+int fs_flusher_start(const struct fs_flusher_params *params);
+
+/**
+ * fs_flusher_stop - Stop the background flusher
+ *
+ * Join the flusher thread, then write every dirty block back and go back to
+ * writing through. Does not flush.
+ *
+ * Return: -1 if the flusher is not running, or if the dirty blocks cannot be
+ * written back. 0 otherwise.
+ */
+int fs_flusher_stop(void);
+
 #endif /* _FS_H */
@@ -0,0 +1,179 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define MIN_MATCH 4
+#define HASH_BITS 12
+
+/* Matches stop this far from the end, the rest always goes as literals */
+#define END_LITERALS 5
+
+static uint32_t read32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static size_t hash4(const unsigned char *p)
+{
+	return (read32(p) * 2654435761U) >> (32 - HASH_BITS);
+}
+
+/* Write @n as the 255-byte continuation of a nibble that was 15 */
+static unsigned char *put_length(unsigned char *op, const unsigned char *oend,
+				 size_t n)
+{
+	for (; n >= 255; n -= 255) {
+		if (op >= oend) {
+			return NULL;
+		}
+		*op++ = 255;
+	}
+	if (op >= oend) {
+		return NULL;
+	}
+	*op++ = n;
+	return op;
+}
+
+/* Emit one sequence: @nlit literals at @lit, then a match unless @mlen is 0 */
+static unsigned char *put_sequence(unsigned char *op, const unsigned char *oend,
+				   const unsigned char *lit, size_t nlit,
+				   size_t offset, size_t mlen)
+{
+	size_t ml = mlen ? mlen - MIN_MATCH : 0;
+	unsigned char *token = op++;
+
+	if (op > oend) {
+		return NULL;
+	}
+	*token = (nlit < 15 ? nlit : 15) << 4 | (ml < 15 ? ml : 15);
+	if (nlit >= 15 && (op = put_length(op, oend, nlit - 15)) == NULL) {
+		return NULL;
+	}
+	if ((size_t)(oend - op) < nlit) {
+		return NULL;
+	}
+	memcpy(op, lit, nlit);
+	op += nlit;
+
+	if (mlen) {
+		if (oend - op < 2) {
+			return NULL;
+		}
+		*op++ = offset & 0xFF;
+		*op++ = offset >> 8;
+		if (ml >= 15 && (op = put_length(op, oend, ml - 15)) == NULL) {
+			return NULL;
+		}
+	}
+	return op;
+}
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap)
+{
+	const unsigned char *base = src, *ip = base, *anchor = base;
+	const unsigned char *iend = base + len;
+	unsigned char *op = dst, *oend = op + cap;
+	uint32_t table[1 << HASH_BITS];
+
+	if (len > LZ_MAX_INPUT) {
+		return 0;
+	}
+	memset(table, 0, sizeof(table));
+
+	if (len > END_LITERALS + MIN_MATCH) {
+		const unsigned char *limit = iend - END_LITERALS - MIN_MATCH;
+
+		/* Positions are stored plus one, so 0 means empty */
+		while (ip < limit) {
+			size_t h = hash4(ip);
+			uint32_t pos = table[h];
+			table[h] = ip - base + 1;
+
+			const unsigned char *ref = base + pos - 1;
+			if (pos == 0 || ip - ref > 0xFFFF || read32(ref) != read32(ip)) {
+				ip++;
+				continue;
+			}
+
+			size_t mlen = MIN_MATCH;
+			while (ip + mlen < iend - END_LITERALS && ref[mlen] == ip[mlen]) {
+				mlen++;
+			}
+			op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, mlen);
+			if (op == NULL) {
+				return 0;
+			}
+			ip += mlen;
+			anchor = ip;
+		}
+	}
+
+	op = put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+	return op ? (size_t)(op - (unsigned char *)dst) : 0;
+}
+
+/* Read the 255-byte continuation of a nibble that was 15 */
+static const unsigned char *get_length(const unsigned char *ip,
+				       const unsigned char *iend, size_t *n)
+{
+	unsigned char b;
+	do {
+		if (ip >= iend) {
+			return NULL;
+		}
+		b = *ip++;
+		*n += b;
+	} while (b == 255);
+	return ip;
+}
+
+long lz_decompress(const void *src, size_t len, void *dst, size_t cap)
+{
+	const unsigned char *ip = src, *iend = ip + len;
+	unsigned char *base = dst, *op = base, *oend = base + cap;
+
+	while (ip < iend) {
+		unsigned token = *ip++;
+		size_t nlit = token >> 4;
+		if (nlit == 15 && (ip = get_length(ip, iend, &nlit)) == NULL) {
+			return -1;
+		}
+		if ((size_t)(iend - ip) < nlit || (size_t)(oend - op) < nlit) {
+			return -1;
+		}
+		memcpy(op, ip, nlit);
+		op += nlit;
+		ip += nlit;
+
+		/* The last sequence has no match */
+		if (ip == iend) {
+			break;
+		}
+		if (iend - ip < 2) {
+			return -1;
+		}
+		size_t offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		size_t mlen = token & 15;
+		if (mlen == 15 && (ip = get_length(ip, iend, &mlen)) == NULL) {
+			return -1;
+		}
+		mlen += MIN_MATCH;
+		if (offset == 0 || offset > (size_t)(op - base) ||
+		    (size_t)(oend - op) < mlen) {
+			return -1;
+		}
+
+		/* Byte by byte: the match may overlap what it produces */
+		const unsigned char *ref = op - offset;
+		while (mlen--) {
+			*op++ = *ref++;
+		}
+	}
+
+	return op - base;
+}
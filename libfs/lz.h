@@ -0,0 +1,42 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+#include <stddef.h> /* for size_t definition */
+
+/*
+ * LZ4-style block codec: a sequence is a token byte (literal count in the
+ * high nibble, match length minus 4 in the low one, 15 meaning that extra
+ * bytes follow), the literals, then a 2-byte little-endian match offset. The
+ * last sequence has literals only. Fast rather than tight, self-contained.
+ */
+
+/** Largest input lz_compress() takes */
+#define LZ_MAX_INPUT 65536
+
+/**
+ * lz_compress - Compress a buffer
+ * @src: Data to compress
+ * @len: Size of @src in bytes, at most %LZ_MAX_INPUT
+ * @dst: Filled with the compressed data
+ * @cap: Size of @dst in bytes
+ *
+ * Return: the compressed size, or 0 if it would not fit in @cap bytes.
+ */
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap);
+
+/**
+ * lz_decompress - Decompress a buffer
+ * @src: Data written by lz_compress()
+ * @len: Size of @src in bytes
+ * @dst: Filled with the decompressed data
+ * @cap: Size of @dst in bytes
+ *
+ * Damaged input is detected rather than trusted: nothing is ever read or
+ * written out of bounds.
+ *
+ * Return: the decompressed size, or -1 if @src is not valid or does not fit
+ * in @cap bytes.
+ */
+long lz_decompress(const void *src, size_t len, void *dst, size_t cap);
+
+#endif /* _LZ_H */
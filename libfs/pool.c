@@ -0,0 +1,63 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+int pool_init(struct bufPool *pool, int numSlabs, size_t slabSize)
+{
+	memset(pool, 0, sizeof(*pool));
+
+	if (posix_memalign(&pool->arena, slabSize, numSlabs * slabSize)) {
+		pool->arena = NULL;
+		return -1;
+	}
+
+	pool->freeSlabs = malloc(numSlabs * sizeof(void *));
+	if (pool->freeSlabs == NULL) {
+		free(pool->arena);
+		pool->arena = NULL;
+		return -1;
+	}
+
+	for (int i = 0; i < numSlabs; i++) {
+		pool->freeSlabs[i] = (char *)pool->arena + i * slabSize;
+	}
+	pool->numFree = numSlabs;
+	pool->numSlabs = numSlabs;
+	pool->slabSize = slabSize;
+
+	return 0;
+}
+
+void pool_destroy(struct bufPool *pool)
+{
+	free(pool->freeSlabs);
+	free(pool->arena);
+	memset(pool, 0, sizeof(*pool));
+}
+
+void *pool_get(struct bufPool *pool)
+{
+	if (pool->numFree == 0) {
+		return NULL;
+	}
+
+	void *slab = pool->freeSlabs[--pool->numFree];
+	if (pool_used(pool) > pool->peakUsed) {
+		pool->peakUsed = pool_used(pool);
+	}
+	return slab;
+}
+
+void pool_put(struct bufPool *pool, void *slab)
+{
+	if (slab == NULL) {
+		return;
+	}
+	pool->freeSlabs[pool->numFree++] = slab;
+}
+
+int pool_used(const struct bufPool *pool)
+{
+	return pool->numSlabs - pool->numFree;
+}
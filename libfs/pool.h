@@ -0,0 +1,61 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <stddef.h> /* for size_t definition */
+
+/**
+ * struct bufPool - Fixed-size pool of aligned buffers
+ *
+ * All slabs are carved out of a single aligned arena allocated up front, so
+ * the pool's memory use is bounded by @numSlabs * @slabSize for its whole
+ * lifetime. The pool itself does no locking: it is only ever used under the
+ * library lock.
+ */
+struct bufPool {
+	void *arena;		// Backing memory for every slab
+	void **freeSlabs;	// Stack of slabs available for handing out
+	int numFree;
+	int numSlabs;
+	int peakUsed;		// High-water mark of slabs handed out at once
+	size_t slabSize;
+};
+
+/**
+ * pool_init - Allocate a buffer pool
+ * @pool: Pool to initialize
+ * @numSlabs: Number of slabs in the pool
+ * @slabSize: Size in bytes of each slab, also used as their alignment
+ *
+ * Return: -1 if the arena cannot be allocated. 0 otherwise.
+ */
+int pool_init(struct bufPool *pool, int numSlabs, size_t slabSize);
+
+/**
+ * pool_destroy - Release a buffer pool and its arena
+ * @pool: Pool to release
+ */
+void pool_destroy(struct bufPool *pool);
+
+/**
+ * pool_get - Take a slab out of the pool
+ * @pool: Pool to take from
+ *
+ * Return: NULL if every slab is currently in use. Otherwise a slab of
+ * @pool->slabSize bytes.
+ */
+void *pool_get(struct bufPool *pool);
+
+/**
+ * pool_put - Give a slab back to the pool
+ * @pool: Pool the slab was taken from
+ * @slab: Slab returned by pool_get(), or NULL
+ */
+void pool_put(struct bufPool *pool, void *slab);
+
+/**
+ * pool_used - Number of slabs currently handed out
+ * @pool: Pool to inspect
+ */
+int pool_used(const struct bufPool *pool);
+
+#endif /* _POOL_H */